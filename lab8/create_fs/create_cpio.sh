@@ -1,5 +1,8 @@
 #!/bin/sh
 
+# Build the user benchmarks and copy them into rootfs
+make -C user_bench install
+
 # Go to rootfs folder
 # Select all files and put into archives
 # '-o, --create' Run in copy-out mode
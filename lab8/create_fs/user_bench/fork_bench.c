@@ -0,0 +1,52 @@
+// fork latency as the parent sees it, for a growing number of touched pages
+#include "ulib.h"
+
+#define FORK_ITERATIONS 64
+#define HEAP_BASE       ((char *)0x10000000)
+
+static unsigned long fork_ticks()
+{
+    unsigned long total = 0;
+    for (int i = 0; i < FORK_ITERATIONS; i++)
+    {
+        unsigned long t0 = read_cntpct();
+        int pid = fork();
+        if (pid == 0) exit(0);
+        total += read_cntpct() - t0;
+    }
+    return total / FORK_ITERATIONS;
+}
+
+int main()
+{
+    static const unsigned long heap_kb[] = {0, 64, 256, 1024};
+    unsigned long freq = read_cntfrq();
+    unsigned long mapped = 0;
+
+    print_str("fork_bench: pid ");
+    print_dec(getpid());
+    print_str(", ");
+    print_dec(FORK_ITERATIONS);
+    print_str(" forks per row\r\n");
+    print_str("heap(KB)\tticks/fork\tns/fork\r\n");
+    for (int r = 0; r < sizeof(heap_kb) / sizeof(heap_kb[0]); r++)
+    {
+        // grow the touched heap, every page becomes one more frame to share
+        unsigned long want = heap_kb[r] * 1024;
+        if (want > mapped)
+        {
+            char *p = mmap(HEAP_BASE + mapped, want - mapped, PROT_READ | PROT_WRITE);
+            for (unsigned long off = 0; off < want - mapped; off += PAGESIZE)
+                p[off] = 1;
+            mapped = want;
+        }
+        unsigned long ticks = fork_ticks();
+        print_dec(heap_kb[r]);
+        print_str("\t\t");
+        print_dec(ticks);
+        print_str("\t\t");
+        print_dec(ticks * 1000000000UL / freq);
+        print_str("\r\n");
+    }
+    return 0;
+}
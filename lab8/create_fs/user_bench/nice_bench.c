@@ -0,0 +1,65 @@
+// CPU share by nice value: spinners at nice 0 and nice 10 compete for the same cores,
+// a nice 0 spinner should get about 1024 / 110 times the loops of a nice 10 one
+#include "ulib.h"
+
+#define NICE_SPINNERS 4   // of each nice value
+#define NICE_HIGH     10
+#define SPIN_MS       2000
+
+static char *append_str(char *p, const char *s)
+{
+    while (*s) *p++ = *s++;
+    return p;
+}
+
+static char *append_dec(char *p, unsigned long n)
+{
+    char buf[21];
+    int i = sizeof(buf);
+    do {
+        buf[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    while (i < sizeof(buf)) *p++ = buf[i++];
+    return p;
+}
+
+static void spin(int inc, unsigned long start, unsigned long ticks)
+{
+    int n = nice(inc);
+    unsigned long loops = 0;
+    while (read_cntpct() - start < ticks)
+        loops++;
+
+    // one write per line so the spinners do not interleave
+    char line[64];
+    char *p = append_str(line, "pid ");
+    p = append_dec(p, getpid());
+    p = append_str(p, " nice ");
+    p = append_dec(p, n);
+    p = append_str(p, ": ");
+    p = append_dec(p, loops);
+    p = append_str(p, " loops\r\n");
+    *p = '\0';
+    print_str(line);
+    exit(0);
+}
+
+int main()
+{
+    unsigned long ticks = read_cntfrq() * SPIN_MS / 1000;
+    unsigned long start = read_cntpct();
+
+    print_str("nice_bench: ");
+    print_dec(NICE_SPINNERS);
+    print_str(" spinners at nice 0 and ");
+    print_dec(NICE_SPINNERS);
+    print_str(" at nice 10 for ");
+    print_dec(SPIN_MS);
+    print_str(" ms\r\n");
+    for (int i = 0; i < 2 * NICE_SPINNERS; i++)
+    {
+        if (fork() == 0) spin(i % 2 ? NICE_HIGH : 0, start, ticks);
+    }
+    return 0;
+}
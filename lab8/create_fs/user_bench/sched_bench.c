@@ -0,0 +1,84 @@
+// scheduler scaling: N CPU-bound children each do the same fixed work, the parent reports how
+// much of it got done per second. With per-core run queues N up to the number of cores should
+// scale almost linearly, beyond that throughput should stay flat.
+// There is no wait(): every child marks its byte in DONE_FILE when it is finished and the parent
+// polls the file, sleeping POLL_MS in between so it takes no CPU time from them.
+#include "ulib.h"
+
+#define WORK_LOOPS   (1UL << 25)  // per child
+#define MAX_CHILDREN 8
+#define DONE_FILE    "/sched_bench_done"
+#define POLL_MS      1
+
+static void done_reset()
+{
+    char zero[MAX_CHILDREN] = {0};
+    int fd = open(DONE_FILE, O_CREAT);
+    write(fd, zero, sizeof(zero));
+    close(fd);
+}
+
+static int done_count(int n)
+{
+    char done[MAX_CHILDREN];
+    int fd = open(DONE_FILE, 0);
+    read(fd, done, n);
+    close(fd);
+    int count = 0;
+    for (int i = 0; i < n; i++)
+        count += done[i];
+    return count;
+}
+
+static void worker(int idx)
+{
+    volatile unsigned long sum = 0;
+    for (unsigned long i = 0; i < WORK_LOOPS; i++)
+        sum += i;
+
+    char one = 1;
+    int fd = open(DONE_FILE, 0);
+    lseek64(fd, idx, SEEK_SET);
+    write(fd, &one, 1);
+    close(fd);
+    exit(0);
+}
+
+int main()
+{
+    static const int children[] = {1, 2, 3, 4, 8};
+    unsigned long freq = read_cntfrq();
+    unsigned long one = 0;
+
+    print_str("sched_bench: ");
+    print_dec(WORK_LOOPS);
+    print_str(" loops per child\r\n");
+    print_str("children\tms\tMloops/s\tspeedup(%)\r\n");
+    for (int r = 0; r < sizeof(children) / sizeof(children[0]); r++)
+    {
+        int n = children[r];
+        done_reset();
+        unsigned long t0 = read_cntpct();
+        for (int i = 0; i < n; i++)
+        {
+            if (fork() == 0) worker(i);
+        }
+        struct timespec poll = {0, POLL_MS * 1000000L};
+        while (done_count(n) < n)
+            nanosleep(&poll, 0);
+        unsigned long ticks = read_cntpct() - t0;
+
+        // throughput against a single child, n * 100 is perfect scaling
+        unsigned long rate = n * WORK_LOOPS * (freq / 1000) / ticks / 1000;
+        if (n == 1) one = rate;
+        print_dec(n);
+        print_str("\t\t");
+        print_dec(ticks * 1000 / freq);
+        print_str("\t");
+        print_dec(rate);
+        print_str("\t\t");
+        print_dec(rate * 100 / one);
+        print_str("\r\n");
+    }
+    return 0;
+}
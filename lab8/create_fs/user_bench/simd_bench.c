@@ -0,0 +1,93 @@
+// FP/SIMD in user space: vectorized against scalar throughput, and NEON registers surviving
+// preemption by other processes that use them too
+#include "ulib.h"
+
+#define SUM_WORDS   (64 * 1024)
+#define SUM_ROUNDS  16
+#define SIMD_PROCS  8          // more than cores, so they preempt each other
+#define LCG_STEPS   (1 << 24)  // several scheduler ticks per process
+#define LCG_MUL     1664525u
+#define LCG_ADD     1013904223u
+
+typedef unsigned int v4u __attribute__((vector_size(16)));
+
+static unsigned int data[SUM_WORDS] __attribute__((aligned(16)));
+
+__attribute__((optimize("no-tree-vectorize")))
+static unsigned int sum_scalar(const unsigned int *p, int n)
+{
+    unsigned int s = 0;
+    for (int i = 0; i < n; i++) s += p[i];
+    return s;
+}
+
+static unsigned int sum_simd(const unsigned int *p, int n)
+{
+    v4u s0 = {0, 0, 0, 0}, s1 = s0;
+    const v4u *v = (const v4u *)p;
+    for (int i = 0; i < n / 4; i += 2)
+    {
+        s0 += v[i];
+        s1 += v[i + 1];
+    }
+    s0 += s1;
+    return s0[0] + s0[1] + s0[2] + s0[3];
+}
+
+// four independent generators, kept in one q register for the whole loop
+static v4u lcg_simd(v4u x)
+{
+    for (int i = 0; i < LCG_STEPS; i++) x = x * LCG_MUL + LCG_ADD;
+    return x;
+}
+
+__attribute__((optimize("no-tree-vectorize")))
+static unsigned int lcg_scalar(unsigned int x)
+{
+    for (int i = 0; i < LCG_STEPS; i++) x = x * LCG_MUL + LCG_ADD;
+    return x;
+}
+
+static unsigned long ns(unsigned long ticks)
+{
+    return ticks * 1000000000UL / read_cntfrq();
+}
+
+int main()
+{
+    for (int i = 0; i < SUM_WORDS; i++) data[i] = i * 2654435761u;
+
+    unsigned int a = 0, b = 0;
+    unsigned long t0 = read_cntpct();
+    for (int r = 0; r < SUM_ROUNDS; r++) a += sum_scalar(data, SUM_WORDS);
+    unsigned long scalar = read_cntpct() - t0;
+    t0 = read_cntpct();
+    for (int r = 0; r < SUM_ROUNDS; r++) b += sum_simd(data, SUM_WORDS);
+    unsigned long simd = read_cntpct() - t0;
+
+    print_str("simd_bench: sum of ");
+    print_dec(SUM_WORDS);
+    print_str(" words, ");
+    print_dec(SUM_ROUNDS);
+    print_str(" rounds\r\n");
+    print_str("scalar\t");
+    print_dec(ns(scalar) / SUM_ROUNDS);
+    print_str(" ns/round\r\nneon\t");
+    print_dec(ns(simd) / SUM_ROUNDS);
+    print_str(" ns/round\r\n");
+    print_str(a == b ? "sums match\r\n" : "SUMS DIFFER\r\n");
+
+    // every process runs the generators from its own seeds, the kernel has to keep their q registers apart
+    for (int i = 1; i < SIMD_PROCS; i++)
+        if (fork() == 0) break;
+    unsigned int seed = getpid() * 4;
+    v4u x = {seed, seed + 1, seed + 2, seed + 3};
+    x = lcg_simd(x);
+    int ok = 1;
+    for (int lane = 0; lane < 4; lane++)
+        if (x[lane] != lcg_scalar(seed + lane)) ok = 0;
+    print_str("pid ");
+    print_dec(getpid());
+    print_str(ok ? ": neon state ok\r\n" : ": NEON STATE CORRUPTED\r\n");
+    return 0;
+}
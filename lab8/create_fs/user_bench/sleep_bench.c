@@ -0,0 +1,72 @@
+// how late nanosleep and a periodic ITIMER_REAL wake up, measured against clock_gettime
+#include "ulib.h"
+
+#define SLEEP_ROUNDS    16
+#define ALARM_PERIOD_US 10000
+#define ALARM_COUNT     50
+
+static unsigned long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static volatile int alarms;
+
+static void on_alarm()
+{
+    alarms++;
+}
+
+int main()
+{
+    static const unsigned long sleep_us[] = {10, 100, 1000, 10000, 100000};
+
+    print_str("sleep_bench: nanosleep, ");
+    print_dec(SLEEP_ROUNDS);
+    print_str(" rounds per row\r\n");
+    print_str("request(us)\tavg late(us)\tmax late(us)\r\n");
+    for (int r = 0; r < sizeof(sleep_us) / sizeof(sleep_us[0]); r++)
+    {
+        struct timespec req = {sleep_us[r] / 1000000, sleep_us[r] % 1000000 * 1000};
+        unsigned long total = 0, max = 0;
+        for (int i = 0; i < SLEEP_ROUNDS; i++)
+        {
+            unsigned long t0 = now_ns();
+            nanosleep(&req, 0);
+            unsigned long late = now_ns() - t0 - sleep_us[r] * 1000;
+            total += late;
+            if (late > max) max = late;
+        }
+        print_dec(sleep_us[r]);
+        print_str("\t\t");
+        print_dec(total / SLEEP_ROUNDS / 1000);
+        print_str("\t\t");
+        print_dec(max / 1000);
+        print_str("\r\n");
+    }
+
+    // the interval timer re-arms from its own deadline, the total should not drift
+    signal(SIGALRM, on_alarm);
+    struct itimerval it = {{0, ALARM_PERIOD_US}, {0, ALARM_PERIOD_US}};
+    unsigned long t0 = now_ns();
+    setitimer(ITIMER_REAL, &it, 0);
+    struct timespec forever = {3600, 0};
+    while (alarms < ALARM_COUNT)
+        nanosleep(&forever, 0); // each SIGALRM cuts it short
+    unsigned long elapsed = now_ns() - t0;
+    struct itimerval off = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_REAL, &off, 0);
+
+    print_str("itimer: ");
+    print_dec(ALARM_COUNT);
+    print_str(" x ");
+    print_dec(ALARM_PERIOD_US);
+    print_str("us took ");
+    print_dec(elapsed / 1000);
+    print_str("us, expected ");
+    print_dec((unsigned long)ALARM_COUNT * ALARM_PERIOD_US);
+    print_str("us\r\n");
+    return 0;
+}
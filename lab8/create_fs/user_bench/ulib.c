@@ -0,0 +1,114 @@
+#include "ulib.h"
+
+int getpid()
+{
+    return syscall(SYS_GETPID, 0, 0, 0, 0, 0, 0);
+}
+
+int fork()
+{
+    return syscall(SYS_FORK, 0, 0, 0, 0, 0, 0);
+}
+
+void exit(int status)
+{
+    syscall(SYS_EXIT, status, 0, 0, 0, 0, 0);
+    while (1);
+}
+
+void *mmap(void *addr, unsigned long len, int prot)
+{
+    return (void *)syscall(SYS_MMAP, (long)addr, len, prot, 0, -1, 0);
+}
+
+int open(const char *path, int flags)
+{
+    return syscall(SYS_OPEN, (long)path, flags, 0, 0, 0, 0);
+}
+
+int close(int fd)
+{
+    return syscall(SYS_CLOSE, fd, 0, 0, 0, 0, 0);
+}
+
+long write(int fd, const void *buf, unsigned long count)
+{
+    return syscall(SYS_WRITE, fd, (long)buf, count, 0, 0, 0);
+}
+
+long read(int fd, void *buf, unsigned long count)
+{
+    return syscall(SYS_READ, fd, (long)buf, count, 0, 0, 0);
+}
+
+long lseek64(int fd, long offset, int whence)
+{
+    return syscall(SYS_LSEEK64, fd, offset, whence, 0, 0, 0);
+}
+
+int spawn(const char *path, char *const argv[])
+{
+    return syscall(SYS_SPAWN, (long)path, (long)argv, 0, 0, 0, 0);
+}
+
+int nice(int inc)
+{
+    return syscall(SYS_NICE, inc, 0, 0, 0, 0, 0);
+}
+
+int sched_setscheduler(int pid, int policy, int priority)
+{
+    return syscall(SYS_SCHED_SETSCHEDULER, pid, policy, priority, 0, 0, 0);
+}
+
+int sched_setparam(int pid, int priority)
+{
+    return syscall(SYS_SCHED_SETPARAM, pid, priority, 0, 0, 0, 0);
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    return syscall(SYS_NANOSLEEP, (long)req, (long)rem, 0, 0, 0, 0);
+}
+
+int clock_gettime(int clockid, struct timespec *ts)
+{
+    return syscall(SYS_CLOCK_GETTIME, clockid, (long)ts, 0, 0, 0, 0);
+}
+
+int setitimer(int which, const struct itimerval *new_value, struct itimerval *old_value)
+{
+    return syscall(SYS_SETITIMER, which, (long)new_value, (long)old_value, 0, 0, 0);
+}
+
+void signal(int signum, void (*handler)())
+{
+    syscall(SYS_SIGNAL, signum, (long)handler, 0, 0, 0, 0);
+}
+
+void gettime(struct timespec *ts)
+{
+    unsigned long t = read_cntpct() - vdso->boot_cntpct;
+    unsigned long freq = vdso->cntfrq;
+    ts->tv_sec = t / freq;
+    ts->tv_nsec = t % freq * 1000000000UL / freq;
+}
+
+void print_str(const char *s)
+{
+    unsigned long len = 0;
+    while (s[len]) len++;
+    syscall(SYS_UARTWRITE, (long)s, len, 0, 0, 0, 0);
+}
+
+void print_dec(unsigned long n)
+{
+    char buf[21];
+    int i = sizeof(buf) - 1;
+    buf[i] = '\0';
+    do {
+        buf[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    print_str(&buf[i]);
+}
@@ -0,0 +1,133 @@
+#ifndef _ULIB_H_
+#define _ULIB_H_
+
+// syscall numbers, see sync_64_router in kernel/src/exception.c
+#define SYS_GETPID    0
+#define SYS_UARTWRITE 2
+#define SYS_FORK      4
+#define SYS_EXIT      5
+#define SYS_SIGNAL    8
+#define SYS_MMAP      10
+#define SYS_OPEN      11
+#define SYS_CLOSE     12
+#define SYS_WRITE     13
+#define SYS_READ      14
+#define SYS_LSEEK64   18
+#define SYS_SPAWN     20
+#define SYS_NICE      21
+#define SYS_SCHED_SETSCHEDULER 22
+#define SYS_SCHED_SETPARAM     23
+#define SYS_NANOSLEEP          24
+#define SYS_CLOCK_GETTIME      25
+#define SYS_SETITIMER          26
+
+#define SCHED_NORMAL 0
+#define SCHED_FIFO   1
+#define SCHED_RR     2
+
+#define O_CREAT  00000100
+#define SEEK_SET 0
+
+#define CLOCK_MONOTONIC 1
+#define ITIMER_REAL     0
+#define SIGALRM         14
+
+struct timespec
+{
+    long tv_sec;
+    long tv_nsec;
+};
+
+struct timeval
+{
+    long tv_sec;
+    long tv_usec;
+};
+
+struct itimerval
+{
+    struct timeval it_interval;
+    struct timeval it_value;
+};
+
+// read-only page the kernel maps into every process, see kernel/include/vdso.h
+#define USER_VDSO_VA  0xffffffffb000L
+#define VDSO_VERSION  1
+#define VDSO_NR_CPUS  4
+
+struct vdso_cpu
+{
+    unsigned long nr_switches;
+    unsigned long nr_running;
+};
+
+struct vdso_data
+{
+    unsigned int    version;
+    unsigned int    nr_cpus;
+    unsigned long   cntfrq;
+    unsigned long   boot_cntpct;
+    unsigned long   tick_period;
+    struct vdso_cpu cpu[VDSO_NR_CPUS];
+};
+
+#define vdso ((const volatile struct vdso_data *)USER_VDSO_VA)
+
+#define PROT_READ  1
+#define PROT_WRITE 2
+
+#define PAGESIZE 0x1000
+
+long syscall(long no, long a0, long a1, long a2, long a3, long a4, long a5);
+
+int   getpid();
+int   fork();
+void  exit(int status);
+void *mmap(void *addr, unsigned long len, int prot);
+int   open(const char *path, int flags);
+int   close(int fd);
+long  write(int fd, const void *buf, unsigned long count);
+long  read(int fd, void *buf, unsigned long count);
+long  lseek64(int fd, long offset, int whence);
+// start path as a new process without copying the caller, returns its pid or -1
+int   spawn(const char *path, char *const argv[]);
+// returns the new nice value
+int   nice(int inc);
+// pid 0 is the caller, priority 1 ~ 99 for SCHED_FIFO/SCHED_RR and 0 for SCHED_NORMAL, -1 on bad parameters
+int   sched_setscheduler(int pid, int policy, int priority);
+int   sched_setparam(int pid, int priority);
+// -1 if a signal cut the sleep short, rem (may be 0) gets the rest
+int   nanosleep(const struct timespec *req, struct timespec *rem);
+int   clock_gettime(int clockid, struct timespec *ts);
+int   setitimer(int which, const struct itimerval *new_value, struct itimerval *old_value);
+void  signal(int signum, void (*handler)());
+// clock_gettime(CLOCK_MONOTONIC) from the vdso page, no syscall
+void  gettime(struct timespec *ts);
+
+void print_str(const char *s);
+void print_dec(unsigned long n);
+
+// physical counter, the kernel lets EL0 read it (CNTKCTL_EL1.EL0PCTEN)
+static inline unsigned long read_cntpct()
+{
+    unsigned long r;
+    asm volatile("isb\n\tmrs %0, cntpct_el0" : "=r"(r));
+    return r;
+}
+
+static inline unsigned long read_cntfrq()
+{
+    unsigned long r;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(r));
+    return r;
+}
+
+// nanoseconds since boot, same clock as gettime
+static inline unsigned long gettime_ns()
+{
+    unsigned long t = read_cntpct() - vdso->boot_cntpct;
+    unsigned long freq = vdso->cntfrq;
+    return t / freq * 1000000000UL + t % freq * 1000000000UL / freq;
+}
+
+#endif /* _ULIB_H_ */
@@ -0,0 +1,74 @@
+// cost of reading the time through the clock_gettime syscall and through the vdso page
+#include "ulib.h"
+
+#define READS 10000
+
+static unsigned long ts_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000UL + ts->tv_nsec;
+}
+
+// counter ticks to nanoseconds per read
+static unsigned long per_read_ns(unsigned long ticks)
+{
+    return ticks * 1000000000UL / vdso->cntfrq / READS;
+}
+
+int main()
+{
+    struct timespec ts;
+
+    if (vdso->version != VDSO_VERSION)
+    {
+        print_str("vdso_bench: vdso page version mismatch\r\n");
+        return 1;
+    }
+
+    unsigned long t0 = read_cntpct();
+    for (int i = 0; i < READS; i++)
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long svc = read_cntpct() - t0;
+
+    t0 = read_cntpct();
+    for (int i = 0; i < READS; i++)
+        gettime(&ts);
+    unsigned long page = read_cntpct() - t0;
+
+    // both clocks have to agree and never go backwards against each other
+    int backwards = 0;
+    unsigned long last = 0;
+    for (int i = 0; i < READS; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        unsigned long a = ts_ns(&ts);
+        gettime(&ts);
+        unsigned long b = ts_ns(&ts);
+        if (a < last || b < a) backwards++;
+        last = b;
+    }
+
+    print_str("vdso_bench: ");
+    print_dec(READS);
+    print_str(" reads\r\n");
+    print_str("clock_gettime syscall\t");
+    print_dec(per_read_ns(svc));
+    print_str(" ns/read\r\n");
+    print_str("vdso gettime\t\t");
+    print_dec(per_read_ns(page));
+    print_str(" ns/read\r\n");
+    print_str("out of order\t\t");
+    print_dec(backwards);
+    print_str("\r\n");
+
+    print_str("cpu\tswitches\trunning\r\n");
+    for (int cpu = 0; cpu < vdso->nr_cpus && cpu < VDSO_NR_CPUS; cpu++)
+    {
+        print_dec(cpu);
+        print_str("\t");
+        print_dec(vdso->cpu[cpu].nr_switches);
+        print_str("\t\t");
+        print_dec(vdso->cpu[cpu].nr_running);
+        print_str("\r\n");
+    }
+    return 0;
+}
@@ -0,0 +1,16 @@
+#ifndef _ASID_H_
+#define _ASID_H_
+
+// ASIDs tag the TLB entries of user pages (PD_NG) with their address space, a context switch only
+// loads ttbr0_el1. 8-bit ASIDs (TCR_EL1.AS = 0), taken from ttbr0_el1 (TCR_EL1.A1 = 0).
+#define ASID_BITS 8
+#define ASID_MASK ((1UL << ASID_BITS) - 1)
+
+struct thread;
+
+extern unsigned long asid_rollovers;
+extern int           asid_flush_every_switch; // bench: flush the TLB on every switch as before ASIDs
+
+void asid_switch_mm(struct thread *t);
+
+#endif /* _ASID_H_ */
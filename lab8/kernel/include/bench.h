@@ -0,0 +1,21 @@
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+// PMU cycle counter, enabled by bench_init()
+static inline unsigned long bench_cycles()
+{
+    unsigned long c;
+    __asm__ __volatile__("isb\n\tmrs %0, pmccntr_el0\n\t" : "=r"(c));
+    return c;
+}
+
+void bench_init();
+void bench_run(char *name);
+void bench_buddy();
+void bench_smp();
+void bench_sched();
+void bench_timer();
+void bench_switch();
+void bench_mem();
+
+#endif /* _BENCH_H_ */
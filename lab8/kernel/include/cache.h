@@ -0,0 +1,45 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+// Cache maintenance by virtual address, for whatever does not snoop the cores' data caches: the
+// VideoCore reading mailbox buffers, cores still running with their MMU off (spin table) and the
+// instruction fetch of code just written through the data cache.
+
+static inline unsigned long dcache_line_size()
+{
+    unsigned long ctr;
+    __asm__ __volatile__("mrs %0, ctr_el0\n\t" : "=r"(ctr));
+    return 4UL << ((ctr >> 16) & 0xf); // DminLine, log2 words
+}
+
+static inline unsigned long icache_line_size()
+{
+    unsigned long ctr;
+    __asm__ __volatile__("mrs %0, ctr_el0\n\t" : "=r"(ctr));
+    return 4UL << (ctr & 0xf);         // IminLine, log2 words
+}
+
+// write the dirty lines of [addr, addr + size) back to memory and drop them: memory is current for
+// a reader that bypasses the cache, and what it writes there is not hidden by stale lines afterwards
+static inline void dcache_clean_inval(const void *addr, unsigned long size)
+{
+    unsigned long line = dcache_line_size();
+    for (unsigned long p = (unsigned long)addr & ~(line - 1); p < (unsigned long)addr + size; p += line)
+        __asm__ __volatile__("dc civac, %0\n\t" :: "r"(p) : "memory");
+    __asm__ __volatile__("dsb sy\n\t" ::: "memory");
+}
+
+// code was written to [addr, addr + size): make instruction fetch on every core see it
+static inline void icache_sync(const void *addr, unsigned long size)
+{
+    unsigned long dline = dcache_line_size(), iline = icache_line_size();
+    for (unsigned long p = (unsigned long)addr & ~(dline - 1); p < (unsigned long)addr + size; p += dline)
+        __asm__ __volatile__("dc cvau, %0\n\t" :: "r"(p) : "memory");
+    __asm__ __volatile__("dsb ish\n\t" ::: "memory");
+    for (unsigned long p = (unsigned long)addr & ~(iline - 1); p < (unsigned long)addr + size; p += iline)
+        __asm__ __volatile__("ic ivau, %0\n\t" :: "r"(p) : "memory"); // the I-cache is physically indexed, the kernel alias will do
+    __asm__ __volatile__("dsb ish\n\t"
+                         "isb\n\t" ::: "memory");
+}
+
+#endif /* _CACHE_H_ */
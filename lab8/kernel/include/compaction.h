@@ -0,0 +1,16 @@
+#ifndef _COMPACTION_H_
+#define _COMPACTION_H_
+
+// Memory compaction: user memory is movable. VMA backing blocks are copied to
+// lower physical memory and their user mappings dropped so the next access
+// faults in the new frames, anonymous frames are copied and their PTE rewritten.
+// Freed high memory merges back into max-order blocks.
+#define COMPACT_MAX_PASSES   4
+#define KCOMPACTD_PERIOD_SEC 1
+
+int  compact_memory(void); // returns number of blocks and frames migrated
+void compaction_wakeup(); // ask kcompactd for a pass
+void kcompactd_init();
+void kcompactd();
+
+#endif /* _COMPACTION_H_ */
@@ -22,6 +22,7 @@ uint64_t uint64_endian_big2lttle(uint64_t data);
 void traverse_device_tree(void *base, dtb_callback callback);  //traverse dtb tree
 void dtb_callback_show_tree(uint32_t node_type, char *name, void *value, uint32_t name_size);
 void dtb_callback_initramfs(uint32_t node_type, char *name, void *value, uint32_t name_size);
+void dtb_callback_memory(uint32_t node_type, char *name, void *value, uint32_t name_size);
 
 void dtb_find_and_store_reserved_memory();
 
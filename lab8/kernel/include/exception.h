@@ -3,8 +3,6 @@
 
 #include "bcm2837/rpi_irq.h"
 
-#define CORE0_INTERRUPT_SOURCE ((volatile unsigned int *)(PHYS_TO_VIRT(0x40000060)))
-
 #define IRQ_PENDING_1_AUX_INT (1<<29)
 #define INTERRUPT_SOURCE_GPU (1<<8)
 #define INTERRUPT_SOURCE_CNTPNSIRQ (1<<1)
@@ -49,11 +47,16 @@ typedef struct trapframe
 
 #define MEMFAIL_DATA_ABORT_LOWER 0b100100 // esr_el1
 #define MEMFAIL_INST_ABORT_LOWER 0b100000 // EC, bits [31:26]
+#define MEMFAIL_DATA_ABORT_SAME  0b100101 // kernel touching memory
 
 #define TF_LEVEL0 0b000100 // iss IFSC, bits [5:0]
 #define TF_LEVEL1 0b000101
 #define TF_LEVEL2 0b000110
 #define TF_LEVEL3 0b000111
+#define PF_LEVEL1 0b001101 // permission fault, iss DFSC
+#define PF_LEVEL2 0b001110
+#define PF_LEVEL3 0b001111
+#define ISS_WNR   (1 << 6) // data abort caused by a write
 
 typedef struct{
     unsigned int iss : 25, // Instruction specific syndrome
@@ -62,6 +65,7 @@ typedef struct{
 } esr_el1_t;
 
 void sync_64_router(trapframe_t *tpf);
+void el1_sync_router(trapframe_t *tpf);
 void irq_router(trapframe_t *tpf);
 void invalid_exception_router();
 
@@ -75,6 +79,20 @@ static inline void el1_interrupt_disable()
     __asm__ __volatile__("msr daifset, 0xf");
 }
 
+// mask interrupts on this core only, restore the previous mask afterwards
+static inline unsigned long local_irq_save()
+{
+    unsigned long flags;
+    __asm__ __volatile__("mrs %0, daif\n\t"
+                         "msr daifset, 0xf\n\t" : "=r"(flags));
+    return flags;
+}
+
+static inline void local_irq_restore(unsigned long flags)
+{
+    __asm__ __volatile__("msr daif, %0\n\t" :: "r"(flags));
+}
+
 void lock();
 void unlock();
 
@@ -0,0 +1,30 @@
+#ifndef _FPSIMD_H_
+#define _FPSIMD_H_
+
+// The kernel is built with -mgeneral-regs-only, q0 ~ q31 only ever hold user state. They are switched
+// lazily: EL0 traps on its first FP/SIMD instruction after a switch (CPACR_EL1.FPEN), the trap loads
+// the thread's saved state and leaves access on. A thread that never traps is never saved or loaded.
+#define CPACR_FPEN_TRAP_EL0 (0b01 << 20) // EL1 may use the registers, EL0 traps
+#define CPACR_FPEN_NO_TRAP  (0b11 << 20)
+
+#define ESR_ELx_EC_FP_ASIMD 0b000111     // esr_el1 EC: access to FP/SIMD trapped by CPACR_EL1
+
+struct thread;
+
+typedef struct fpsimd_state
+{
+    unsigned long vregs[64];             // q0 ~ q31
+    unsigned int  fpsr;
+    unsigned int  fpcr;
+} __attribute__((aligned(16))) fpsimd_state_t;
+
+void fpsimd_save(fpsimd_state_t *state);
+void fpsimd_load(fpsimd_state_t *state);
+
+void fpsimd_init_cpu();
+void fpsimd_switch(struct thread *prev, struct thread *next);
+void fpsimd_access_trap();
+void fpsimd_fork(struct thread *child, struct thread *parent);
+void fpsimd_flush(struct thread *t);
+
+#endif /* _FPSIMD_H_ */
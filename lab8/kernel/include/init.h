@@ -0,0 +1,16 @@
+#ifndef _INIT_H_
+#define _INIT_H_
+
+// Boot-only code and data. Everything marked here is linked between
+// _init_start and _init_end and handed to the buddy system by free_initmem()
+// once the kernel is up, so it must not be referenced after that point.
+#define __init     __attribute__((section(".init.text")))
+#define __initdata __attribute__((section(".init.data")))
+
+extern char _init_start;
+extern char _init_data;     // end of the init text, page aligned
+extern char _init_end;
+
+void free_initmem();
+
+#endif /* _INIT_H_ */
@@ -59,5 +59,6 @@ typedef enum {
 #define MBOX_TAG_LAST_BYTE    0x00000000
 
 int mbox_call(mbox_channel_type, unsigned int);
+int mbox_get_memory(mbox_tag_type tag, unsigned int *base, unsigned int *size);
 
 #endif /*_MBOX_H_*/
@@ -0,0 +1,43 @@
+#ifndef _MEMBLOCK_H_
+#define _MEMBLOCK_H_
+
+// Early boot allocator. Before the buddy system exists, physical memory is
+// described by two sorted region lists: memory (RAM from the device tree)
+// and reserved (kernel image, dtb, initramfs, page tables, early
+// allocations). The buddy system is seeded with exactly memory - reserved,
+// and the lists themselves live in init data that is freed after boot.
+#define MEMBLOCK_MAX_REGIONS 32
+
+typedef struct memblock_region
+{
+    unsigned long long base; // physical address
+    unsigned long long size;
+} memblock_region_t;
+
+typedef struct memblock_type
+{
+    int               cnt;
+    const char       *name;
+    memblock_region_t regions[MEMBLOCK_MAX_REGIONS];
+} memblock_type_t;
+
+typedef struct memblock
+{
+    unsigned long long limit; // highest physical address memblock_alloc may return
+    memblock_type_t    memory;
+    memblock_type_t    reserved;
+} memblock_t;
+
+extern memblock_t memblock;
+
+void  memblock_add(unsigned long long base, unsigned long long size);
+void  memblock_remove(unsigned long long base, unsigned long long size);
+void  memblock_reserve(unsigned long long base, unsigned long long size);
+unsigned long long memblock_end_of_memory();
+void* memblock_alloc(unsigned long long size, unsigned long long align);
+void  memblock_dump();
+
+// call fn on every free physical range [start, end) of memory - reserved
+void  memblock_for_each_free(void (*fn)(unsigned long long start, unsigned long long end));
+
+#endif /* _MEMBLOCK_H_ */
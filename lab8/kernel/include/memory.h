@@ -3,16 +3,21 @@
 
 #include "bcm2837/rpi_mmu.h"
 #include "list.h"
-
-/* Lab2 */
-void* s_allocator(unsigned int size);
-void  s_free(void* ptr);
+#include "smp.h"
+#include "spinlock.h"
 
 /* Lab4 */
-#define BUDDY_MEMORY_BASE       PHYS_TO_VIRT(0x0)     // 0x10000000 - 0x20000000 (SPEC) -> Advanced #3 for all memory region
-#define BUDDY_MEMORY_PAGE_COUNT 0x3C000 // let BUDDY_MEMORY use 0x0 ~ 0x3C000000 (SPEC)
+#define BUDDY_MEMORY_BASE       PHYS_TO_VIRT(0x0)     // pfn 0, the zone covers 0 ~ end of the last RAM bank found at boot
+#define BUDDY_FALLBACK_MEMORY   0x3C000000            // used only when neither the dtb nor the firmware report RAM
 #define PAGESIZE    0x1000     // 4KB
-#define MAX_PAGES   0x10000    // 65536 (Entries), PAGESIZE * MAX_PAGES = 0x10000000 (SPEC)
+
+// number of buddy orders, the largest block is PAGESIZE << (BUDDY_MAX_ORDER - 1): 2MB by default (make BUDDY_MAX_ORDER=n)
+#ifndef BUDDY_MAX_ORDER
+#define BUDDY_MAX_ORDER 10
+#endif
+#if BUDDY_MAX_ORDER < 8 || BUDDY_MAX_ORDER > 19
+#error "BUDDY_MAX_ORDER must be between 8 (512KB blocks) and 19 (1GB blocks)"
+#endif
 
 typedef enum {
     FRAME_FREE = -2,
@@ -24,8 +29,9 @@ typedef enum {
     FRAME_IDX_4,          // 0x10000
     FRAME_IDX_5,          // 0x20000
     FRAME_IDX_6,          // 0x40000
-    FRAME_IDX_FINAL = 7,  // 0x80000
-    FRAME_MAX_IDX = 8
+    FRAME_IDX_7,          // 0x80000
+    FRAME_IDX_FINAL = BUDDY_MAX_ORDER - 1,
+    FRAME_MAX_IDX = BUDDY_MAX_ORDER
 } frame_value_type;
 
 typedef enum {
@@ -40,19 +46,93 @@ typedef enum {
     CACHE_MAX_IDX = 7
 } cache_value_type;
 
+// free state lives in the zone bitmaps, a frame only remembers what was handed out
 typedef struct frame
 {
-    struct list_head listhead; // store freelist
-    int val;                   // store order
-    int used;
-    int cache_order;
-    unsigned int idx;
+    int val;                   // order of the allocated block (valid on block head)
+    int slab;                  // page index inside its slab + 1, 0 for page allocation
+    unsigned int contig;       // pages of an alloc_contig allocation (valid on head), 0 otherwise
+    unsigned int refcount;     // page tables mapping a user frame, 1 from page_malloc (valid on head)
 } frame_t;
 
+// Each order keeps a free bitmap (bit i: block i of this order is a free block),
+// an index word per 64 bitmap words and one summary word over the index words,
+// so the lowest free block of an order is found with three count-trailing-zeros.
+#define BUDDY_BITS_PER_WORD 64
+#define BUDDY_MAX_PAGES     (BUDDY_BITS_PER_WORD * BUDDY_BITS_PER_WORD * BUDDY_BITS_PER_WORD)
+
+typedef struct buddy_zone
+{
+    unsigned long  page_count;
+    unsigned long  free_orders;                  // bit k set: order k has a free block
+    unsigned long  summary[FRAME_MAX_IDX];       // bit j set: index[j] != 0
+    unsigned long *index[FRAME_MAX_IDX];         // bit i set: map[i]   != 0
+    unsigned long *map[FRAME_MAX_IDX];           // bit b set: block b is free
+    unsigned int   nr_free[FRAME_MAX_IDX];
+} buddy_zone_t;
+
+unsigned long buddy_zone_metadata_size(unsigned long page_count);
+void buddy_zone_init(buddy_zone_t *zone, unsigned long page_count, void *metadata);
+long buddy_zone_alloc(buddy_zone_t *zone, int order);
+void buddy_zone_free(buddy_zone_t *zone, unsigned long pfn, int order);
+void buddy_zone_free_range(buddy_zone_t *zone, unsigned long start_pfn, unsigned long end_pfn);
+void buddy_zone_reserve(buddy_zone_t *zone, unsigned long start_pfn, unsigned long end_pfn);
+long buddy_zone_alloc_contig(buddy_zone_t *zone, unsigned long pages);
+unsigned long buddy_zone_nr_free_pages(buddy_zone_t *zone);
+
+// Slab layer: every object type is a cache of slabs (1 << slab_order pages each)
+// carrying their own header and free count. Each CPU keeps a small magazine of
+// objects per cache, so kmalloc/kfree only take the cache's lock to refill or
+// flush a magazine. Empty slabs beyond SLAB_KEEP_FREE go back to page_free.
+#define SLAB_MAGAZINE_SIZE 16
+#define SLAB_KEEP_FREE     1
+#define CACHE_LINE_SIZE    64
+
+typedef struct slab
+{
+    list_head_t        listhead;  // in partial/full/free list of its cache
+    struct kmem_cache *cache;
+    void              *freelist;  // singly linked through the free_offset word of free objects
+    unsigned int       inuse;
+    unsigned int       free;
+} slab_t;
+
+typedef struct kmem_magazine
+{
+    unsigned int avail;
+    void        *objs[SLAB_MAGAZINE_SIZE];
+} kmem_magazine_t;
+
+typedef struct kmem_cache
+{
+    list_head_t     listhead;      // in the list of all caches (for stats)
+    spinlock_t      lock;          // slab lists and counters, the magazines are per CPU
+    const char     *name;
+    unsigned int    object_size;   // size asked by the user
+    unsigned int    stride;        // object_size + free link (if ctor) rounded up to align
+    unsigned int    align;
+    unsigned int    free_offset;   // free link inside the object, behind it when there is a ctor
+    void            (*ctor)(void *obj);
+    unsigned int    slab_order;
+    unsigned int    objs_per_slab;
+    unsigned int    first_offset;  // first object in a slab, after slab_t
+    list_head_t     slabs_partial;
+    list_head_t     slabs_full;
+    list_head_t     slabs_free;
+    unsigned int    nr_slabs;
+    unsigned int    nr_free_slabs;
+    unsigned int    nr_objs_free;  // free objects sitting in slabs (not in magazines)
+    kmem_magazine_t cpu_magazine[NR_CPUS];
+} kmem_cache_t;
+
+// align 0 keeps objects at their exact size (word aligned), CACHE_LINE_SIZE keeps hot objects on their own line.
+// ctor runs once per object when its slab is created, freed objects must be returned in constructed state.
+kmem_cache_t *kmem_cache_create(const char *name, unsigned int size, unsigned int align, void (*ctor)(void *obj));
+void         *kmem_cache_alloc(kmem_cache_t *cache);
+void          kmem_cache_free(kmem_cache_t *cache, void *ptr);
+void          kmem_cache_dump_stats();
+
 void     init_allocator();
-frame_t *release_redundant(frame_t *frame);
-frame_t *get_buddy(frame_t *frame);
-frame_t *coalesce(frame_t *frame_ptr);
 
 void dump_page_info();
 void dump_cache_info();
@@ -60,12 +140,21 @@ void dump_cache_info();
 //buddy system
 void* page_malloc(unsigned int size);
 void  page_free(void *ptr);
-void  page2caches(int order);
+// user frames shared copy-on-write after fork, page_put frees on the last reference
+void  page_get(void *ptr);
+void  page_put(void *ptr);
+unsigned int page_refcount(void *ptr);
 void* cache_malloc(unsigned int size);
 void  cache_free(void* ptr);
 
+// physically contiguous runs of max-order blocks, for buffers larger than the biggest buddy block
+void* alloc_contig(unsigned long size);
+void  free_contig(void *ptr);
+
 void* kmalloc(unsigned int size);
 void  kfree(void *ptr);
+unsigned long ksize(void *ptr);
+int   memory_fragmented();
 void  memory_reserve(unsigned long long start, unsigned long long end);
 
 #endif /* _MEMORY_H_ */
@@ -0,0 +1,50 @@
+#ifndef _MEMTRACE_H_
+#define _MEMTRACE_H_
+
+// Allocator tracing, selected at build time (make MEMTRACE=n):
+//   0  compiled out, the hooks below expand to nothing
+//   1  allocation histograms + ring buffer event log (runtime toggle, `memtrace on`)
+//   2  level 1 + free list / magazine dumps around every page and cache operation
+#ifndef MEMTRACE_LEVEL
+#define MEMTRACE_LEVEL 0
+#endif
+
+#define MEMTRACE_RING_SIZE 256 // events, power of 2
+#define MEMTRACE_HIST_SIZE 24  // log2 size buckets: 1B ... 8MB
+
+enum memtrace_type
+{
+    MEMTRACE_PAGE_ALLOC,
+    MEMTRACE_PAGE_FREE,
+    MEMTRACE_CACHE_ALLOC,
+    MEMTRACE_CACHE_FREE,
+    MEMTRACE_KMALLOC,
+    MEMTRACE_KFREE,
+    MEMTRACE_TYPE_COUNT
+};
+
+typedef struct memtrace_event
+{
+    unsigned long long tick; // cntpct_el0
+    void *ptr;
+    unsigned int size;
+    unsigned char type;
+    unsigned char cpu;
+} memtrace_event_t;
+
+#if MEMTRACE_LEVEL >= 1
+void memtrace_record(int type, void *ptr, unsigned int size);
+#define memtrace(type, ptr, size) memtrace_record(type, ptr, size)
+#else
+#define memtrace(type, ptr, size) ((void)0)
+#endif
+
+#if MEMTRACE_LEVEL >= 2
+#define memtrace_dump(fn) fn()
+#else
+#define memtrace_dump(fn) ((void)0)
+#endif
+
+void memtrace_cmd(char *arg);
+
+#endif /* _MEMTRACE_H_ */
@@ -2,20 +2,51 @@
 #define _MMU_H_
 
 #include "stddef.h"
+
+// 1: map RAM non-cacheable and leave the caches off, as before write-back RAM (to benchmark against)
+#ifndef MMU_RAM_NOCACHE
+#define MMU_RAM_NOCACHE 0
+#endif
                                                                             // tcr_el1: The control register for stage 1 of the EL1&0 translation regime.
 #define TCR_CONFIG_REGION_48bit (((64 - 48) << 0) | ((64 - 48) << 16))      // T0SZ[5:0]   The size offset for ttbr0_el1 is 2**(64-T0SZ): 0x0000_0000_0000_0000 <- 0x0000_FFFF_FFFF_FFFF
 #define TCR_CONFIG_4KB          ((0b00 << 14) | (0b10 << 30))               // T1SZ[21:16] The size offset for ttbr1_el1 is 2**(64-T1SZ): 0xFFFF_0000_0000_0000 -> 0xFFFF_FFFF_FFFF_FFFF
-#define TCR_CONFIG_DEFAULT      (TCR_CONFIG_REGION_48bit | TCR_CONFIG_4KB)  // TG0[15:14]  Granule size for the TTBR0_EL1: 0b00 = 4KB // TG1[31:30]  Granule size for the TTBR1_EL1: 0b10 = 4KB
+#if MMU_RAM_NOCACHE
+#define TCR_CONFIG_WALK         0
+#else
+#define TCR_CONFIG_WALK         ((0b01 << 8) | (0b01 << 10) | (0b11 << 12) | (0b01 << 24) | (0b01 << 26) | (0b11 << 28)) // IRGNn/ORGNn write-back, SHn inner shareable: table walks go through the caches
+#endif
+#define TCR_CONFIG_DEFAULT      (TCR_CONFIG_REGION_48bit | TCR_CONFIG_4KB | TCR_CONFIG_WALK)  // TG0[15:14]  Granule size for the TTBR0_EL1: 0b00 = 4KB // TG1[31:30]  Granule size for the TTBR1_EL1: 0b10 = 4KB
 
 #define MAIR_DEVICE_nGnRnE      0b00000000                                  // ((MAIR_DEVICE_nGnRnE << (MAIR_IDX_DEVICE_nGnRnE * 8)) | (MAIR_NORMAL_NOCACHE << (MAIR_IDX_NORMAL_NOCACHE * 8)))
 #define MAIR_NORMAL_NOCACHE     0b01000100                                  // mair_el1: Provides the memory attribute encodings corresponding to the possible AttrIndx values for stage 1 translations at EL1.
 #define MAIR_IDX_DEVICE_nGnRnE  0                                           // ATTR0[7:0]: 0b0000dd00 Device memory,   dd = 0b00   Device-nGnRnE memory
 #define MAIR_IDX_NORMAL_NOCACHE 1                                           // ATTR1[14:8] 0booooiiii Normal memory, oooo = 0b0100 Outer Non-cacheable, iiii = 0b0100 Inner Non-cacheable
+#define MAIR_NORMAL_WB          0b11111111                                  // Normal memory, inner and outer write-back, read and write allocate
+#define MAIR_IDX_NORMAL_WB      2                                           // ATTR2[23:16]: RAM
+#define MAIR_CONFIG_DEFAULT     ((MAIR_DEVICE_nGnRnE << (MAIR_IDX_DEVICE_nGnRnE * 8)) | (MAIR_NORMAL_NOCACHE << (MAIR_IDX_NORMAL_NOCACHE * 8)) | (MAIR_NORMAL_WB << (MAIR_IDX_NORMAL_WB * 8)))
+
+#define SCTLR_MMU               (1 << 0)                                    // sctlr_el1 M: stage 1 translation
+#define SCTLR_DCACHE            (1 << 2)                                    // C: data accesses may be cached
+#define SCTLR_ICACHE            (1 << 12)                                   // I: instruction fetches may be cached
+#if MMU_RAM_NOCACHE
+#define SCTLR_CONFIG_DEFAULT    (SCTLR_MMU)
+#else
+#define SCTLR_CONFIG_DEFAULT    (SCTLR_MMU | SCTLR_DCACHE | SCTLR_ICACHE)
+#endif
 
 #define PD_TABLE                0b11L                                       // Table Entry Armv8_a_address_translation p.14
 #define PD_BLOCK                0b01L                                       // Block Entry
 #define PD_UNX                  (1L << 54)                                  // non-executable page frame for EL0 if set
 #define PD_KNX                  (1L << 53)                                  // non-executable page frame for EL1 if set
+#define PD_NG                   (1L << 11)                                  // not global: the TLB entry is tagged with the ASID
+#define PD_INNER_SHAREABLE      (0b11L << 8)                                // SH[9:8]: coherent between the cores
+#define PD_ATTR(idx)            ((idx) << 2)                                // AttrIndx[4:2]: MAIR_IDX_*
+#define PD_ATTR_NOCACHE         (PD_ATTR(MAIR_IDX_NORMAL_NOCACHE))
+#if MMU_RAM_NOCACHE
+#define PD_ATTR_RAM             PD_ATTR_NOCACHE
+#else
+#define PD_ATTR_RAM             (PD_ATTR(MAIR_IDX_NORMAL_WB) | PD_INNER_SHAREABLE)
+#endif
 #define PD_ACCESS               (1L << 10)                                  // a page fault is generated if not set
 #define PD_RDONLY               (1L << 7)                                   // 0 for read-write, 1 for read-only.
 #define PD_UK_ACCESS            (1L << 6)                                   // 0 for only kernel access, 1 for user/kernel access.
@@ -25,23 +56,33 @@
 #define USER_KERNEL_BASE        0x00000000L
 #define USER_STACK_BASE         0xfffffffff000L
 #define USER_SIGNAL_WRAPPER_VA  0xffffffff9000L
+#define USER_VDSO_VA            0xffffffffb000L     // read-only vdso_data page, right after the signal wrapper
+#define USER_ADDR_LIMIT         0x1000000000000L    // ttbr0_el1 range, 48-bit
 
+// Kernel page tables, built by mmu_build_kernel_pgd() before the MMU is on, in low memory below the image
 #define MMU_PGD_BASE            0x1000L
-#define MMU_PGD_ADDR            (MMU_PGD_BASE + 0x0000L)
-#define MMU_PUD_ADDR            (MMU_PGD_BASE + 0x1000L)
-#define MMU_PTE_ADDR            (MMU_PGD_BASE + 0x2000L)
-
-// Used for EL1
-#define BOOT_PGD_ATTR           (PD_TABLE)
-#define BOOT_PUD_ATTR           (PD_TABLE | PD_ACCESS)
-#define BOOT_PTE_ATTR_nGnRnE    (PD_BLOCK | PD_ACCESS | (MAIR_DEVICE_nGnRnE << 2) | PD_UNX | PD_KNX | PD_UK_ACCESS)  // p.17
-#define BOOT_PTE_ATTR_NOCACHE   (PD_BLOCK | PD_ACCESS | (MAIR_NORMAL_NOCACHE << 2))
+#define MMU_PGD_ADDR            (MMU_PGD_BASE + 0x0000L)    // identity map, ttbr0_el1 while booting (and until the first switch)
+#define MMU_KERNEL_PGD_ADDR     (MMU_PGD_BASE + 0x1000L)    // linear map, ttbr1_el1 for good
+#define MMU_PGTABLE_ADDR        (MMU_PGD_BASE + 0x2000L)    // PUD/PMD/PTE tables below both roots
+#define MMU_PGTABLE_END         (MMU_PGD_BASE + 0x12000L)   // 16 tables
+
+// Used for EL1, the builder adds PD_BLOCK or PD_TABLE (page) depending on the level. Global, no EL0 access.
+#define KERNEL_ATTR_DEVICE      (PD_ACCESS | PD_ATTR(MAIR_IDX_DEVICE_nGnRnE) | PD_UNX | PD_KNX)  // p.17
+#define KERNEL_ATTR_NOCACHE     (PD_ACCESS | PD_ATTR_NOCACHE | PD_UNX | PD_KNX)    // VideoCore memory (framebuffer)
+#define KERNEL_ATTR_TEXT        (PD_ACCESS | PD_ATTR_RAM | PD_UNX | PD_RDONLY)     // rx
+#define KERNEL_ATTR_RODATA      (PD_ACCESS | PD_ATTR_RAM | PD_UNX | PD_KNX | PD_RDONLY)
+#define KERNEL_ATTR_DATA        (PD_ACCESS | PD_ATTR_RAM | PD_UNX | PD_KNX)        // rw, all RAM outside the image
 
 #ifndef __ASSEMBLER__
 
 #include "sched.h"
 #include "exception.h"
 
+// how a vma is backed
+#define VMA_FIXED   0    // phys_addr belongs to someone else (peripherals, signal wrapper)
+#define VMA_ALLOCED 1    // phys_addr is a kmalloc block owned by the vma
+#define VMA_ANON    2    // no backing, a zeroed frame is allocated on first touch, frames are refcounted and shared by fork
+
 typedef struct vm_area_struct
 {
 
@@ -50,16 +91,26 @@ typedef struct vm_area_struct
     unsigned long phys_addr;
     unsigned long area_size;
     unsigned long rwx;   // 1, 2, 4
-    int is_alloced;
+    int backing;         // VMA_FIXED, VMA_ALLOCED, VMA_ANON
 
 } vm_area_struct_t;
 
-void *set_2M_kernel_mmu(void *x0);
+void  mmu_init();
+void *mmu_build_kernel_pgd(void *x0);
+void  mmu_kernel_protect(size_t va, size_t size, size_t attr);
 void map_one_page(size_t *pgd_p, size_t va, size_t pa, size_t flag);
 
-void mmu_add_vma(struct thread *t, size_t va, size_t size, size_t pa, size_t rwx, int is_alloced);
+vm_area_struct_t *mmu_add_vma(struct thread *t, size_t va, size_t size, size_t pa, size_t rwx, int backing);
 void mmu_del_vma(struct thread *t);
+size_t mmu_vma_flags(vm_area_struct_t *vma);
+size_t *mmu_find_pte(size_t *pgd_p, size_t va);
 void mmu_map_pages(size_t *pgd_p, size_t va, size_t size, size_t pa, size_t flag);
+unsigned long mmu_unmap_pages(struct thread *t, size_t va, size_t size);
+void mmu_flush_tlb_asid(struct thread *t);
+void mmu_flush_tlb_page(struct thread *t, size_t va);
+char *mmu_map_anon_page(struct thread *t, vm_area_struct_t *vma, size_t va);
+int  mmu_load_anon_pages(struct thread *t, vm_area_struct_t *vma, const char *src, size_t size);
+void mmu_share_anon_pages(struct thread *dst, struct thread *src, vm_area_struct_t *vma);
 void mmu_free_page_tables(size_t *page_table, int level);
 
 void mmu_memfail_abort_handle(esr_el1_t* esr_el1);
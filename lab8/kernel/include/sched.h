@@ -3,16 +3,49 @@
 
 #include "list.h"
 #include "vfs.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "fpsimd.h"
 
 #define PIDMAX      32768
 #define USTACK_SIZE 0x4000
 #define KSTACK_SIZE 0x4000
 #define SIGNAL_MAX  64
 
+// thread_t.state
+#define THREAD_NEW      0  // slot allocated, not published by sched_enqueue yet
+#define THREAD_RUNNABLE 1  // running, or queued in its scheduling class
+#define THREAD_BLOCKED  2  // off the class queues until sched_wake_up
+#define THREAD_ZOMBIE   3  // dead, freed by the reaper thread once no core runs it
+
+// thread_t.policy, numbered as in Linux
+#define SCHED_NORMAL 0  // fair class, share by nice weight
+#define SCHED_FIFO   1  // rt class, runs until it blocks or a higher rt_priority arrives
+#define SCHED_RR     2  // rt class, round robin among equal rt_priority every SCHED_RR_SLICE_MS
+
+#define NICE_MIN          -20
+#define NICE_MAX          19
+#define NICE_0_WEIGHT     1024
+#define RT_PRIO_MAX       100   // rt_priority 1 ~ 99, higher runs first
+#define SCHED_RR_SLICE_MS 100
+#define SCHED_LATENCY_MS  125   // fair class: every queued thread runs once per period, for at least one tick
+
+// sched_class enqueue flags
+#define ENQUEUE_WAKEUP 1  // back from sleep
+#define ENQUEUE_NEW    2  // first time runnable
+#define ENQUEUE_YIELD  4  // switched out by sched_yield
+#define ENQUEUE_MIGRATE 8 // pulled over from another core's run queue
+
+// sched_class dequeue flags
+#define DEQUEUE_MIGRATE 8 // leaving for another core's run queue
+
+#define SCHED_BALANCE_TICKS 8  // periodic load balance every this many ticks of a core
+
 extern void switch_to(void *curr_context, void *next_context);
 extern void store_context(void *curr_context);
 extern void load_context(void *curr_context);
 extern void *get_current();
+extern void ret_from_create();
 
 typedef struct thread_context
 {
@@ -36,35 +69,184 @@ typedef struct thread
 {
     list_head_t      listhead;
     thread_context_t context;
-    char*            data;
-    unsigned int     datasize;
-    int              iszombie;
+    int              state;                             // THREAD_*, changed under the lock of its run queue
     int              pid;
-    int              isused;
-    char*            stack_alloced_ptr;
+    list_head_t      thread_node;                       // in thread_list
+    int              on_cpu;                            // running on some core right now, no other core may pick it
+    int              cpu;                               // run queue it belongs to, changed with both run queues locked
+    const struct sched_class *sched_class;
+    int              policy;                            // SCHED_*
+    int              nice;                              // NICE_MIN ~ NICE_MAX
+    int              rt_priority;                       // 1 ~ 99 for the rt class, 0 otherwise
+    unsigned long    weight;                            // from nice
+    unsigned long    vruntime;                          // fair class: cntpct ticks run, scaled by NICE_0_WEIGHT / weight
+    unsigned long    exec_start;                        // cntpct when run time was last charged
+    unsigned long    slice_exec;                        // cntpct ticks run since switched in
+    int              heap_idx;                          // fair class: index in the vruntime heap
+    int              yield;                             // sched_yield: let any queued thread go first
     char*            kernel_stack_alloced_ptr;
+    unsigned long    rss;                               // user pages mapped in this thread's page table
     void             (*signal_handler[SIGNAL_MAX+1])();
     int              sigcount[SIGNAL_MAX + 1];
     void             (*curr_signal_handler)();
     int              signal_is_checking;
     thread_context_t signal_saved_context;
+    list_head_t      sleep_wait;                        // sched_sleep_until sleeps here alone
+    timer_event_t    sleep_timer;                       // sched_sleep_until deadline
+    volatile int     sleep_expired;
+    timer_event_t    itimer;                            // ITIMER_REAL, raises SIGALRM
+    unsigned long    itimer_interval;                   // cntpct ticks between SIGALRMs, 0: one shot
+    fpsimd_state_t   fpsimd;                            // user FP/SIMD registers while they are not loaded
+    int              fpsimd_cpu;                        // core they were last loaded on, -1: none
+    unsigned long    asid;                              // generation << ASID_BITS | ASID, 0: none yet (asid.c)
     list_head_t      vma_list;
     char             curr_working_dir[MAX_PATH_NAME+1]; // Lab7 Basic Exercise 3
     struct file*     file_descriptors_table[MAX_FD+1];    // Lab7 Basic Exercise 3 
 } thread_t;
 
-extern thread_t    *curr_thread;
-extern list_head_t *run_queue;
-extern list_head_t *wait_queue;
-extern thread_t    threads[PIDMAX + 1];
+// the thread running on this core: tpidr_el1 holds &thread->context (switch_to sets it)
+static inline thread_t *get_curr_thread()
+{
+    unsigned long ctx;
+    __asm__ __volatile__("mrs %0, tpidr_el1\n\t" : "=r"(ctx));
+    return (thread_t *)(ctx - __builtin_offsetof(thread_t, context));
+}
+#define curr_thread get_curr_thread()
+
+static inline int signal_pending(thread_t *t)
+{
+    for (int i = 0; i <= SIGNAL_MAX; i++)
+    {
+        if (t->sigcount[i]) return 1;
+    }
+    return 0;
+}
+
+#define RT_BITMAP_WORDS ((RT_PRIO_MAX + 63) / 64)
+
+struct rt_rq
+{
+    list_head_t   queue[RT_PRIO_MAX];        // one FIFO list per rt_priority
+    unsigned long bitmap[RT_BITMAP_WORDS];   // non-empty lists
+};
+
+struct fair_rq
+{
+    thread_t    **heap;          // min-heap on vruntime, room for every thread (fair_reserve)
+    int           cap;
+    int           nr;
+    unsigned long load;          // weight of all queued threads
+    unsigned long min_vruntime;  // only moves forward, new and woken threads start from it
+};
+
+// One per core: the threads waiting for it, in their classes. A thread is queued on at most one.
+struct rq
+{
+    spinlock_t     lock;
+    int            cpu;
+    int            nr_queued;     // all classes
+    int            need_resched;  // set by tick or wakeup, irq_router calls schedule() on the way out
+    int            balance_tick;
+    thread_t      *curr;
+    thread_t      *prev;          // thread being switched away from, for schedule_tail
+    list_head_t    zombies;       // dead threads this core no longer runs, for kill_zombies
+    struct rt_rq   rt;
+    struct fair_rq fair;
+};
+
+extern struct rq runqueues[NR_CPUS];
+
+// Scheduling class: owns the queue of its runnable threads that are not running anywhere.
+// Called with rq->lock held. Classes are tried from rt down to fair, idle threads belong to none.
+struct sched_class
+{
+    const struct sched_class *next;                       // next lower class
+    void      (*enqueue)(struct rq *rq, thread_t *t, int flags);
+    void      (*dequeue)(struct rq *rq, thread_t *t, int flags);
+    thread_t *(*peek)(struct rq *rq);                     // best queued thread, 0 if none
+    int       (*preempts)(thread_t *t, thread_t *curr);   // same class: t should run instead of curr
+    void      (*charge)(struct rq *rq, thread_t *curr, unsigned long delta);
+    int       (*tick)(struct rq *rq, thread_t *curr);     // 1: curr has used up its slice
+};
+
+extern const struct sched_class rt_sched_class;
+extern const struct sched_class fair_sched_class;
+#define sched_class_highest (&rt_sched_class)
+
+static inline unsigned long sched_clock()
+{
+    unsigned long c;
+    __asm__ __volatile__("mrs %0, cntpct_el0\n\t" : "=r"(c));
+    return c;
+}
+
+static inline unsigned long sched_ms_to_ticks(unsigned long ms)
+{
+    unsigned long cntfrq_el0;
+    __asm__ __volatile__("mrs %0, cntfrq_el0\n\t" : "=r"(cntfrq_el0));
+    return cntfrq_el0 * ms / 1000;
+}
+
+extern list_head_t thread_list;    // every thread that has a pid, walk it with the BKL held
+extern thread_t   *idle_threads[NR_CPUS];
+
+static inline thread_t *thread_list_entry(list_head_t *pos)
+{
+    return (thread_t *)((char *)pos - __builtin_offsetof(thread_t, thread_node));
+}
 
-void      schedule_timer(char *notuse);
 void      init_thread_sched();
 void      idle();
 void      schedule();
+void      schedule_tail();
+void      sched_sleep_on(list_head_t *wq, volatile int *cond);
+void      sched_wake_up(thread_t *t);
+void      sched_wake_up_all(list_head_t *wq);
+void      sched_kill(thread_t *t);
+int       sched_sleep_until(unsigned long long deadline);
+void      sched_signal_wake(thread_t *t);
+unsigned long sched_wait_lock();
+void      sched_wait_unlock(unsigned long flags);
+int       sched_wait_sleep(list_head_t *wq, unsigned long *flags);
+void      sched_yield();
+int       sched_tick();
+int       sched_resched_pending();
+int       sched_set_policy(thread_t *t, int policy, int rt_priority, int nice);
+void      sched_fork(thread_t *child, thread_t *parent);
+int       sched_nr_queued();
+void      sched_balance();
+void      fair_init(struct rq *rq);
+int       fair_reserve(int n);
+void      rt_init(struct rq *rq);
+unsigned long nice_to_weight(int nice);
+thread_t *sched_create_idle(int cpu);
 void      kill_zombies();
 void      thread_exit();
-thread_t *thread_create(void *start, unsigned int filesize);
+thread_t *thread_alloc(void *start);
+thread_t *find_thread(int pid);
+void      thread_free(thread_t *t);
+void      sched_enqueue(thread_t *t);
+thread_t *thread_create(void *start);
 int       thread_exec(char *data, unsigned int filesize);
+void      thread_start_user();
+
+// Sleep on wq until condition is true, evaluates to 0 if the thread was killed first. condition is
+// evaluated with the wait queue lock held and interrupts masked: keep it to a few loads, no locks.
+// Whoever makes it true calls wake_up(wq) afterwards, the wakeup cannot slip in between the check
+// and the sleep.
+#define wait_event(wq, condition)                                            \
+    ({                                                                       \
+        unsigned long __flags = sched_wait_lock();                           \
+        int __ok;                                                            \
+        while (!(__ok = !!(condition)) && sched_wait_sleep(wq, &__flags));  \
+        sched_wait_unlock(__flags);                                          \
+        __ok;                                                                \
+    })
+
+// every thread sleeping on wq, from threads and interrupt handlers alike
+static inline void wake_up(list_head_t *wq)
+{
+    sched_wake_up_all(wq);
+}
 
 #endif /* _SCHED_H_ */
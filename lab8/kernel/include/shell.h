@@ -27,5 +27,9 @@ void do_cmd_setTimeout(char* msg, char* sec);
 void do_cmd_vfs();
 void do_cmd_initramfs();
 void do_cmd_reboot();
+void do_cmd_bench(char*);
+void do_cmd_slabinfo();
+void do_cmd_memtrace(char*);
+void do_cmd_ps();
 
 #endif /* _SHELL_H_ */
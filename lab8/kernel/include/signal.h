@@ -43,5 +43,6 @@ void signal_default_handler();
 void check_signal(trapframe_t *tpf);
 void run_signal(trapframe_t* tpf,int signal);
 void signal_handler_wrapper();
+void itimer_fire(void *thread);
 
 #endif /* _SIGNAL_H_ */
@@ -0,0 +1,42 @@
+#ifndef _SMP_H_
+#define _SMP_H_
+
+#include "bcm2837/rpi_mmu.h"
+
+#define NR_CPUS 4
+
+// Aff0 of mpidr_el1 is the core number on the BCM2837
+static inline int smp_processor_id()
+{
+    unsigned long mpidr;
+    __asm__ __volatile__("mrs %0, mpidr_el1\n\t" : "=r"(mpidr));
+    return mpidr & 0xff;
+}
+
+// the firmware parks core n polling this word, a non-zero value is the physical address it jumps to
+#define SPIN_TABLE_BASE 0xd8
+
+// QA7_rev3.4.pdf: ARM local interrupt controller, one register (or block of four mailboxes) per core
+#define CORE_MAILBOX_IRQ_CTRL(cpu)  ((volatile unsigned int *)(PHYS_TO_VIRT(0x40000050) + 4 * (cpu)))
+#define CORE_INTERRUPT_SOURCE(cpu)  ((volatile unsigned int *)(PHYS_TO_VIRT(0x40000060) + 4 * (cpu)))
+#define CORE_MAILBOX_SET(cpu, n)    ((volatile unsigned int *)(PHYS_TO_VIRT(0x40000080) + 0x10 * (cpu) + 4 * (n)))  // write 1s to set
+#define CORE_MAILBOX_CLR(cpu, n)    ((volatile unsigned int *)(PHYS_TO_VIRT(0x400000C0) + 0x10 * (cpu) + 4 * (n)))  // read, write 1s to clear
+#define INTERRUPT_SOURCE_MAILBOX(n) (1 << (4 + (n)))
+
+// inter-processor interrupts, one bit each in mailbox 0
+#define IPI_RESCHEDULE 0
+#define IPI_TIMER      1  // core 0: the first timer event changed, reprogram its timer
+
+extern unsigned long secondary_stack[NR_CPUS];  // stack tops handed to secondary_entry in boot.S
+extern volatile unsigned int cpu_online_mask;
+
+extern void secondary_entry();
+
+void smp_init();
+void secondary_main(int cpu);
+void smp_send_ipi(int cpu, int ipi);
+void smp_send_reschedule_others();
+void smp_handle_ipi(int cpu);
+int  smp_num_online();
+
+#endif /* _SMP_H_ */
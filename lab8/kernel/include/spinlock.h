@@ -0,0 +1,101 @@
+#ifndef _SPINLOCK_H_
+#define _SPINLOCK_H_
+
+#include "exception.h"
+#include "smp.h"
+
+// lock order: a lock may only be taken while every lock this core holds ranks lower (make LOCKDEP=1 checks it)
+enum lock_rank
+{
+    LOCK_RANK_BKL,       // lock(), everything not moved to a subsystem lock yet
+    LOCK_RANK_VFS,       // mount tree and vnode namespace
+    LOCK_RANK_TIMER,     // timer event list
+    LOCK_RANK_SLAB_LIST, // list of all slab caches
+    LOCK_RANK_SLAB,      // one slab cache's slab lists
+    LOCK_RANK_ZONE,      // buddy zone and frame_array
+    LOCK_RANK_WAITQUEUE, // wait lists and the sleep/wake transition
+    LOCK_RANK_RUNQUEUE,  // per-core run queue, RUNQUEUE + cpu: two are taken in cpu order. Any path may wake a thread
+    LOCK_RANK_ASID = LOCK_RANK_RUNQUEUE + NR_CPUS, // ASID allocator, only context_switch takes it, inside the run queue lock
+    LOCK_RANK_MEMTRACE,  // memtrace ring and histogram, innermost: recorded under the allocator locks
+};
+
+// Ticket lock: a locker draws next and waits until owner reaches its ticket, so cores get the lock
+// in arrival order. Both halves share one word, owner in the low half (little endian).
+typedef struct spinlock
+{
+    volatile unsigned short owner;
+    volatile unsigned short next;
+    const char *name;
+    int rank;
+} spinlock_t;
+
+#define SPINLOCK_INIT(lockname, lockrank) { .owner = 0, .next = 0, .name = lockname, .rank = lockrank }
+
+#ifndef LOCKDEP
+#define LOCKDEP 0
+#endif
+
+#if LOCKDEP
+void lockdep_acquire(spinlock_t *lock);
+void lockdep_release(spinlock_t *lock);
+void lockdep_assert_none_held(const char *where);
+#else
+static inline void lockdep_acquire(spinlock_t *lock) {}
+static inline void lockdep_release(spinlock_t *lock) {}
+static inline void lockdep_assert_none_held(const char *where) {}
+#endif
+
+static inline void spin_lock_init(spinlock_t *lock, const char *name, int rank)
+{
+    lock->owner = 0;
+    lock->next = 0;
+    lock->name = name;
+    lock->rank = rank;
+}
+
+// interrupts must be masked on this core, see spin_lock_irqsave
+static inline void spin_lock(spinlock_t *lock)
+{
+    unsigned int lockval, newval, tmp;
+    lockdep_acquire(lock);
+    __asm__ __volatile__("1: ldaxr %w0, [%3]\n\t"
+                         "add %w1, %w0, %w4\n\t"          // draw a ticket
+                         "stxr %w2, %w1, [%3]\n\t"
+                         "cbnz %w2, 1b\n\t"
+                         "eor %w1, %w0, %w0, ror #16\n\t" // ticket == owner: lock was free
+                         "cbz %w1, 3f\n\t"
+                         "sevl\n\t"
+                         "2: wfe\n\t"                     // the unlocker's store to owner wakes us
+                         "ldaxrh %w2, [%3]\n\t"
+                         "eor %w1, %w2, %w0, lsr #16\n\t"
+                         "cbnz %w1, 2b\n\t"
+                         "3:\n\t"
+                         : "=&r"(lockval), "=&r"(newval), "=&r"(tmp)
+                         : "r"(lock), "r"(1 << 16)
+                         : "memory");
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+    unsigned int tmp;
+    lockdep_release(lock);
+    __asm__ __volatile__("ldrh %w0, [%1]\n\t"
+                         "add %w0, %w0, #1\n\t"
+                         "stlrh %w0, [%1]\n\t" // serve the next ticket
+                         : "=&r"(tmp) : "r"(lock) : "memory");
+}
+
+static inline unsigned long spin_lock_irqsave(spinlock_t *lock)
+{
+    unsigned long flags = local_irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, unsigned long flags)
+{
+    spin_unlock(lock);
+    local_irq_restore(flags);
+}
+
+#endif /* _SPINLOCK_H_ */
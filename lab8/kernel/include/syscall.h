@@ -3,12 +3,14 @@
 
 #include "exception.h"
 #include "stddef.h"
+#include "timer.h"
 
 int    getpid(trapframe_t *tpf);
 size_t uartread(trapframe_t *tpf, char buf[], size_t size);
 size_t uartwrite(trapframe_t *tpf, const char buf[], size_t size);
 int    exec(trapframe_t *tpf, const char *name, char *const argv[]);
 int    fork(trapframe_t *tpf);
+int    spawn(trapframe_t *tpf, const char *name, char *const argv[]);
 void   exit(trapframe_t *tpf, int status);
 int    syscall_mbox_call(trapframe_t *tpf, unsigned char ch, unsigned int *mbox);
 void   kill(trapframe_t *tpf, int pid);
@@ -28,6 +30,13 @@ int    chdir(trapframe_t *tpf, const char *path);
 long   lseek64(trapframe_t *tpf, int fd, long offset, int whence);
 int    ioctl(trapframe_t *tpf, int fd, unsigned long request, void *info);
 
+int    nice(trapframe_t *tpf, int inc);
+int    sched_setscheduler(trapframe_t *tpf, int pid, int policy, int priority);
+int    sched_setparam(trapframe_t *tpf, int pid, int priority);
+int    nanosleep(trapframe_t *tpf, const struct timespec *req, struct timespec *rem);
+int    clock_gettime(trapframe_t *tpf, int clockid, struct timespec *ts);
+int    setitimer(trapframe_t *tpf, int which, const struct itimerval *new_value, struct itimerval *old_value);
+
 unsigned int get_file_size(char *thefilepath);
 char        *get_file_start(char *thefilepath);
 
@@ -1,29 +1,69 @@
 #ifndef _TIMER_H_
 #define _TIMER_H_
 
-#include "list.h"
 //https://github.com/Tekki/raspberrypi-documentation/blob/master/hardware/raspberrypi/bcm2836/QA7_rev3.4.pdf p13
 #define CORE0_TIMER_IRQ_CTRL PHYS_TO_VIRT(0x40000040)
+#define CORE_TIMER_IRQ_CTRL(cpu) ((volatile unsigned int *)(CORE0_TIMER_IRQ_CTRL + 4 * (cpu)))
 
+#define SCHED_TICK_SHIFT 5 // scheduler tick every cntfrq_el0 >> 5 cpu ticks (31.25ms), stopped while idle
+
+#define NSEC_PER_SEC 1000000000L
+#define USEC_PER_SEC 1000000L
+
+// clock_gettime clocks, both count cntpct_el0 from boot
+#define CLOCK_REALTIME  0
+#define CLOCK_MONOTONIC 1
+
+#define ITIMER_REAL 0 // setitimer: SIGALRM in real time, the only kind there is
+
+struct timespec
+{
+    long tv_sec;
+    long tv_nsec;
+};
+
+struct timeval
+{
+    long tv_sec;
+    long tv_usec;
+};
+
+struct itimerval
+{
+    struct timeval it_interval;  // period after the first expiry, 0: once
+    struct timeval it_value;     // until the first expiry, 0: disarmed
+};
+
+typedef void (*timer_callback_t)(void *ctx);
+
+// A timer lives wherever its owner keeps it, timer_setup once and then arm and cancel as needed
 typedef struct timer_event
 {
-    struct list_head listhead;
-    unsigned long long interrupt_time;
-    void *callback;
-    char *args;
+    unsigned long long interrupt_time;  // cntpct deadline
+    timer_callback_t   callback;
+    void              *ctx;
+    int                heap_idx;        // position in the timer heap, -1 while not armed
+    int                oneshot;         // allocated by add_timer, freed when it fires
 } timer_event_t;
 
-extern struct list_head *timer_event_list;
-
 void core_timer_enable();
 void core_timer_disable();
 void core_timer_handler();
+void timer_handle_ipi();
+void local_tick_enable();
+void tick_start();
+void tick_stop();
+int  tick_handle();
 
-void               add_timer(void *callback, unsigned long long timeout, char *args, int bytick);
+void               timer_setup(timer_event_t *timer, timer_callback_t callback, void *ctx);
+int                timer_arm(timer_event_t *timer, unsigned long long expires);
+int                timer_cancel(timer_event_t *timer);
+int                timer_cancel_sync(timer_event_t *timer);
+int                add_timer(timer_callback_t callback, void *ctx, unsigned long long timeout, int bytick);
 unsigned long long get_tick_plus_s(unsigned long long second);
 void               set_core_timer_interrupt(unsigned long long expired_time);
 void               set_core_timer_interrupt_by_tick(unsigned long long tick);
 void               timer_list_init();
-int                timer_list_get_size();
+int                timer_count();
 
 #endif /* _TIMER_H_ */
@@ -0,0 +1,37 @@
+#ifndef _VDSO_H_
+#define _VDSO_H_
+
+#include "smp.h"
+
+// One read-only page mapped into every process at USER_VDSO_VA. With cntpct_el0 readable from EL0,
+// a process gets the time from it without a syscall. The layout is ABI, user_bench/ulib.h mirrors it.
+#define VDSO_VERSION 1
+
+struct vdso_cpu
+{
+    unsigned long nr_switches;  // context switches on this core since boot
+    unsigned long nr_running;   // runnable threads here, queued plus the running one, at the last switch or tick
+};
+
+struct vdso_data
+{
+    unsigned int    version;
+    unsigned int    nr_cpus;
+    unsigned long   cntfrq;        // counter ticks per second
+    unsigned long   boot_cntpct;   // cntpct_el0 at boot, clock_gettime counts from here
+    unsigned long   tick_period;   // scheduler tick in counter ticks
+    struct vdso_cpu cpu[NR_CPUS];  // each written by its own core only, words are read without a lock
+};
+
+extern struct vdso_data *vdso_data;
+
+void vdso_init();
+
+// rq->lock held: this core switched threads or ticked
+static inline void vdso_update_cpu(int cpu, int nr_running, int switched)
+{
+    vdso_data->cpu[cpu].nr_switches += switched;
+    vdso_data->cpu[cpu].nr_running = nr_running;
+}
+
+#endif /* _VDSO_H_ */
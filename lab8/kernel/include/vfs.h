@@ -65,6 +65,9 @@ struct vnode_operations
                  const char *component_name);
 };
 
+extern struct kmem_cache *file_cache;
+extern struct kmem_cache *vnode_cache;
+
 int register_filesystem(struct filesystem *fs);
 int register_dev(struct file_operations* fo);
 struct filesystem *find_filesystem(const char *fs_name);
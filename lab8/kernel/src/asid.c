@@ -0,0 +1,115 @@
+#include "asid.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "smp.h"
+#include "string.h"
+#include "bcm2837/rpi_mmu.h"
+
+// thread->asid is generation << ASID_BITS | ASID, one from an older generation is replaced the next
+// time the thread is switched in. A number is taken for the rest of its generation, also after its
+// thread died: its TLB entries may still be around. When the numbers run out the generation moves
+// on, every core flushes its own TLB at its next switch, and the ASIDs the cores run right now keep
+// their numbers (reserved) so no thread has its ASID changed under it while it runs.
+#define ASID_FIRST_GENERATION (1UL << ASID_BITS)
+#define ASID_WORDS            ((1 << ASID_BITS) / 64)
+
+static spinlock_t    asid_lock = SPINLOCK_INIT("asid", LOCK_RANK_ASID);
+static unsigned long asid_generation = ASID_FIRST_GENERATION;
+static unsigned long asid_map[ASID_WORDS] = {1};                 // taken in this generation, 0 is never handed out
+static unsigned long asid_next = 1;                              // where the search for a free one starts
+static unsigned long active_asid[NR_CPUS];                       // what each core runs with, 0 since a rollover
+static unsigned long reserved_asid[NR_CPUS];                     // what each core ran with at the last rollover
+static unsigned int  tlb_flush_pending = (1 << NR_CPUS) - 1;     // cores that flush at their next switch, at
+                                                                 // boot too: the boot page table's global entries
+unsigned long asid_rollovers;
+int           asid_flush_every_switch;
+
+// asid_lock held
+static void asid_rollover()
+{
+    asid_generation += ASID_FIRST_GENERATION;
+    memset(asid_map, 0, sizeof(asid_map));
+    asid_map[0] = 1;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        unsigned long asid = active_asid[cpu];
+        if (!asid) asid = reserved_asid[cpu]; // has not switched since the last rollover, still runs this one
+        asid_map[(asid & ASID_MASK) / 64] |= 1UL << (asid & 63);
+        reserved_asid[cpu] = asid;
+        active_asid[cpu] = 0;
+    }
+    tlb_flush_pending = (1 << NR_CPUS) - 1;
+    asid_next = 1;
+    asid_rollovers++;
+}
+
+// asid_lock held: a core runs asid since before the rollover, it moves into this generation as is
+static int asid_update_reserved(unsigned long asid, unsigned long newasid)
+{
+    int hit = 0;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        if (reserved_asid[cpu] == asid)
+        {
+            reserved_asid[cpu] = newasid;
+            hit = 1;
+        }
+    }
+    return hit;
+}
+
+// asid_lock held: an ASID of this generation for a thread that had asid (0: none yet)
+static unsigned long asid_new(unsigned long asid)
+{
+    if (asid)
+    {
+        unsigned long newasid = asid_generation | (asid & ASID_MASK);
+        if (asid_update_reserved(asid, newasid)) return newasid;
+        // keep the number if nobody took it yet
+        unsigned long bit = 1UL << (asid & 63);
+        if (!(asid_map[(asid & ASID_MASK) / 64] & bit))
+        {
+            asid_map[(asid & ASID_MASK) / 64] |= bit;
+            return newasid;
+        }
+    }
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (unsigned long n = asid_next; n <= ASID_MASK; n++)
+        {
+            if (asid_map[n / 64] & (1UL << (n & 63))) continue;
+            asid_map[n / 64] |= 1UL << (n & 63);
+            asid_next = n + 1;
+            return asid_generation | n;
+        }
+        asid_rollover(); // the reserved ones are at most NR_CPUS, the second pass finds one
+    }
+    return 0;
+}
+
+// context_switch, interrupts masked: run t's page table under an ASID of the current generation
+void asid_switch_mm(thread_t *t)
+{
+    int cpu = smp_processor_id();
+    spin_lock(&asid_lock);
+    if ((t->asid ^ asid_generation) >> ASID_BITS)
+        t->asid = asid_new(t->asid);
+    int flush = tlb_flush_pending & (1 << cpu);
+    tlb_flush_pending &= ~(1 << cpu);
+    active_asid[cpu] = t->asid;
+    spin_unlock(&asid_lock);
+
+    unsigned long ttbr = ((unsigned long)t->context.pgd & ENTRY_ADDR_MASK) | (t->asid & ASID_MASK) << 48;
+    __asm__ __volatile__("msr ttbr0_el1, %0\n\t"
+                         "isb\n\t" :: "r"(ttbr));
+    // after the new ttbr0: nothing can walk the old table into the TLB again
+    if (asid_flush_every_switch)
+        __asm__ __volatile__("tlbi vmalle1is\n\t" // what every switch did before
+                             "dsb ish\n\t"
+                             "isb\n\t");
+    else if (flush)
+        __asm__ __volatile__("tlbi vmalle1\n\t" // this core only, the others flush at their own switch
+                             "dsb nsh\n\t"
+                             "isb\n\t");
+}
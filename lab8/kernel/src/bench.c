@@ -0,0 +1,500 @@
+#include "bench.h"
+#include "memory.h"
+#include "list.h"
+#include "string.h"
+#include "uart1.h"
+#include "exception.h"
+#include "sched.h"
+#include "smp.h"
+#include "timer.h"
+#include "asid.h"
+#include "mmu.h"
+
+#define BENCH_PAGES   0x4000  // 64MB worth of frames for the private allocator instances
+#define BENCH_LIVE    512     // blocks held at the same time during a storm
+#define BENCH_ROUNDS  16
+#define BENCH_RESERVE 64      // reserved ranges for the reserve benchmark
+#define BENCH_SMP_WORK (1 << 24) // loop iterations of one CPU-bound worker
+#define BENCH_SCHED_YIELDS   10000
+#define BENCH_SCHED_SLEEPERS 256   // blocked threads in the second round
+#define BENCH_TIMERS         10000
+#define BENCH_TIMER_STRIDE   7919    // prime, visits every timer once in a scattered order
+#define BENCH_SWITCH_ROUNDS  10000   // round trips of the ping-pong token
+#define BENCH_MEM_SIZE       0x100000 // 1MB, more than the 512KB L2
+#define BENCH_MEM_ROUNDS     16
+#define BENCH_MEM_ALLOCS     10000
+
+static unsigned long bench_seed;
+
+static unsigned int bench_rand()
+{
+    bench_seed = bench_seed * 6364136223846793005UL + 1442695040888963407UL;
+    return bench_seed >> 33;
+}
+
+void bench_init()
+{
+    __asm__ __volatile__("msr pmccfiltr_el0, xzr\n\t");       // count cycles in EL0 and EL1
+    __asm__ __volatile__("msr pmcntenset_el0, %0\n\t" :: "r"(1UL << 31));
+    __asm__ __volatile__("msr pmcr_el0, %0\n\t" :: "r"(1UL | (1UL << 2))); // enable, reset cycle counter
+}
+
+void bench_run(char *name)
+{
+    bench_init();
+    if (strcmp(name, "buddy") == 0)
+    {
+        bench_buddy();
+    }
+    else if (strcmp(name, "smp") == 0)
+    {
+        bench_smp();
+    }
+    else if (strcmp(name, "sched") == 0)
+    {
+        bench_sched();
+    }
+    else if (strcmp(name, "timer") == 0)
+    {
+        bench_timer();
+    }
+    else if (strcmp(name, "switch") == 0)
+    {
+        bench_switch();
+    }
+    else if (strcmp(name, "mem") == 0)
+    {
+        bench_mem();
+    }
+    else
+    {
+        uart_sendline("usage: bench [buddy|smp|sched|timer|switch|mem]\r\n");
+    }
+}
+
+// ------ list based buddy system (before bitmaps), kept as the baseline ------
+typedef struct legacy_frame
+{
+    struct list_head listhead;
+    int val;
+    int used;
+    unsigned int idx;
+} legacy_frame_t;
+
+static legacy_frame_t *legacy_frames;
+static list_head_t     legacy_freelist[FRAME_MAX_IDX];
+
+static legacy_frame_t *legacy_get_buddy(legacy_frame_t *frame)
+{
+    return &legacy_frames[frame->idx ^ (1 << frame->val)];
+}
+
+static legacy_frame_t *legacy_release_redundant(legacy_frame_t *frame)
+{
+    frame->val -= 1;
+    legacy_frame_t *buddy = legacy_get_buddy(frame);
+    buddy->val = frame->val;
+    list_add(&buddy->listhead, &legacy_freelist[buddy->val]);
+    return frame;
+}
+
+static legacy_frame_t *legacy_coalesce(legacy_frame_t *frame)
+{
+    legacy_frame_t *buddy = legacy_get_buddy(frame);
+    if (frame->val == FRAME_IDX_FINAL || frame->val != buddy->val || buddy->used == FRAME_ALLOCATED)
+        return (legacy_frame_t *)-1;
+    list_del_entry(&buddy->listhead);
+    frame->val += 1;
+    buddy->val += 1;
+    return buddy < frame ? buddy : frame;
+}
+
+static void legacy_init()
+{
+    for (int i = FRAME_IDX_0; i <= FRAME_IDX_FINAL; i++)
+        INIT_LIST_HEAD(&legacy_freelist[i]);
+    for (int i = 0; i < BENCH_PAGES; i++)
+    {
+        INIT_LIST_HEAD(&legacy_frames[i].listhead);
+        legacy_frames[i].idx = i;
+        legacy_frames[i].val = FRAME_IDX_FINAL;
+        legacy_frames[i].used = FRAME_FREE;
+        if (i % (1 << FRAME_IDX_FINAL) == 0)
+            list_add(&legacy_frames[i].listhead, &legacy_freelist[FRAME_IDX_FINAL]);
+    }
+}
+
+static long legacy_alloc(int val)
+{
+    int target_val;
+    for (target_val = val; target_val <= FRAME_IDX_FINAL; target_val++)
+    {
+        if (!list_empty(&legacy_freelist[target_val]))
+            break;
+    }
+    if (target_val > FRAME_IDX_FINAL)
+        return -1;
+    legacy_frame_t *frame = (legacy_frame_t *)legacy_freelist[target_val].next;
+    list_del_entry(&frame->listhead);
+    for (int j = target_val; j > val; j--)
+        legacy_release_redundant(frame);
+    frame->used = FRAME_ALLOCATED;
+    return frame->idx;
+}
+
+static void legacy_free(unsigned long pfn)
+{
+    legacy_frame_t *frame = &legacy_frames[pfn];
+    legacy_frame_t *temp;
+    frame->used = FRAME_FREE;
+    while ((temp = legacy_coalesce(frame)) != (legacy_frame_t *)-1) frame = temp;
+    list_add(&frame->listhead, &legacy_freelist[frame->val]);
+}
+
+static void legacy_reserve(unsigned long start, unsigned long end)
+{
+    for (int order = FRAME_IDX_FINAL; order >= 0; order--)
+    {
+        list_head_t *pos;
+        list_for_each(pos, &legacy_freelist[order])
+        {
+            unsigned long pagestart = ((legacy_frame_t *)pos)->idx;
+            unsigned long pageend = pagestart + (1 << order);
+            if (start <= pagestart && end >= pageend)
+            {
+                ((legacy_frame_t *)pos)->used = FRAME_ALLOCATED;
+                list_del_entry(pos);
+            }
+            else if (start >= pageend || end <= pagestart)
+            {
+                continue;
+            }
+            else
+            {
+                list_del_entry(pos);
+                list_head_t *temppos = pos->prev;
+                list_add(&legacy_release_redundant((legacy_frame_t *)pos)->listhead, &legacy_freelist[order - 1]);
+                pos = temppos;
+            }
+        }
+    }
+}
+
+// ------ alloc/free storm: both allocators replay the same random sequence ------
+static unsigned long bench_storm(buddy_zone_t *zone, long *live, int *orders)
+{
+    unsigned long cycles = 0;
+    bench_seed = 0x5eed;
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+    {
+        for (int i = 0; i < BENCH_LIVE; i++)
+            orders[i] = bench_rand() % 4;
+
+        unsigned long t0 = bench_cycles();
+        for (int i = 0; i < BENCH_LIVE; i++)
+            live[i] = zone ? buddy_zone_alloc(zone, orders[i]) : legacy_alloc(orders[i]);
+        cycles += bench_cycles() - t0;
+
+        // free in a shuffled order so coalescing does real work
+        for (int i = BENCH_LIVE - 1; i > 0; i--)
+        {
+            int j = bench_rand() % (i + 1);
+            long tp = live[i]; live[i] = live[j]; live[j] = tp;
+            int to = orders[i]; orders[i] = orders[j]; orders[j] = to;
+        }
+
+        t0 = bench_cycles();
+        for (int i = 0; i < BENCH_LIVE; i++)
+        {
+            if (live[i] < 0) continue;
+            if (zone) buddy_zone_free(zone, live[i], orders[i]);
+            else      legacy_free(live[i]);
+        }
+        cycles += bench_cycles() - t0;
+    }
+    return cycles;
+}
+
+static unsigned long bench_reserve(buddy_zone_t *zone)
+{
+    bench_seed = 0x7e5e;
+    unsigned long t0 = bench_cycles();
+    for (int i = 0; i < BENCH_RESERVE; i++)
+    {
+        unsigned long start = bench_rand() % BENCH_PAGES;
+        unsigned long end = start + 1 + bench_rand() % 0x200;
+        if (end > BENCH_PAGES) end = BENCH_PAGES;
+        if (zone) buddy_zone_reserve(zone, start, end);
+        else      legacy_reserve(start, end);
+    }
+    return bench_cycles() - t0;
+}
+
+void bench_buddy()
+{
+    long *live = kmalloc(BENCH_LIVE * sizeof(long));
+    int *orders = kmalloc(BENCH_LIVE * sizeof(int));
+    legacy_frames = kmalloc(BENCH_PAGES * sizeof(legacy_frame_t));
+    buddy_zone_t *zone = kmalloc(sizeof(buddy_zone_t));
+    void *metadata = kmalloc(buddy_zone_metadata_size(BENCH_PAGES));
+    unsigned long ops = 2 * BENCH_ROUNDS * BENCH_LIVE;
+
+    lock();
+    legacy_init();
+    unsigned long legacy_storm = bench_storm(0, live, orders);
+    buddy_zone_init(zone, BENCH_PAGES, metadata);
+    buddy_zone_free_range(zone, 0, BENCH_PAGES);
+    unsigned long bitmap_storm = bench_storm(zone, live, orders);
+
+    legacy_init();
+    unsigned long legacy_rsv = bench_reserve(0);
+    buddy_zone_init(zone, BENCH_PAGES, metadata);
+    buddy_zone_free_range(zone, 0, BENCH_PAGES);
+    unsigned long bitmap_rsv = bench_reserve(zone);
+    unlock();
+
+    uart_sendline("buddy alloc/free storm (%d ops, orders 0-3, %d live)\r\n", ops, BENCH_LIVE);
+    uart_sendline("    list   : %d cycles/op\r\n", legacy_storm / ops);
+    uart_sendline("    bitmap : %d cycles/op\r\n", bitmap_storm / ops);
+    uart_sendline("buddy reserve (%d ranges)\r\n", BENCH_RESERVE);
+    uart_sendline("    list   : %d cycles/range\r\n", legacy_rsv / BENCH_RESERVE);
+    uart_sendline("    bitmap : %d cycles/range\r\n", bitmap_rsv / BENCH_RESERVE);
+
+    kfree(metadata);
+    kfree(zone);
+    kfree(legacy_frames);
+    kfree(orders);
+    kfree(live);
+}
+
+// ------ SMP scaling: n kernel threads with the same CPU-bound loop each ------
+static volatile int bench_smp_done;
+
+static void bench_smp_worker()
+{
+    volatile unsigned long sum = 0;
+    for (unsigned long i = 0; i < BENCH_SMP_WORK; i++)
+        sum += i;
+    lock();
+    bench_smp_done++;
+    unlock();
+}
+
+void bench_smp()
+{
+    unsigned long long cntfrq_el0, t0, t1;
+    unsigned long one = 0;
+    __asm__ __volatile__("mrs %0, cntfrq_el0\n\t" : "=r"(cntfrq_el0));
+
+    uart_sendline("smp scaling (%d cores online, %d iterations per worker)\r\n", smp_num_online(), BENCH_SMP_WORK);
+    for (int n = 1; n <= NR_CPUS; n++)
+    {
+        bench_smp_done = 0;
+        __asm__ __volatile__("isb\n\tmrs %0, cntpct_el0\n\t" : "=r"(t0));
+        for (int i = 0; i < n; i++)
+            thread_create(bench_smp_worker);
+        while (bench_smp_done < n)
+            sched_yield(); // the shell only yields, the workers do the work
+        __asm__ __volatile__("isb\n\tmrs %0, cntpct_el0\n\t" : "=r"(t1));
+
+        unsigned long ticks = t1 - t0;
+        if (n == 1) one = ticks;
+        // n workers in the time of one: n * 100 percent is perfect scaling
+        uart_sendline("    %d workers : %d ms, speedup %d%%\r\n", n, (int)(ticks * 1000 / cntfrq_el0), (int)(one * n * 100 / ticks));
+    }
+}
+
+// ------ scheduler: a yield must not get slower with many threads blocked ------
+static LIST_HEAD(bench_sched_wait);
+static volatile int bench_sched_stop;
+static volatile int bench_sched_asleep;
+
+static void bench_sched_sleeper()
+{
+    lock();
+    bench_sched_asleep++;
+    unlock();
+    sched_sleep_on(&bench_sched_wait, &bench_sched_stop);
+}
+
+static unsigned long bench_sched_yields()
+{
+    unsigned long t0 = bench_cycles();
+    for (int i = 0; i < BENCH_SCHED_YIELDS; i++)
+        sched_yield();
+    return (bench_cycles() - t0) / BENCH_SCHED_YIELDS;
+}
+
+void bench_sched()
+{
+    uart_sendline("sched_yield() with nothing else runnable (%d yields)\r\n", BENCH_SCHED_YIELDS);
+    uart_sendline("    %4d blocked : %d cycles/yield\r\n", 0, bench_sched_yields());
+
+    bench_sched_stop = 0;
+    bench_sched_asleep = 0;
+    for (int i = 0; i < BENCH_SCHED_SLEEPERS; i++)
+        thread_create(bench_sched_sleeper);
+    while (bench_sched_asleep < BENCH_SCHED_SLEEPERS || sched_nr_queued())
+        sched_yield();
+    uart_sendline("    %4d blocked : %d cycles/yield\r\n", BENCH_SCHED_SLEEPERS, bench_sched_yields());
+
+    bench_sched_stop = 1;
+    sched_wake_up_all(&bench_sched_wait); // they exit, the reaper frees them
+}
+
+// ------ timers: arm and cancel many, none of them due ------
+typedef struct legacy_timer
+{
+    struct list_head listhead;
+    unsigned long long interrupt_time;
+} legacy_timer_t;
+
+static void bench_timer_nop(void *ctx)
+{
+}
+
+// the sorted list add_timer used before the heap
+static void legacy_timer_add(list_head_t *head, legacy_timer_t *timer)
+{
+    struct list_head *curr;
+    list_for_each(curr, head)
+    {
+        if (((legacy_timer_t *)curr)->interrupt_time > timer->interrupt_time) break;
+    }
+    list_add(&timer->listhead, curr->prev);
+}
+
+void bench_timer()
+{
+    timer_event_t *timers = kmalloc(BENCH_TIMERS * sizeof(timer_event_t));
+    legacy_timer_t *legacy = kmalloc(BENCH_TIMERS * sizeof(legacy_timer_t));
+    unsigned long long base = get_tick_plus_s(3600); // an hour out, nothing fires during the run
+    unsigned long t0;
+
+    bench_seed = 1;
+    for (int i = 0; i < BENCH_TIMERS; i++)
+    {
+        timer_setup(&timers[i], bench_timer_nop, 0);
+        legacy[i].interrupt_time = base + bench_rand();
+    }
+
+    uart_sendline("timer heap, %d timers\r\n", BENCH_TIMERS);
+    int failed = 0;
+    t0 = bench_cycles();
+    for (int i = 0; i < BENCH_TIMERS; i++)
+        failed |= timer_arm(&timers[i], legacy[i].interrupt_time);
+    uart_sendline("    arm    : %d cycles/timer\r\n", (bench_cycles() - t0) / BENCH_TIMERS);
+    if (failed)
+    {
+        uart_sendline("    out of memory arming the timers\r\n");
+        for (int i = 0; i < BENCH_TIMERS; i++)
+            timer_cancel(&timers[i]);
+        kfree(legacy);
+        kfree(timers);
+        return;
+    }
+
+    t0 = bench_cycles();
+    for (int i = 0; i < BENCH_TIMERS; i++)
+        timer_arm(&timers[i], base + bench_rand());
+    uart_sendline("    re-arm : %d cycles/timer\r\n", (bench_cycles() - t0) / BENCH_TIMERS);
+
+    t0 = bench_cycles();
+    for (int i = 0; i < BENCH_TIMERS; i++)
+        timer_cancel(&timers[(unsigned long)i * BENCH_TIMER_STRIDE % BENCH_TIMERS]);
+    uart_sendline("    cancel : %d cycles/timer\r\n", (bench_cycles() - t0) / BENCH_TIMERS);
+
+    list_head_t legacy_list;
+    INIT_LIST_HEAD(&legacy_list);
+    uart_sendline("sorted list (before), %d timers\r\n", BENCH_TIMERS);
+    t0 = bench_cycles();
+    for (int i = 0; i < BENCH_TIMERS; i++)
+        legacy_timer_add(&legacy_list, &legacy[i]);
+    uart_sendline("    arm    : %d cycles/timer\r\n", (bench_cycles() - t0) / BENCH_TIMERS);
+
+    kfree(legacy);
+    kfree(timers);
+}
+
+// ------ context switch: two threads hand a token back and forth, with and without a TLB flush per switch ------
+static LIST_HEAD(bench_switch_wait);
+static volatile int bench_switch_turn; // 0: the shell's, 1: the partner's, 2: the partner exits
+
+static void bench_switch_partner()
+{
+    while (1)
+    {
+        wait_event(&bench_switch_wait, bench_switch_turn != 0);
+        if (bench_switch_turn == 2) return;
+        bench_switch_turn = 0;
+        wake_up(&bench_switch_wait);
+    }
+}
+
+// ns per round trip, two switches at least (four when the partner runs on another core: both idle in between)
+static unsigned long bench_switch_round_trips()
+{
+    unsigned long t0 = sched_clock();
+    for (int i = 0; i < BENCH_SWITCH_ROUNDS; i++)
+    {
+        bench_switch_turn = 1;
+        wake_up(&bench_switch_wait);
+        wait_event(&bench_switch_wait, bench_switch_turn == 0);
+    }
+    return (sched_clock() - t0) * 1000000000UL / sched_ms_to_ticks(1000) / BENCH_SWITCH_ROUNDS;
+}
+
+void bench_switch()
+{
+    unsigned long rollovers = asid_rollovers;
+    bench_switch_turn = 0;
+    thread_create(bench_switch_partner);
+
+    uart_sendline("ping-pong between two threads (%d round trips)\r\n", BENCH_SWITCH_ROUNDS);
+    asid_flush_every_switch = 1;
+    uart_sendline("    tlbi vmalle1is per switch (before) : %d ns/round trip\r\n", bench_switch_round_trips());
+    asid_flush_every_switch = 0;
+    uart_sendline("    ASID, no flush                     : %d ns/round trip\r\n", bench_switch_round_trips());
+    uart_sendline("    ASID rollovers during the run      : %d\r\n", asid_rollovers - rollovers);
+
+    bench_switch_turn = 2;
+    wake_up(&bench_switch_wait); // it exits, the reaper frees it
+}
+
+// ------ memory: the same loops on uncached (MMU_RAM_NOCACHE=1, before) and write-back RAM ------
+static unsigned long bench_ns(unsigned long t0, unsigned long n)
+{
+    return (sched_clock() - t0) * 1000000000UL / sched_ms_to_ticks(1000) / n;
+}
+
+void bench_mem()
+{
+    char *src = kmalloc(BENCH_MEM_SIZE);
+    char *dst = kmalloc(BENCH_MEM_SIZE);
+    unsigned long t0;
+
+    uart_sendline("memory, RAM mapped %s\r\n", MMU_RAM_NOCACHE ? "non-cacheable (before)" : "write-back cacheable");
+    memset(src, 0x5a, BENCH_MEM_SIZE);
+
+    t0 = sched_clock();
+    for (int r = 0; r < BENCH_MEM_ROUNDS; r++)
+        memcpy(dst, src, BENCH_MEM_SIZE);
+    unsigned long ns = bench_ns(t0, BENCH_MEM_ROUNDS);
+    uart_sendline("    memcpy 1MB      : %d us, %d MB/s\r\n", ns / 1000, ns ? 1000000000UL / ns : 0);
+
+    volatile unsigned long sum = 0;
+    t0 = sched_clock();
+    for (int r = 0; r < BENCH_MEM_ROUNDS; r++)
+        for (unsigned long *p = (unsigned long *)src; p < (unsigned long *)(src + BENCH_MEM_SIZE); p++)
+            sum += *p;
+    ns = bench_ns(t0, BENCH_MEM_ROUNDS);
+    uart_sendline("    sum 1MB         : %d us, %d MB/s\r\n", ns / 1000, ns ? 1000000000UL / ns : 0);
+
+    t0 = sched_clock();
+    for (int i = 0; i < BENCH_MEM_ALLOCS; i++)
+        kfree(kmalloc(64 + (bench_rand() & 0x3ff)));
+    uart_sendline("    kmalloc + kfree : %d ns\r\n", bench_ns(t0, BENCH_MEM_ALLOCS));
+
+    kfree(dst);
+    kfree(src);
+}
@@ -0,0 +1,148 @@
+#include "compaction.h"
+#include "memory.h"
+#include "sched.h"
+#include "mmu.h"
+#include "timer.h"
+#include "exception.h"
+#include "string.h"
+#include "uart1.h"
+#include "cache.h"
+
+static int          compacting;        // compaction allocates, don't recurse from its own failures
+static volatile int kcompactd_pending;
+static LIST_HEAD(kcompactd_wait);      // page_malloc may wake it before kcompactd_init
+
+// Migration runs under the BKL but the owner is not stopped by it, it may get a core any time. Its
+// pages are unmapped and flushed before the copy: a store from another core then faults and the
+// fault handler waits for the BKL, after which it finds the new frame.
+
+// move one VMA's backing block below its current address, 1 on success
+static int compact_migrate_vma(thread_t *t, vm_area_struct_t *vma)
+{
+    char *old = (char *)PHYS_TO_VIRT(vma->phys_addr);
+    if (ksize(old) < PAGESIZE) return 0; // slab object, not page backed
+
+    char *new = kmalloc(vma->area_size);
+    if (!new) return 0;
+    if (new > old)
+    {
+        kfree(new);
+        return 0;
+    }
+
+    t->rss -= mmu_unmap_pages(t, vma->virt_addr, vma->area_size); // faulted in again from the new block
+    memcpy(new, old, vma->area_size);
+    if (vma->rwx & (0b1 << 2)) icache_sync(new, vma->area_size);
+    vma->phys_addr = VIRT_TO_PHYS((size_t)new);
+    kfree(old);
+    return 1;
+}
+
+// move the faulted-in frames of an anonymous VMA to lower pages, returns frames moved
+static int compact_migrate_anon(thread_t *t, vm_area_struct_t *vma)
+{
+    size_t *pgd_p = (size_t *)PHYS_TO_VIRT((size_t)t->context.pgd);
+    int moved = 0;
+    for (size_t s = 0; s < vma->area_size; s += PAGESIZE)
+    {
+        size_t *pte = mmu_find_pte(pgd_p, vma->virt_addr + s);
+        if (!pte || !*pte) continue;
+
+        char *old = (char *)PHYS_TO_VIRT((size_t)(*pte & ENTRY_ADDR_MASK));
+        if (page_refcount(old) > 1) continue; // shared after fork, other page tables point at it
+        char *new = kmalloc(PAGESIZE);
+        if (!new) break;
+        if (new > old)
+        {
+            kfree(new);
+            continue;
+        }
+        size_t entry = *pte;
+        *pte = 0;
+        mmu_flush_tlb_page(t, vma->virt_addr + s);
+        memcpy(new, old, PAGESIZE);
+        if (!(entry & PD_UNX)) icache_sync(new, PAGESIZE);
+        *pte = (entry & ~ENTRY_ADDR_MASK) | VIRT_TO_PHYS((size_t)new);
+        page_put(old);
+        moved++;
+    }
+    return moved;
+}
+
+int compact_memory(void)
+{
+    list_head_t *pos;
+    int moved = 0;
+
+    lock();
+    if (compacting)
+    {
+        unlock();
+        return 0;
+    }
+    compacting = 1;
+    for (int pass = 0; pass < COMPACT_MAX_PASSES; pass++)
+    {
+        int progress = 0;
+        list_head_t *tpos;
+        list_for_each(tpos, &thread_list)
+        {
+            thread_t *t = thread_list_entry(tpos);
+            // zombies are going away, new threads are still being built by spawn/fork outside the BKL,
+            // a running one would only fault on every page it is using
+            if (t->state == THREAD_ZOMBIE || t->state == THREAD_NEW || t->on_cpu) continue;
+            list_for_each(pos, &t->vma_list)
+            {
+                vm_area_struct_t *vma = (vm_area_struct_t *)pos;
+                if (vma->backing == VMA_ALLOCED && compact_migrate_vma(t, vma)) progress++;
+                else if (vma->backing == VMA_ANON) progress += compact_migrate_anon(t, vma);
+            }
+        }
+        moved += progress;
+        if (!progress || !memory_fragmented()) break;
+    }
+    compacting = 0;
+    unlock();
+    return moved;
+}
+
+void compaction_wakeup()
+{
+    kcompactd_pending = 1;
+    sched_wake_up_all(&kcompactd_wait);
+}
+
+static timer_event_t kcompactd_timer;
+
+static void kcompactd_timer_fire(void *notuse)
+{
+    if (memory_fragmented()) compaction_wakeup();
+    // out of memory: no more periodic checks, failing allocations still wake kcompactd
+    timer_arm(&kcompactd_timer, get_tick_plus_s(KCOMPACTD_PERIOD_SEC));
+}
+
+void kcompactd()
+{
+    while (1)
+    {
+        sched_sleep_on(&kcompactd_wait, &kcompactd_pending); // off the run queue until there is work
+        kcompactd_pending = 0;
+        int moved = compact_memory();
+        if (moved) uart_sendline("kcompactd: migrated %d blocks\r\n", moved);
+    }
+}
+
+void kcompactd_init()
+{
+    // background work, it only gets the core when nothing at nice 0 is left to run
+    thread_t *t = thread_alloc(kcompactd);
+    if (!t)
+    {
+        uart_sendline("kcompactd: out of memory, running without background compaction\r\n");
+        return;
+    }
+    sched_set_policy(t, SCHED_NORMAL, 0, NICE_MAX);
+    sched_enqueue(t);
+    timer_setup(&kcompactd_timer, kcompactd_timer_fire, 0);
+    timer_arm(&kcompactd_timer, get_tick_plus_s(KCOMPACTD_PERIOD_SEC));
+}
@@ -104,7 +104,7 @@ int dev_framebuffer_open(struct vnode *file_node, struct file **target)
 
 int dev_framebuffer_close(struct file *file)
 {
-    kfree(file);
+    kmem_cache_free(file_cache, file);
     return 0;
 }
 
@@ -39,7 +39,7 @@ int dev_uart_open(struct vnode *file_node, struct file **target)
 
 int dev_uart_close(struct file *file)
 {
-    kfree(file);
+    kmem_cache_free(file_cache, file);
     return 0;
 }
 
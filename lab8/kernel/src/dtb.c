@@ -4,6 +4,8 @@
 #include "string.h"
 #include "cpio.h"
 #include "memory.h"
+#include "memblock.h"
+#include "init.h"
 
 char* dtb_ptr;
 
@@ -125,7 +127,53 @@ void dtb_callback_initramfs(uint32_t node_type, char *name, void *value, uint32_
     }
 }
 
-void dtb_find_and_store_reserved_memory()
+// /memory reg is #address-cells + #size-cells big endian words per bank, cells come from the root node
+static int dtb_depth __initdata;
+static int dtb_in_memory_node __initdata;
+static int dtb_address_cells __initdata = 2;
+static int dtb_size_cells __initdata = 1;
+
+static unsigned long long __init dtb_read_cells(uint32_t *p, int cells)
+{
+    unsigned long long r = 0;
+    while (cells--) r = (r << 32) | uint32_endian_big2lttle(*p++);
+    return r;
+}
+
+void __init dtb_callback_memory(uint32_t node_type, char *name, void *value, uint32_t name_size)
+{
+    if (node_type == FDT_BEGIN_NODE)
+    {
+        dtb_depth++;
+        dtb_in_memory_node = dtb_depth == 2 && strncmp(name, "memory", 6) == 0;
+    }
+    else if (node_type == FDT_END_NODE)
+    {
+        dtb_depth--;
+        dtb_in_memory_node = 0;
+    }
+    else if (node_type == FDT_PROP && dtb_depth == 1 && strcmp(name, "#address-cells") == 0)
+    {
+        dtb_address_cells = uint32_endian_big2lttle(*(uint32_t *)value);
+    }
+    else if (node_type == FDT_PROP && dtb_depth == 1 && strcmp(name, "#size-cells") == 0)
+    {
+        dtb_size_cells = uint32_endian_big2lttle(*(uint32_t *)value);
+    }
+    else if (node_type == FDT_PROP && dtb_in_memory_node && strcmp(name, "reg") == 0)
+    {
+        uint32_t *cell = value;
+        int bank_cells = dtb_address_cells + dtb_size_cells;
+        for (int i = 0; i + bank_cells <= name_size / 4; i += bank_cells)
+        {
+            unsigned long long base = dtb_read_cells(cell + i, dtb_address_cells);
+            unsigned long long size = dtb_read_cells(cell + i + dtb_address_cells, dtb_size_cells);
+            memblock_add(base, size);
+        }
+    }
+}
+
+void __init dtb_find_and_store_reserved_memory()
 {
     struct fdt_header *header = (struct fdt_header *) dtb_ptr;
     if (uint32_endian_big2lttle(header->magic) != 0xD00DFEED)
@@ -141,12 +189,10 @@ void dtb_find_and_store_reserved_memory()
     // reserve memory which is defined by dtb
     while (reverse_entry->address != 0 || reverse_entry->size != 0)
     {
-        unsigned long long start = PHYS_TO_VIRT(uint64_endian_big2lttle(reverse_entry->address));
-        unsigned long long end   = uint64_endian_big2lttle(reverse_entry->size) + start;
-        memory_reserve(start, end);
+        memblock_reserve(uint64_endian_big2lttle(reverse_entry->address), uint64_endian_big2lttle(reverse_entry->size));
         reverse_entry++;
     }
 
     // reserve device tree itself
-    memory_reserve((unsigned long long)dtb_ptr, (unsigned long long)dtb_ptr + uint32_endian_big2lttle(header->totalsize));
+    memblock_reserve(VIRT_TO_PHYS((unsigned long long)dtb_ptr), uint32_endian_big2lttle(header->totalsize));
 }
@@ -7,6 +7,8 @@
 #include "sched.h"
 #include "signal.h"
 #include "mmu.h"
+#include "smp.h"
+#include "spinlock.h"
 
 void sync_64_router(trapframe_t* tpf)
 {
@@ -19,6 +21,11 @@ void sync_64_router(trapframe_t* tpf)
         mmu_memfail_abort_handle(esr);
         return;
     }
+    if (esr->ec == ESR_ELx_EC_FP_ASIMD)
+    {
+        fpsimd_access_trap();
+        return;
+    }
 
     el1_interrupt_enable();
     unsigned long long syscall_no = tpf->x8;
@@ -42,13 +49,42 @@ void sync_64_router(trapframe_t* tpf)
     else if (syscall_no == 17) { chdir(tpf, (char *)tpf->x0);                                                            }
     else if (syscall_no == 18) { lseek64(tpf, tpf->x0, tpf->x1, tpf->x2);                                                }
     else if (syscall_no == 19) { ioctl(tpf, tpf->x0, tpf->x1, (void*)tpf->x2);                                           }
+    else if (syscall_no == 20) { spawn(tpf, (char *)tpf->x0, (char **)tpf->x1);                                          }
+    else if (syscall_no == 21) { nice(tpf, tpf->x0);                                                                     }
+    else if (syscall_no == 22) { sched_setscheduler(tpf, tpf->x0, tpf->x1, tpf->x2);                                     }
+    else if (syscall_no == 23) { sched_setparam(tpf, tpf->x0, tpf->x1);                                                  }
+    else if (syscall_no == 24) { nanosleep(tpf, (struct timespec *)tpf->x0, (struct timespec *)tpf->x1);                 }
+    else if (syscall_no == 25) { clock_gettime(tpf, tpf->x0, (struct timespec *)tpf->x1);                                }
+    else if (syscall_no == 26) { setitimer(tpf, tpf->x0, (struct itimerval *)tpf->x1, (struct itimerval *)tpf->x2);      }
     else if (syscall_no == 50) { sigreturn(tpf);                                                                 }
+    check_signal(tpf); // a signal that cut a sleep short is delivered now, not at the next interrupt
     el1_interrupt_disable();
 }
 
+void el1_sync_router(trapframe_t* tpf)
+{
+    unsigned long long esr_el1, far_el1, elr_el1;
+    __asm__ __volatile__("mrs %0, esr_el1\n\t": "=r"(esr_el1));
+    __asm__ __volatile__("mrs %0, far_el1\n\t": "=r"(far_el1));
+    __asm__ __volatile__("mrs %0, elr_el1\n\t": "=r"(elr_el1));
+    esr_el1_t *esr = (esr_el1_t *)&esr_el1;
+    // kernel touching a user page which is not mapped (yet, or anymore after compaction): same as a user fault
+    if (esr->ec == MEMFAIL_DATA_ABORT_SAME && far_el1 < USER_ADDR_LIMIT)
+    {
+        mmu_memfail_abort_handle(esr);
+        return;
+    }
+    uart_sendline("[kernel panic] el1 sync exception, esr_el1 0x%x far_el1 0x%x elr_el1 0x%x\r\n", esr_el1, far_el1, elr_el1);
+    while (1);
+}
+
 void irq_router(trapframe_t* tpf)
 {
-    if (*IRQ_PENDING_1 & IRQ_PENDING_1_AUX_INT && *CORE0_INTERRUPT_SOURCE & INTERRUPT_SOURCE_GPU) {
+    int cpu = smp_processor_id();
+    unsigned int source = *CORE_INTERRUPT_SOURCE(cpu);
+
+    // GPU interrupts (uart) are routed to core 0 only
+    if (*IRQ_PENDING_1 & IRQ_PENDING_1_AUX_INT && source & INTERRUPT_SOURCE_GPU) {
         if (*AUX_MU_IIR_REG & (1 << 1)) // can write
         {
             *AUX_MU_IER_REG &= ~(2);  // disable write interrupt
@@ -61,15 +97,22 @@ void irq_router(trapframe_t* tpf)
             irqtask_add(uart_r_irq_handler, UART_IRQ_PRIORITY);
             irqtask_run_preemptive();
         }
-    } else if(*CORE0_INTERRUPT_SOURCE & INTERRUPT_SOURCE_CNTPNSIRQ) {
+    } else if(source & INTERRUPT_SOURCE_CNTPNSIRQ && cpu == 0) {
+        int tick = tick_handle();
         core_timer_disable();
         irqtask_add(core_timer_handler, TIMER_IRQ_PRIORITY);
         irqtask_run_preemptive();
         core_timer_enable();
-
-        el1_interrupt_disable();
-        if (run_queue->next->next != run_queue) schedule();
+        if (tick) sched_tick();
+    } else if (source & INTERRUPT_SOURCE_CNTPNSIRQ) {
+        // secondary cores: the timer is only a scheduler tick
+        if (tick_handle()) sched_tick();
+    } else if (source & INTERRUPT_SOURCE_MAILBOX(0)) {
+        smp_handle_ipi(cpu);
     }
+    // a tick that ended the slice or a wakeup that beats the running thread
+    el1_interrupt_disable();
+    if (sched_resched_pending()) schedule();
     if ((tpf->spsr_el1 & 0b1100) == 0) { check_signal(tpf); }
     el1_interrupt_disable();
 }
@@ -78,16 +121,26 @@ void invalid_exception_router(unsigned long long x0){
     // TBD
 }
 
-static unsigned long long lock_count = 0;
+// Big kernel lock: what has no subsystem lock of its own (signals, irq tasks, uart, page tables,
+// thread slots) still serializes here. lock() masks interrupts on this core and, at the outermost
+// level, takes the ticket lock shared by all cores. Nesting is counted per core, so it must never be
+// held across schedule().
+static unsigned long long lock_count[NR_CPUS];
+static spinlock_t kernel_lock = SPINLOCK_INIT("kernel_lock", LOCK_RANK_BKL);
+
 void lock()
 {
     el1_interrupt_disable();
-    lock_count++;
+    if (lock_count[smp_processor_id()]++ == 0)
+        spin_lock(&kernel_lock);
 }
 
 void unlock()
 {
-    lock_count--;
-    if (lock_count == 0)
+    int cpu = smp_processor_id();
+    if (--lock_count[cpu] == 0)
+    {
+        spin_unlock(&kernel_lock);
         el1_interrupt_enable();
+    }
 }
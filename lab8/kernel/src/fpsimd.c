@@ -0,0 +1,79 @@
+#include "fpsimd.h"
+#include "sched.h"
+#include "smp.h"
+#include "exception.h"
+#include "string.h"
+
+// whose state this core's registers hold. Only trusted together with owner->fpsimd_cpu == this core:
+// once the owner loads its state on another core, or is freed and its memory reused, the copy is stale.
+static struct thread *fpsimd_owner[NR_CPUS];
+
+static inline unsigned long cpacr_read()
+{
+    unsigned long cpacr;
+    __asm__ __volatile__("mrs %0, cpacr_el1\n\t" : "=r"(cpacr));
+    return cpacr;
+}
+
+static inline void cpacr_fpen(unsigned long fpen)
+{
+    unsigned long cpacr = (cpacr_read() & ~CPACR_FPEN_NO_TRAP) | fpen;
+    __asm__ __volatile__("msr cpacr_el1, %0\n\tisb\n\t" :: "r"(cpacr));
+}
+
+// interrupts masked: EL0 has the registers, they may differ from its save area
+static inline int fpsimd_live()
+{
+    return (cpacr_read() & CPACR_FPEN_NO_TRAP) == CPACR_FPEN_NO_TRAP;
+}
+
+// every core at boot, before it runs a thread
+void fpsimd_init_cpu()
+{
+    fpsimd_owner[smp_processor_id()] = 0;
+    cpacr_fpen(CPACR_FPEN_TRAP_EL0);
+}
+
+// context_switch, interrupts masked: keep what prev did to the registers. next gets access right
+// away if they still hold its state, else it traps on first use.
+void fpsimd_switch(thread_t *prev, thread_t *next)
+{
+    int cpu = smp_processor_id();
+    if (fpsimd_live() && fpsimd_owner[cpu] == prev)
+        fpsimd_save(&prev->fpsimd);
+    if (fpsimd_owner[cpu] == next && next->fpsimd_cpu == cpu)
+        cpacr_fpen(CPACR_FPEN_NO_TRAP);
+    else
+        cpacr_fpen(CPACR_FPEN_TRAP_EL0);
+}
+
+// EL0 used FP/SIMD with access off (sync_64_router, interrupts still masked): hand it its registers
+void fpsimd_access_trap()
+{
+    thread_t *t = curr_thread;
+    int cpu = smp_processor_id();
+    fpsimd_load(&t->fpsimd); // zeroed by thread_alloc for a thread that never used them
+    t->fpsimd_cpu = cpu;
+    fpsimd_owner[cpu] = t;
+    cpacr_fpen(CPACR_FPEN_NO_TRAP);
+}
+
+// fork, parent is the caller: the child starts with the registers as they are now
+void fpsimd_fork(thread_t *child, thread_t *parent)
+{
+    unsigned long flags = local_irq_save();
+    if (fpsimd_live() && fpsimd_owner[smp_processor_id()] == parent)
+        fpsimd_save(&parent->fpsimd);
+    local_irq_restore(flags);
+    memcpy(&child->fpsimd, &parent->fpsimd, sizeof(fpsimd_state_t));
+}
+
+// exec, t is the caller: the new image starts with zeroed registers, loaded on its first use
+void fpsimd_flush(thread_t *t)
+{
+    unsigned long flags = local_irq_save();
+    memset(&t->fpsimd, 0, sizeof(fpsimd_state_t));
+    t->fpsimd_cpu = -1;
+    cpacr_fpen(CPACR_FPEN_TRAP_EL0);
+    local_irq_restore(flags);
+}
@@ -57,7 +57,7 @@ int initramfs_setup_mount(struct filesystem *fs, struct mount *_mount)
 
 struct vnode *initramfs_create_vnode(struct mount *_mount, enum fsnode_type type)
 {
-    struct vnode *v = kmalloc(sizeof(struct vnode));
+    struct vnode *v = kmem_cache_alloc(vnode_cache);
     v->f_ops = &initramfs_file_operations;
     v->v_ops = &initramfs_vnode_operations;
     v->mount = _mount;
@@ -104,7 +104,7 @@ int initramfs_open(struct vnode *file_node, struct file **target)
 
 int initramfs_close(struct file *file)
 {
-    kfree(file);
+    kmem_cache_free(file_cache, file);
     return 0;
 }
 
@@ -5,16 +5,18 @@
 
 int curr_task_priority = 9999;
 struct list_head *task_list;
+static kmem_cache_t *irqtask_cache;
 
 void irqtask_init_list()
 {
+    irqtask_cache = kmem_cache_create("irqtask", sizeof(irqtask_t), 0, 0);
     task_list = kmalloc(sizeof(list_head_t));
     INIT_LIST_HEAD(task_list);
 }
 
 void irqtask_add(void *task_function,unsigned long long priority){
 
-    irqtask_t *the_task = kmalloc(sizeof(irqtask_t)); //need to kfree by task runner
+    irqtask_t *the_task = kmem_cache_alloc(irqtask_cache); //need to free by task runner
     the_task->priority = priority;
     the_task->task_function = task_function;
 
@@ -55,7 +57,7 @@ void irqtask_run_preemptive(){
         unlock();
         irqtask_run(the_task);
         curr_task_priority = prev_task_priority;
-        kfree(the_task);
+        kmem_cache_free(irqtask_cache, the_task);
     }
 }
 
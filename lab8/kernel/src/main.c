@@ -7,6 +7,12 @@
 #include "timer.h"
 #include "sched.h"
 #include "vfs.h"
+#include "mmu.h"
+#include "init.h"
+#include "compaction.h"
+#include "smp.h"
+#include "vdso.h"
+#include "fpsimd.h"
 
 void main(char* arg){
     char input_buffer[CMD_MAX_LEN];
@@ -15,18 +21,24 @@ void main(char* arg){
     traverse_device_tree(dtb_ptr, dtb_callback_initramfs); // get initramfs location from dtb
 
     init_allocator();
+    fpsimd_init_cpu();
 
     uart_init();
     irqtask_init_list();
     timer_list_init();
+    vdso_init();
+    mmu_init();
 
     init_thread_sched();
+    kcompactd_init();
 
     init_rootfs();
+    smp_init();
+    free_initmem();
 
     uart_interrupt_enable();
     el1_interrupt_enable();  // enable interrupt in EL1 -> EL1
-    core_timer_enable();
+    local_tick_enable();     // core 0's tick and timer events
 
 #if DEBUG
     cli_cmd_read(input_buffer); // Wait for input, Windows cannot attach to SERIAL from two processes.
@@ -1,11 +1,18 @@
 #include "bcm2837/rpi_mbox.h"
 #include "mbox.h"
+#include "cache.h"
+#include "bcm2837/rpi_mmu.h"
 
 /* Aligned to 16-byte boundary while we have 28-bits for VC */
 volatile unsigned int  __attribute__((aligned(16))) pt[36];
 
 int mbox_call( mbox_channel_type channel, unsigned int value )
 {
+    // the VideoCore reads and writes the buffer in memory, past the cores' data caches
+    unsigned int *buf = (unsigned int *)PHYS_TO_VIRT((unsigned long)(value & ~0xF));
+    unsigned int size = buf[0];
+    dcache_clean_inval(buf, size);
+
     // Add channel to lower 4 bit
     value &= ~(0xF);
     value |= channel;
@@ -16,8 +23,30 @@ int mbox_call( mbox_channel_type channel, unsigned int value )
         while ( *MBOX_STATUS & BCM_ARM_VC_MS_EMPTY ) {}
         // Read from Register
         if (value == *MBOX_READ)
+        {
+            dcache_clean_inval(buf, size); // lines fetched while the VideoCore wrote its answer
             return pt[1] == MBOX_REQUEST_SUCCEED;
+        }
     }
     return 0;
 }
 
+// MBOX_TAG_GET_ARM_MEMORY / MBOX_TAG_GET_VC_MEMORY: the firmware's view of the gpu_mem split
+int mbox_get_memory(mbox_tag_type tag, unsigned int *base, unsigned int *size)
+{
+    pt[0] = 8 * 4;
+    pt[1] = MBOX_REQUEST_PROCESS;
+    pt[2] = tag;
+    pt[3] = 8;
+    pt[4] = MBOX_TAG_REQUEST_CODE;
+    pt[5] = 0;
+    pt[6] = 0;
+    pt[7] = MBOX_TAG_LAST_BYTE;
+
+    if (!mbox_call(MBOX_TAGS_ARM_TO_VC, (unsigned int)((unsigned long)&pt)))
+        return 0;
+    *base = pt[5];
+    *size = pt[6];
+    return 1;
+}
+
@@ -0,0 +1,171 @@
+#include "memblock.h"
+#include "init.h"
+#include "uart1.h"
+#include "string.h"
+#include "bcm2837/rpi_mmu.h"
+
+memblock_t memblock __initdata = {
+    .limit = ~0ULL,
+    .memory.name = "memory",
+    .reserved.name = "reserved",
+};
+
+// insert [base, base + size) keeping the list sorted, merging overlapping and adjacent regions
+static void __init memblock_insert(memblock_type_t *type, unsigned long long base, unsigned long long size)
+{
+    if (!size) return;
+    unsigned long long end = base + size;
+
+    int i = 0;
+    while (i < type->cnt && type->regions[i].base + type->regions[i].size < base) i++;
+
+    int j = i;
+    while (j < type->cnt && type->regions[j].base <= end)
+    {
+        unsigned long long r_end = type->regions[j].base + type->regions[j].size;
+        if (type->regions[j].base < base) base = type->regions[j].base;
+        if (r_end > end) end = r_end;
+        j++;
+    }
+
+    // regions[i, j) collapse into one entry at i
+    if (j == i)
+    {
+        if (type->cnt == MEMBLOCK_MAX_REGIONS)
+        {
+            uart_sendline("memblock: %s table full, dropping 0x%x ~ 0x%x\r\n", type->name, base, end);
+            return;
+        }
+        for (int k = type->cnt; k > i; k--)
+            type->regions[k] = type->regions[k - 1];
+        type->cnt++;
+    }
+    else if (j - i > 1)
+    {
+        for (int k = j; k < type->cnt; k++)
+            type->regions[k - (j - i - 1)] = type->regions[k];
+        type->cnt -= j - i - 1;
+    }
+    type->regions[i].base = base;
+    type->regions[i].size = end - base;
+}
+
+void __init memblock_add(unsigned long long base, unsigned long long size)
+{
+    if (base >= memblock.limit) return;
+    if (base + size > memblock.limit) size = memblock.limit - base;
+    memblock_insert(&memblock.memory, base, size);
+}
+
+// cut [base, base + size) out of memory, e.g. RAM that belongs to the VideoCore
+void __init memblock_remove(unsigned long long base, unsigned long long size)
+{
+    memblock_type_t *type = &memblock.memory;
+    unsigned long long end = base + size;
+    for (int i = 0; i < type->cnt; i++)
+    {
+        memblock_region_t *rg = &type->regions[i];
+        unsigned long long r_end = rg->base + rg->size;
+        if (r_end <= base || rg->base >= end) continue;
+
+        if (rg->base < base && r_end > end)
+        {
+            // hole in the middle, keep both sides
+            rg->size = base - rg->base;
+            memblock_insert(type, end, r_end - end);
+            return;
+        }
+        if (rg->base < base)
+            rg->size = base - rg->base;
+        else if (r_end > end)
+        {
+            rg->base = end;
+            rg->size = r_end - end;
+        }
+        else
+        {
+            for (int k = i + 1; k < type->cnt; k++)
+                type->regions[k - 1] = type->regions[k];
+            type->cnt--;
+            i--;
+        }
+    }
+}
+
+unsigned long long __init memblock_end_of_memory()
+{
+    if (!memblock.memory.cnt) return 0;
+    memblock_region_t *last = &memblock.memory.regions[memblock.memory.cnt - 1];
+    return last->base + last->size;
+}
+
+void __init memblock_reserve(unsigned long long base, unsigned long long size)
+{
+    memblock_insert(&memblock.reserved, base, size);
+}
+
+// top-down first fit below memblock.limit, returned memory is zeroed and reserved
+void* __init memblock_alloc(unsigned long long size, unsigned long long align)
+{
+    size = (size + align - 1) & ~(align - 1);
+    for (int m = memblock.memory.cnt - 1; m >= 0; m--)
+    {
+        unsigned long long m_base = memblock.memory.regions[m].base;
+        unsigned long long end = memblock.memory.regions[m].base + memblock.memory.regions[m].size;
+        if (end > memblock.limit) end = memblock.limit;
+
+        while (end >= m_base + size)
+        {
+            unsigned long long start = (end - size) & ~(align - 1);
+            if (start < m_base) break;
+
+            // highest reserved region overlapping the candidate, if any
+            int r;
+            for (r = memblock.reserved.cnt - 1; r >= 0; r--)
+            {
+                memblock_region_t *rg = &memblock.reserved.regions[r];
+                if (rg->base < start + size && rg->base + rg->size > start) break;
+            }
+            if (r < 0)
+            {
+                memblock_reserve(start, size);
+                memset((void *)PHYS_TO_VIRT(start), 0, size);
+                return (void *)PHYS_TO_VIRT(start);
+            }
+            end = memblock.reserved.regions[r].base;
+        }
+    }
+    uart_sendline("memblock: cannot allocate 0x%x bytes\r\n", size);
+    return 0;
+}
+
+void __init memblock_for_each_free(void (*fn)(unsigned long long start, unsigned long long end))
+{
+    for (int m = 0; m < memblock.memory.cnt; m++)
+    {
+        unsigned long long start = memblock.memory.regions[m].base;
+        unsigned long long end = start + memblock.memory.regions[m].size;
+        for (int r = 0; r < memblock.reserved.cnt && start < end; r++)
+        {
+            memblock_region_t *rg = &memblock.reserved.regions[r];
+            if (rg->base + rg->size <= start) continue;
+            if (rg->base >= end) break;
+            if (rg->base > start) fn(start, rg->base);
+            start = rg->base + rg->size;
+        }
+        if (start < end) fn(start, end);
+    }
+}
+
+void __init memblock_dump()
+{
+    memblock_type_t *types[2] = {&memblock.memory, &memblock.reserved};
+    for (int t = 0; t < 2; t++)
+    {
+        for (int i = 0; i < types[t]->cnt; i++)
+        {
+            memblock_region_t *rg = &types[t]->regions[i];
+            uart_sendline("memblock %s: 0x%x ~ 0x%x\r\n", types[t]->name, rg->base, rg->base + rg->size);
+        }
+    }
+}
@@ -5,211 +5,381 @@
 #include "dtb.h"
 #include "cpio.h"
 #include "mmu.h"
-
-extern char  _heap_start;
-static char* htop_ptr = &_heap_start;
+#include "string.h"
+#include "memtrace.h"
+#include "memblock.h"
+#include "init.h"
+#include "mbox.h"
+#include "compaction.h"
+#include "spinlock.h"
 
 extern char  _kernel_start;
 extern char  _kernel_end;
-extern char  _stack_end;
-extern char  _stack_top;
 
-#ifdef DEBUG
+#if defined(DEBUG) || MEMTRACE_LEVEL >= 2
     #define memory_sendline(fmt, args ...) uart_sendline(fmt, ##args)
 #else
     #define memory_sendline(fmt, args ...) (void)0
 #endif
 
-// ------ Lab2 ------
-void* s_allocator(unsigned int size) {
-    // -> htop_ptr
-    // htop_ptr + 0x02:  heap_block size
-    // htop_ptr + 0x10 ~ htop_ptr + 0x10 * k:
-    //            { heap_block }
-    // -> htop_ptr
-
-    // 0x10 for heap_block header
-    char* r = htop_ptr + 0x10;
-    // size paddling to multiple of 0x10
-    size = 0x10 + size - size % 0x10;
-    *(unsigned int*)(r - 0x8) = size;
-    htop_ptr += size;
-    return r;
+// ------ Lab4 ------
+static frame_t*           frame_array;                    // store allocated block's order and cache order for each page
+static buddy_zone_t       buddy_zone;                     // free bitmaps of the buddy system
+static unsigned long      buddy_page_count;               // pages covered by frame_array and buddy_zone
+static kmem_cache_t       kmalloc_caches[CACHE_MAX_IDX];  // slab caches for 32B ~ 2KB kmalloc
+static const char*        kmalloc_cache_names[CACHE_MAX_IDX] = {"kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256", "kmalloc-512", "kmalloc-1k", "kmalloc-2k"};
+
+static kmem_cache_t       kmem_cache_cache;               // cache of kmem_cache_t for kmem_cache_create
+static list_head_t        kmem_cache_list;                // all caches, for stats
+
+static spinlock_t         zone_lock = SPINLOCK_INIT("zone", LOCK_RANK_ZONE);                       // buddy_zone and frame_array
+static spinlock_t         kmem_cache_list_lock = SPINLOCK_INIT("kmem_cache_list", LOCK_RANK_SLAB_LIST);
+
+static void slab_cache_setup(kmem_cache_t *cache, const char *name, unsigned int size, unsigned int align, void (*ctor)(void *));
+
+#define BUDDY_WORDS(bits) (((bits) + BUDDY_BITS_PER_WORD - 1) / BUDDY_BITS_PER_WORD)
+
+static inline int buddy_order_of(unsigned int size)
+{
+    // turn size into minimum 4KB * 2**order
+    unsigned long pages = (size + PAGESIZE - 1) / PAGESIZE;
+    if (pages <= 1) return FRAME_IDX_0;
+    return 64 - __builtin_clzl(pages - 1);
 }
 
-void s_free(void* ptr) {
-    // TBD
+static inline int buddy_test_free(buddy_zone_t *zone, int order, unsigned long blk)
+{
+    if ((blk << order) >= zone->page_count) return 0;
+    return (zone->map[order][blk / BUDDY_BITS_PER_WORD] >> (blk % BUDDY_BITS_PER_WORD)) & 1;
 }
 
-// ------ Lab4 ------
-static frame_t*           frame_array;                    // store memory's statement and page's corresponding index
-static list_head_t        frame_freelist[FRAME_MAX_IDX];  // store available block for page
-static list_head_t        cache_list[CACHE_MAX_IDX];      // store available block for cache
+static inline void buddy_set_free(buddy_zone_t *zone, int order, unsigned long blk)
+{
+    unsigned long w  = blk / BUDDY_BITS_PER_WORD;
+    unsigned long iw = w / BUDDY_BITS_PER_WORD;
+    if (!zone->map[order][w])
+    {
+        zone->index[order][iw] |= 1UL << (w % BUDDY_BITS_PER_WORD);
+        zone->summary[order]   |= 1UL << iw;
+    }
+    zone->map[order][w] |= 1UL << (blk % BUDDY_BITS_PER_WORD);
+    zone->nr_free[order]++;
+    zone->free_orders |= 1UL << order;
+}
+
+static inline void buddy_clear_free(buddy_zone_t *zone, int order, unsigned long blk)
+{
+    unsigned long w  = blk / BUDDY_BITS_PER_WORD;
+    unsigned long iw = w / BUDDY_BITS_PER_WORD;
+    zone->map[order][w] &= ~(1UL << (blk % BUDDY_BITS_PER_WORD));
+    if (!zone->map[order][w])
+    {
+        zone->index[order][iw] &= ~(1UL << (w % BUDDY_BITS_PER_WORD));
+        if (!zone->index[order][iw]) zone->summary[order] &= ~(1UL << iw);
+    }
+    if (--zone->nr_free[order] == 0) zone->free_orders &= ~(1UL << order);
+}
 
-void init_allocator()
+// lowest free block of this order, summary -> index -> map
+static inline unsigned long buddy_first_free(buddy_zone_t *zone, int order)
 {
-    frame_array = s_allocator(BUDDY_MEMORY_PAGE_COUNT * sizeof(frame_t));
+    unsigned long iw = __builtin_ctzl(zone->summary[order]);
+    unsigned long w  = iw * BUDDY_BITS_PER_WORD + __builtin_ctzl(zone->index[order][iw]);
+    return w * BUDDY_BITS_PER_WORD + __builtin_ctzl(zone->map[order][w]);
+}
 
-    // init frame_array
-    for (int i = 0; i < BUDDY_MEMORY_PAGE_COUNT; i++)
+unsigned long buddy_zone_metadata_size(unsigned long page_count)
+{
+    unsigned long words = 0;
+    for (int order = FRAME_IDX_0; order <= FRAME_IDX_FINAL; order++)
     {
-        if (i % (1 << FRAME_IDX_FINAL) == 0)
-        {
-            frame_array[i].val = FRAME_IDX_FINAL;
-            frame_array[i].used = FRAME_FREE;
-        }
+        unsigned long map_words = BUDDY_WORDS((page_count + (1UL << order) - 1) >> order);
+        words += map_words + BUDDY_WORDS(map_words);
     }
+    return words * sizeof(unsigned long);
+}
 
-    //init frame freelist
-    for (int i = FRAME_IDX_0; i <= FRAME_IDX_FINAL; i++)
+// metadata must hold buddy_zone_metadata_size(page_count) bytes, every page starts out reserved
+void buddy_zone_init(buddy_zone_t *zone, unsigned long page_count, void *metadata)
+{
+    unsigned long *p = metadata;
+    if (page_count > BUDDY_MAX_PAGES) page_count = BUDDY_MAX_PAGES;
+    memset(metadata, 0, buddy_zone_metadata_size(page_count));
+
+    zone->page_count = page_count;
+    zone->free_orders = 0;
+    for (int order = FRAME_IDX_0; order <= FRAME_IDX_FINAL; order++)
     {
-        INIT_LIST_HEAD(&frame_freelist[i]);
+        unsigned long map_words = BUDDY_WORDS((page_count + (1UL << order) - 1) >> order);
+        zone->map[order] = p;
+        p += map_words;
+        zone->index[order] = p;
+        p += BUDDY_WORDS(map_words);
+        zone->summary[order] = 0;
+        zone->nr_free[order] = 0;
     }
+}
 
-    //init cache list
-    for (int i = CACHE_IDX_0; i<= CACHE_IDX_FINAL; i++)
+long buddy_zone_alloc(buddy_zone_t *zone, int order)
+{
+    // find the smallest larger order which has a free block
+    unsigned long candidates = zone->free_orders & ~((1UL << order) - 1);
+    if (!candidates)
+        return -1;
+    int target_order = __builtin_ctzl(candidates);
+
+    unsigned long blk = buddy_first_free(zone, target_order);
+    buddy_clear_free(zone, target_order, blk);
+
+    // Release redundant memory block to separate into pieces, keep the lower half
+    for (int j = target_order; j > order; j--) // ex: 10000 -> 01111
+    {
+        blk <<= 1;
+        buddy_set_free(zone, j - 1, blk | 1);
+    }
+    return blk << order;
+}
+
+void buddy_zone_free(buddy_zone_t *zone, unsigned long pfn, int order)
+{
+    unsigned long blk = pfn >> order;
+    // coalesce with buddy while it is a free block of the same order: 2**i + 2**i = 2**(i+1)
+    while (order < FRAME_IDX_FINAL && buddy_test_free(zone, order, blk ^ 1))
     {
-        INIT_LIST_HEAD(&cache_list[i]);
+        buddy_clear_free(zone, order, blk ^ 1);
+        memory_sendline("    coalesce detected, merging 0x%x, 0x%x, -> val = %d\r\n", blk << order, (blk ^ 1) << order, order + 1);
+        blk >>= 1;
+        order++;
     }
+    buddy_set_free(zone, order, blk);
+}
 
-    for (int i = 0; i < BUDDY_MEMORY_PAGE_COUNT; i++)
+// hand [start_pfn, end_pfn) to the zone as the largest aligned blocks, merged with free neighbours
+void buddy_zone_free_range(buddy_zone_t *zone, unsigned long start_pfn, unsigned long end_pfn)
+{
+    if (end_pfn > zone->page_count) end_pfn = zone->page_count;
+    while (start_pfn < end_pfn)
     {
-        // init listhead for each frame
-        INIT_LIST_HEAD(&frame_array[i].listhead);
-        frame_array[i].idx = i;
-        frame_array[i].cache_order = CACHE_NONE;
+        int order = start_pfn ? __builtin_ctzl(start_pfn) : FRAME_IDX_FINAL;
+        if (order > FRAME_IDX_FINAL) order = FRAME_IDX_FINAL;
+        while (start_pfn + (1UL << order) > end_pfn) order--;
+        buddy_zone_free(zone, start_pfn, order);
+        start_pfn += 1UL << order;
+    }
+}
 
-        // add init frame (FRAME_IDX_FINAL) into freelist
-        if (i % (1 << FRAME_IDX_FINAL) == 0)
+// lowest run of free max-order blocks covering pages, the tail past pages goes back to the zone
+long buddy_zone_alloc_contig(buddy_zone_t *zone, unsigned long pages)
+{
+    int order = FRAME_IDX_FINAL;
+    unsigned long need = (pages + (1UL << order) - 1) >> order;
+    unsigned long nr_blk = zone->page_count >> order;
+    unsigned long run = 0;
+    if (!need || zone->nr_free[order] < need)
+        return -1;
+
+    for (unsigned long blk = 0; blk < nr_blk; blk++)
+    {
+        // skip a whole bitmap word of allocated blocks at once
+        if (blk % BUDDY_BITS_PER_WORD == 0 && !zone->map[order][blk / BUDDY_BITS_PER_WORD])
+        {
+            run = 0;
+            blk += BUDDY_BITS_PER_WORD - 1;
+            continue;
+        }
+        run = buddy_test_free(zone, order, blk) ? run + 1 : 0;
+        if (run == need)
         {
-            list_add(&frame_array[i].listhead, &frame_freelist[FRAME_IDX_FINAL]);
+            unsigned long first = blk + 1 - need;
+            for (unsigned long b = first; b <= blk; b++)
+                buddy_clear_free(zone, order, b);
+            buddy_zone_free_range(zone, (first << order) + pages, (blk + 1) << order);
+            return first << order;
         }
     }
+    return -1;
+}
 
-    /* Startup reserving the following region:
-    Spin tables for multicore boot (0x0000 - 0x1000)
-    Devicetree (Optional, if you have implement it)
-    Kernel image in the physical memory
-    Your simple allocator (startup allocator) (Stack + Heap in my case)
-    Initramfs
-    */
-    memory_sendline("\r\n* Startup Allocation *\r\n");
-    memory_sendline("buddy system: usable memory region: 0x%x ~ 0x%x\n", BUDDY_MEMORY_BASE, BUDDY_MEMORY_BASE + BUDDY_MEMORY_PAGE_COUNT * PAGESIZE);
-    dtb_find_and_store_reserved_memory(); // find spin tables in dtb
-    memory_reserve(PHYS_TO_VIRT(MMU_PGD_ADDR), PHYS_TO_VIRT(MMU_PTE_ADDR+0x2000)); // // PGD's page frame at 0x1000 // PUD's page frame at 0x2000 PMD 0x3000-0x5000
-    memory_reserve((unsigned long long)&_kernel_start, (unsigned long long)&_kernel_end); // kernel
-    memory_reserve((unsigned long long)&_stack_end, (unsigned long long)&_stack_top);  // heap & stack -> simple allocator
-    memory_reserve((unsigned long long)CPIO_DEFAULT_START, (unsigned long long)CPIO_DEFAULT_END);
+unsigned long buddy_zone_nr_free_pages(buddy_zone_t *zone)
+{
+    unsigned long pages = 0;
+    for (int order = FRAME_IDX_0; order <= FRAME_IDX_FINAL; order++)
+        pages += (unsigned long)zone->nr_free[order] << order;
+    return pages;
 }
 
-void* page_malloc(unsigned int size)
+// take [start_pfn, end_pfn) out of the zone, touching only the free blocks which overlap it
+void buddy_zone_reserve(buddy_zone_t *zone, unsigned long start_pfn, unsigned long end_pfn)
 {
-    memory_sendline("    [+] Allocate page - size : %d(0x%x)\r\n", size, size);
-    memory_sendline("        Before\r\n");
-    dump_page_info();
-    int val;
-    // turn size into minimum 4KB * 2**val
-    for (int i = FRAME_IDX_0; i <= FRAME_IDX_FINAL; i++)
+    if (end_pfn > zone->page_count) end_pfn = zone->page_count;
+    unsigned long pfn = start_pfn;
+    while (pfn < end_pfn)
     {
-
-        if (size <= (PAGESIZE << i))
+        int order;
+        for (order = FRAME_IDX_0; order <= FRAME_IDX_FINAL; order++)
         {
-            val = i;
-            memory_sendline("        block size = 0x%x\n", PAGESIZE << i);
-            break;
+            if (buddy_test_free(zone, order, pfn >> order)) break;
         }
-
-        if ( i == FRAME_IDX_FINAL)
+        // page is already in use, nothing to take
+        if (order > FRAME_IDX_FINAL)
         {
-            memory_sendline("[!] request size exceeded for page_malloc!!!!\r\n");
-            return (void*)0;
+            pfn++;
+            continue;
         }
 
+        unsigned long blk_start = (pfn >> order) << order;
+        unsigned long blk_end   = blk_start + (1UL << order);
+        buddy_clear_free(zone, order, pfn >> order);
+        memory_sendline("        Remove usable block for reserved memory: order %d\r\n", order);
+
+        // give back the parts of the block outside the reserved range
+        buddy_zone_free_range(zone, blk_start, start_pfn > blk_start ? start_pfn : blk_start);
+        buddy_zone_free_range(zone, end_pfn < blk_end ? end_pfn : blk_end, blk_end);
+        pfn = blk_end;
     }
+}
+
+// memblock callback: hand a free physical range to the buddy system, whole pages only
+static void __init init_allocator_free_range(unsigned long long start, unsigned long long end)
+{
+    buddy_zone_free_range(&buddy_zone, (start + PAGESIZE - 1) / PAGESIZE, end / PAGESIZE);
+}
 
-    // find the smallest larger frame in freelist
-    int target_val;
-    for (target_val = val; target_val <= FRAME_IDX_FINAL; target_val++)
+void __init init_allocator()
+{
+    /* Physical memory map:
+    RAM banks from the dtb /memory node, minus the VideoCore's share reported by the firmware
+    (gpu_mem), clipped below the peripherals since only that part is mapped as normal memory
+    */
+    unsigned int base, size;
+    memblock.limit = PERIPHERAL_END;
+    traverse_device_tree(dtb_ptr, dtb_callback_memory); // usable RAM from /memory
+    if (!memblock.memory.cnt && mbox_get_memory(MBOX_TAG_GET_ARM_MEMORY, &base, &size))
+        memblock_add(base, size);
+    if (!memblock.memory.cnt)
     {
-        // freelist does not have 2**i order frame, going for next order
-        if (!list_empty(&frame_freelist[target_val]))
-            break;
+        uart_sendline("init_allocator: no memory information, assuming 0x%x bytes\r\n", BUDDY_FALLBACK_MEMORY);
+        memblock_add(0, BUDDY_FALLBACK_MEMORY);
     }
-    if (target_val > FRAME_IDX_FINAL)
+    if (mbox_get_memory(MBOX_TAG_GET_VC_MEMORY, &base, &size))
+        memblock_remove(base, size);
+
+    /* Startup reserving the following region:
+    Spin tables for multicore boot (0x0000 - 0x1000)
+    Devicetree (Optional, if you have implement it)
+    Kernel image in the physical memory (boot stack included)
+    Initramfs
+    */
+    dtb_find_and_store_reserved_memory(); // find spin tables in dtb
+    memblock_reserve(MMU_PGD_BASE, MMU_PGTABLE_END - MMU_PGD_BASE); // boot and kernel PGD at 0x1000 and 0x2000, the kernel's PUD/PMD/PTE tables after them
+    memblock_reserve(VIRT_TO_PHYS((unsigned long long)&_kernel_start), &_kernel_end - &_kernel_start); // kernel image, init section included until free_initmem
+    memblock_reserve(VIRT_TO_PHYS((unsigned long long)CPIO_DEFAULT_START), (char *)CPIO_DEFAULT_END - (char *)CPIO_DEFAULT_START);
+
+    // size the zone to the highest bank, holes between banks are never freed into it
+    buddy_page_count = memblock_end_of_memory() / PAGESIZE;
+    if (buddy_page_count > BUDDY_MAX_PAGES) buddy_page_count = BUDDY_MAX_PAGES;
+
+    // allocator metadata, the only early allocations that stay for good
+    frame_array = memblock_alloc(buddy_page_count * sizeof(frame_t), PAGESIZE);
+    buddy_zone_init(&buddy_zone, buddy_page_count, memblock_alloc(buddy_zone_metadata_size(buddy_page_count), PAGESIZE));
+    memblock_dump();
+
+    // the buddy system starts out with exactly memory - reserved
+    memblock_for_each_free(init_allocator_free_range);
+
+    //init kmalloc caches, power of two classes stay aligned to their size up to a cache line
+    INIT_LIST_HEAD(&kmem_cache_list);
+    slab_cache_setup(&kmem_cache_cache, "kmem_cache", sizeof(kmem_cache_t), CACHE_LINE_SIZE, 0);
+    for (int i = CACHE_IDX_0; i<= CACHE_IDX_FINAL; i++)
     {
-        memory_sendline("[!] No available frame in freelist, page_malloc ERROR!!!!\r\n");
-        return (void*)0;
+        slab_cache_setup(&kmalloc_caches[i], kmalloc_cache_names[i], 32 << i, (32 << i) < CACHE_LINE_SIZE ? (32 << i) : CACHE_LINE_SIZE, 0);
     }
+    uart_sendline("buddy system: %d pages, %dK free\r\n", (int)buddy_page_count, (int)(buddy_zone_nr_free_pages(&buddy_zone) * (PAGESIZE / 1024)));
+}
 
-    // get the available frame from freelist
-    frame_t *target_frame_ptr = (frame_t*)frame_freelist[target_val].next;
-    list_del_entry((struct list_head *)target_frame_ptr);
+// boot is over: give the init section (boot-only code, memblock tables) to the buddy system
+void free_initmem()
+{
+    unsigned long start = VIRT_TO_PHYS((unsigned long long)&_init_start) / PAGESIZE;
+    unsigned long end   = VIRT_TO_PHYS((unsigned long long)&_init_end) / PAGESIZE;
+    mmu_kernel_protect((size_t)&_init_start, &_init_data - &_init_start, KERNEL_ATTR_DATA); // no longer text: rw, never executable, init data already is
+    unsigned long flags = spin_lock_irqsave(&zone_lock);
+    buddy_zone_free_range(&buddy_zone, start, end);
+    spin_unlock_irqrestore(&zone_lock, flags);
+    uart_sendline("Freeing init memory: %dK\r\n", (int)(end - start) * (PAGESIZE / 1024));
+}
 
-    // Release redundant memory block to separate into pieces
-    for (int j = target_val; j > val; j--) // ex: 10000 -> 01111
+void* page_malloc(unsigned int size)
+{
+    memory_sendline("    [+] Allocate page - size : %d(0x%x)\r\n", size, size);
+    memory_sendline("        Before\r\n");
+    memtrace_dump(dump_page_info);
+
+    int val = buddy_order_of(size);
+    if (val > FRAME_IDX_FINAL)
     {
-        release_redundant(target_frame_ptr);
+        memory_sendline("[!] request size exceeded for page_malloc!!!!\r\n");
+        return (void*)0;
+    }
+    memory_sendline("        block size = 0x%x\n", PAGESIZE << val);
+
+    unsigned long flags = spin_lock_irqsave(&zone_lock);
+    long pfn = buddy_zone_alloc(&buddy_zone, val);
+    if (pfn < 0)
+    {
+        spin_unlock_irqrestore(&zone_lock, flags);
+        memory_sendline("[!] No available frame in freelist, page_malloc ERROR!!!!\r\n");
+        compaction_wakeup();
+        return (void*)0;
     }
 
     // Allocate it
-    target_frame_ptr->used = FRAME_ALLOCATED;
-    memory_sendline("        physical address : 0x%x\n", BUDDY_MEMORY_BASE + (PAGESIZE*(target_frame_ptr->idx)));
+    frame_array[pfn].val = val;
+    frame_array[pfn].slab = 0;
+    frame_array[pfn].contig = 0;
+    frame_array[pfn].refcount = 1;
+    spin_unlock_irqrestore(&zone_lock, flags);
+    memory_sendline("        physical address : 0x%x\n", BUDDY_MEMORY_BASE + (PAGESIZE*pfn));
     memory_sendline("        After\r\n");
-    dump_page_info();
+    memtrace_dump(dump_page_info);
+    memtrace(MEMTRACE_PAGE_ALLOC, (void *)BUDDY_MEMORY_BASE + (PAGESIZE * pfn), PAGESIZE << val);
 
-    return (void *) BUDDY_MEMORY_BASE + (PAGESIZE * (target_frame_ptr->idx));
+    return (void *) BUDDY_MEMORY_BASE + (PAGESIZE * pfn);
 }
 
 void page_free(void* ptr)
 {
-    frame_t *target_frame_ptr = &frame_array[((unsigned long long)ptr - BUDDY_MEMORY_BASE) >> 12]; // PAGESIZE * Available Region -> 0x1000 * 0x10000000 // SPEC #1, #2
-    memory_sendline("    [+] Free page: 0x%x, val = %d\r\n",ptr, target_frame_ptr->val);
+    unsigned long pfn = ((unsigned long long)ptr - BUDDY_MEMORY_BASE) >> 12; // PAGESIZE * Available Region -> 0x1000 * 0x10000000 // SPEC #1, #2
+    memory_sendline("    [+] Free page: 0x%x, val = %d\r\n",ptr, frame_array[pfn].val);
     memory_sendline("        Before\r\n");
-    dump_page_info();
-    target_frame_ptr->used = FRAME_FREE;
-    frame_t* temp;
-    while ((temp = coalesce(target_frame_ptr)) != (frame_t *)-1)target_frame_ptr = temp;
-    list_add(&target_frame_ptr->listhead, &frame_freelist[target_frame_ptr->val]);
+    memtrace_dump(dump_page_info);
+    memtrace(MEMTRACE_PAGE_FREE, ptr, PAGESIZE << frame_array[pfn].val);
+    unsigned long flags = spin_lock_irqsave(&zone_lock);
+    buddy_zone_free(&buddy_zone, pfn, frame_array[pfn].val);
+    spin_unlock_irqrestore(&zone_lock, flags);
     memory_sendline("        After\r\n");
-    dump_page_info();
+    memtrace_dump(dump_page_info);
 }
 
-frame_t* release_redundant(frame_t *frame)
+void page_get(void *ptr)
 {
-    // order -1 -> add its buddy to free list (frame itself will be used in master function)
-    frame->val -= 1;
-    frame_t *buddyptr = get_buddy(frame);
-    buddyptr->val = frame->val;
-    list_add(&buddyptr->listhead, &frame_freelist[buddyptr->val]);
-    return frame;
+    unsigned long flags = spin_lock_irqsave(&zone_lock);
+    frame_array[((unsigned long long)ptr - BUDDY_MEMORY_BASE) >> 12].refcount++;
+    spin_unlock_irqrestore(&zone_lock, flags);
 }
 
-frame_t* get_buddy(frame_t *frame)
+void page_put(void *ptr)
 {
-    // XOR(idx, order)
-    return &frame_array[frame->idx ^ (1 << frame->val)];
+    unsigned long flags = spin_lock_irqsave(&zone_lock);
+    unsigned int refcount = --frame_array[((unsigned long long)ptr - BUDDY_MEMORY_BASE) >> 12].refcount;
+    spin_unlock_irqrestore(&zone_lock, flags);
+    if (refcount == 0)
+        kfree(ptr); // last mapping gone, nobody else can reach the frame
 }
 
-frame_t* coalesce(frame_t *frame_ptr)
+unsigned int page_refcount(void *ptr)
 {
-    frame_t *buddy = get_buddy(frame_ptr);
-    // frame is the boundary
-    if (frame_ptr->val == FRAME_IDX_FINAL)
-        return (frame_t*)-1;
-
-    // Order must be the same: 2**i + 2**i = 2**(i+1)
-    if (frame_ptr->val != buddy->val)
-        return (frame_t*)-1;
-
-    // buddy is in used
-    if (buddy->used == FRAME_ALLOCATED)
-        return (frame_t*)-1;
-
-    list_del_entry((struct list_head *)buddy);
-    frame_ptr->val += 1;
-    buddy->val += 1;
-    memory_sendline("    coalesce detected, merging 0x%x, 0x%x, -> val = %d\r\n", frame_ptr->idx, buddy->idx, frame_ptr->val);
-    return buddy < frame_ptr ? buddy : frame_ptr;
+    return frame_array[((unsigned long long)ptr - BUDDY_MEMORY_BASE) >> 12].refcount;
 }
 
 void dump_page_info(){
@@ -222,117 +392,362 @@ void dump_page_info(){
     }
     memory_sendline("|\r\n        | ");
     for (int i = FRAME_IDX_0; i <= FRAME_IDX_FINAL; i++)
-        memory_sendline("     %4d ", list_size(&frame_freelist[i]));
+        memory_sendline("     %4d ", buddy_zone.nr_free[i]);
     memory_sendline("|\r\n");
 }
 
 void dump_cache_info()
 {
-    unsigned int exp2 = 1;
-    memory_sendline("    -- [  Number of Available Cache Blocks ] --\r\n    | ");
+    memory_sendline("    -- [  Number of Slabs / Free Objects in Magazine ] --\r\n    | ");
     for (int i = CACHE_IDX_0; i <= CACHE_IDX_FINAL; i++)
-    {
-        memory_sendline("%4dB(%1d) ", 32*exp2, i);
-        exp2 *= 2;
-    }
+        memory_sendline("%11s ", kmalloc_caches[i].name);
     memory_sendline("|\r\n    | ");
     for (int i = CACHE_IDX_0; i <= CACHE_IDX_FINAL; i++)
-        memory_sendline("   %5d ", list_size(&cache_list[i]));
+        memory_sendline("  %4d/%4d ", kmalloc_caches[i].nr_slabs, kmalloc_caches[i].cpu_magazine[smp_processor_id()].avail);
     memory_sendline("|\r\n");
 }
 
-void page2caches(int order)
+// ------ Slab ------
+static void slab_cache_setup(kmem_cache_t *cache, const char *name, unsigned int size, unsigned int align, void (*ctor)(void *))
+{
+    if (align < sizeof(void *)) align = sizeof(void *);
+    cache->name = name;
+    cache->object_size = size;
+    cache->align = align;
+    cache->ctor = ctor;
+    // without a ctor the free link may overwrite the object, otherwise it lives right behind it
+    cache->free_offset = ctor ? (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1) : 0;
+    cache->stride = (cache->free_offset + (ctor ? sizeof(void *) : size) + align - 1) & ~(align - 1);
+    cache->first_offset = (sizeof(slab_t) + align - 1) & ~(align - 1);
+
+    // grow the slab until at least 8 objects fit
+    cache->slab_order = 0;
+    while (((PAGESIZE << cache->slab_order) - cache->first_offset) / cache->stride < 8 && cache->slab_order < 3)
+        cache->slab_order++;
+    cache->objs_per_slab = ((PAGESIZE << cache->slab_order) - cache->first_offset) / cache->stride;
+
+    INIT_LIST_HEAD(&cache->slabs_partial);
+    INIT_LIST_HEAD(&cache->slabs_full);
+    INIT_LIST_HEAD(&cache->slabs_free);
+    cache->nr_slabs = 0;
+    cache->nr_free_slabs = 0;
+    cache->nr_objs_free = 0;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++)
+        cache->cpu_magazine[cpu].avail = 0;
+    spin_lock_init(&cache->lock, name, LOCK_RANK_SLAB);
+
+    unsigned long flags = spin_lock_irqsave(&kmem_cache_list_lock);
+    list_add_tail(&cache->listhead, &kmem_cache_list);
+    spin_unlock_irqrestore(&kmem_cache_list_lock, flags);
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, unsigned int size, unsigned int align, void (*ctor)(void *obj))
+{
+    kmem_cache_t *cache = kmem_cache_alloc(&kmem_cache_cache);
+    if (!cache) return 0;
+    slab_cache_setup(cache, name, size, align, ctor);
+    return cache;
+}
+
+static inline slab_t *slab_of(void *obj)
 {
-    // make caches from a smallest-size page
-    char *page = page_malloc(PAGESIZE);
-    frame_t *pageframe_ptr = &frame_array[((unsigned long long)page - BUDDY_MEMORY_BASE) >> 12];
-    pageframe_ptr->cache_order = order;
+    unsigned long pfn = ((unsigned long long)obj - BUDDY_MEMORY_BASE) >> 12;
+    pfn -= frame_array[pfn].slab - 1;
+    return (slab_t *)(BUDDY_MEMORY_BASE + pfn * PAGESIZE);
+}
 
-    // split page into a lot of caches and push them into cache_list
-    int cachesize = (32 << order);
-    for (int i = 0; i < PAGESIZE; i += cachesize)
+// caller holds cache->lock
+static slab_t *slab_grow(kmem_cache_t *cache)
+{
+    char *page = page_malloc(PAGESIZE << cache->slab_order);
+    if (!page) return 0;
+
+    unsigned long pfn = ((unsigned long long)page - BUDDY_MEMORY_BASE) >> 12;
+    for (int i = 0; i < (1 << cache->slab_order); i++)
+        frame_array[pfn + i].slab = i + 1;
+
+    slab_t *slab = (slab_t *)page;
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->free = cache->objs_per_slab;
+    slab->freelist = 0;
+    for (int i = cache->objs_per_slab - 1; i >= 0; i--)
     {
-        list_head_t *c = (list_head_t *)(page + i);
-        list_add(c, &cache_list[order]);
+        char *obj = page + cache->first_offset + i * cache->stride;
+        if (cache->ctor) cache->ctor(obj);
+        *(void **)(obj + cache->free_offset) = slab->freelist;
+        slab->freelist = obj;
     }
+    list_add(&slab->listhead, &cache->slabs_partial);
+    cache->nr_slabs++;
+    cache->nr_objs_free += cache->objs_per_slab;
+    return slab;
 }
 
-void* cache_malloc(unsigned int size)
+// caller holds cache->lock
+static void *slab_take(kmem_cache_t *cache)
 {
-    memory_sendline("[+] Allocate cache - size : %d(0x%x)\r\n", size, size);
-    memory_sendline("    Before\r\n");
-    dump_cache_info();
+    slab_t *slab;
+    if (!list_empty(&cache->slabs_partial))
+    {
+        slab = (slab_t *)cache->slabs_partial.next;
+    }
+    else if (!list_empty(&cache->slabs_free))
+    {
+        slab = (slab_t *)cache->slabs_free.next;
+        list_del_entry(&slab->listhead);
+        list_add(&slab->listhead, &cache->slabs_partial);
+        cache->nr_free_slabs--;
+    }
+    else if (!(slab = slab_grow(cache)))
+    {
+        return 0;
+    }
 
-    // turn size into cache order: 32B * 2**order
-    int order;
-    for (int i = CACHE_IDX_0; i <= CACHE_IDX_FINAL; i++)
+    char *obj = slab->freelist;
+    slab->freelist = *(void **)(obj + cache->free_offset);
+    slab->inuse++;
+    cache->nr_objs_free--;
+    if (--slab->free == 0)
+    {
+        list_del_entry(&slab->listhead);
+        list_add(&slab->listhead, &cache->slabs_full);
+    }
+    return obj;
+}
+
+// caller holds cache->lock
+static void slab_put(kmem_cache_t *cache, void *ptr)
+{
+    slab_t *slab = slab_of(ptr);
+    *(void **)((char *)ptr + cache->free_offset) = slab->freelist;
+    slab->freelist = ptr;
+    slab->inuse--;
+    cache->nr_objs_free++;
+    if (slab->free++ == 0)
+    {
+        list_del_entry(&slab->listhead);
+        list_add(&slab->listhead, &cache->slabs_partial);
+    }
+    if (slab->inuse == 0)
+    {
+        list_del_entry(&slab->listhead);
+        if (cache->nr_free_slabs < SLAB_KEEP_FREE)
+        {
+            list_add(&slab->listhead, &cache->slabs_free);
+            cache->nr_free_slabs++;
+        }
+        else
+        {
+            // give the empty slab back to the buddy system
+            cache->nr_slabs--;
+            cache->nr_objs_free -= cache->objs_per_slab;
+            page_free(slab);
+        }
+    }
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+    // fast path: this CPU's magazine, no lock
+    unsigned long flags = local_irq_save();
+    kmem_magazine_t *mag = &cache->cpu_magazine[smp_processor_id()];
+    if (mag->avail)
     {
-        if (size <= (32 << i)) { order = i; break; }
+        void *r = mag->objs[--mag->avail];
+        local_irq_restore(flags);
+        memtrace(MEMTRACE_CACHE_ALLOC, r, cache->object_size);
+        return r;
     }
 
-    // if no available cache in list, assign one page for it
-    if (list_empty(&cache_list[order]))
+    // slow path: refill half a magazine from the slabs, still on this CPU with interrupts masked
+    spin_lock(&cache->lock);
+    while (mag->avail < SLAB_MAGAZINE_SIZE / 2)
     {
-        page2caches(order);
+        void *obj = slab_take(cache);
+        if (!obj) break;
+        mag->objs[mag->avail++] = obj;
     }
+    void *r = mag->avail ? mag->objs[--mag->avail] : 0;
+    spin_unlock_irqrestore(&cache->lock, flags);
+    memtrace(MEMTRACE_CACHE_ALLOC, r, cache->object_size);
+    return r;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *ptr)
+{
+    memtrace(MEMTRACE_CACHE_FREE, ptr, cache->object_size);
+    // fast path: this CPU's magazine, no lock
+    unsigned long flags = local_irq_save();
+    kmem_magazine_t *mag = &cache->cpu_magazine[smp_processor_id()];
+    if (mag->avail < SLAB_MAGAZINE_SIZE)
+    {
+        mag->objs[mag->avail++] = ptr;
+        local_irq_restore(flags);
+        return;
+    }
+
+    // slow path: flush half of the magazine back to the slabs
+    spin_lock(&cache->lock);
+    slab_put(cache, ptr);
+    while (mag->avail > SLAB_MAGAZINE_SIZE / 2)
+        slab_put(cache, mag->objs[--mag->avail]);
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+void* cache_malloc(unsigned int size)
+{
+    memory_sendline("[+] Allocate cache - size : %d(0x%x)\r\n", size, size);
+    memory_sendline("    Before\r\n");
+    memtrace_dump(dump_cache_info);
+
+    // turn size into cache order: 32B * 2**order
+    int order = size <= 32 ? CACHE_IDX_0 : 64 - __builtin_clzl(size - 1) - 5;
+    void *r = kmem_cache_alloc(&kmalloc_caches[order]);
 
-    list_head_t* r = cache_list[order].next;
-    list_del_entry(r);
     memory_sendline("    physical address : 0x%x\n", r);
     memory_sendline("    After\r\n");
-    dump_cache_info();
+    memtrace_dump(dump_cache_info);
     return r;
 }
 
 void cache_free(void *ptr)
 {
-    list_head_t *c = (list_head_t *)ptr;
-    frame_t *pageframe_ptr = &frame_array[((unsigned long long)ptr - BUDDY_MEMORY_BASE) >> 12];
-    memory_sendline("[+] Free cache: 0x%x, val = %d\r\n",ptr, pageframe_ptr->cache_order);
+    kmem_cache_t *cache = slab_of(ptr)->cache;
+    memory_sendline("[+] Free cache: 0x%x, cache = %s\r\n", ptr, cache->name);
     memory_sendline("    Before\r\n");
-    dump_cache_info();
-    list_add(c, &cache_list[pageframe_ptr->cache_order]);
+    memtrace_dump(dump_cache_info);
+    kmem_cache_free(cache, ptr);
     memory_sendline("    After\r\n");
-    dump_cache_info();
+    memtrace_dump(dump_cache_info);
+}
+
+// bytes a kmalloc of this size would really occupy
+static unsigned int kmalloc_bucket_size(unsigned int size)
+{
+    if (size > (32 << CACHE_IDX_FINAL))
+        return PAGESIZE << buddy_order_of(size);
+    return size <= 32 ? 32 : 1 << (64 - __builtin_clzl(size - 1));
+}
+
+void kmem_cache_dump_stats()
+{
+    list_head_t *pos;
+    uart_sendline("  size stride objs/slab slabs active kmalloc saved(B)  name\r\n");
+    unsigned long flags = spin_lock_irqsave(&kmem_cache_list_lock);
+    list_for_each(pos, &kmem_cache_list)
+    {
+        kmem_cache_t *cache = (kmem_cache_t *)pos;
+        unsigned int active = cache->nr_slabs * cache->objs_per_slab - cache->nr_objs_free;
+        for (int cpu = 0; cpu < NR_CPUS; cpu++)
+            active -= cache->cpu_magazine[cpu].avail;
+        int saved = ((int)kmalloc_bucket_size(cache->object_size) - (int)cache->stride) * (int)active;
+        uart_sendline("%6d %6d %9d %5d %6d %7d %8d  %s\r\n", cache->object_size, cache->stride, cache->objs_per_slab,
+                      cache->nr_slabs, active, kmalloc_bucket_size(cache->object_size), saved, cache->name);
+    }
+    spin_unlock_irqrestore(&kmem_cache_list_lock, flags);
+}
+
+void *alloc_contig(unsigned long size)
+{
+    unsigned long pages = (size + PAGESIZE - 1) / PAGESIZE;
+    unsigned long flags = spin_lock_irqsave(&zone_lock);
+    long pfn = buddy_zone_alloc_contig(&buddy_zone, pages);
+    spin_unlock_irqrestore(&zone_lock, flags);
+    if (pfn < 0 && compact_memory())
+    {
+        // direct compaction (it allocates, so not under zone_lock) moved something, retry once
+        flags = spin_lock_irqsave(&zone_lock);
+        pfn = buddy_zone_alloc_contig(&buddy_zone, pages);
+        spin_unlock_irqrestore(&zone_lock, flags);
+    }
+    if (pfn < 0)
+    {
+        uart_sendline("[!] alloc_contig: no 0x%x bytes of contiguous memory\r\n", size);
+        return 0;
+    }
+    frame_array[pfn].val = FRAME_IDX_FINAL; // the run is ours alone, nobody looks at it before we return
+    frame_array[pfn].slab = 0;
+    frame_array[pfn].contig = pages;
+    memtrace(MEMTRACE_PAGE_ALLOC, (void *)BUDDY_MEMORY_BASE + PAGESIZE * pfn, pages * PAGESIZE);
+    return (void *)BUDDY_MEMORY_BASE + PAGESIZE * pfn;
+}
+
+void free_contig(void *ptr)
+{
+    unsigned long pfn = ((unsigned long long)ptr - BUDDY_MEMORY_BASE) >> 12;
+    unsigned long pages = frame_array[pfn].contig;
+    memtrace(MEMTRACE_PAGE_FREE, ptr, pages * PAGESIZE);
+    unsigned long flags = spin_lock_irqsave(&zone_lock);
+    frame_array[pfn].contig = 0;
+    buddy_zone_free_range(&buddy_zone, pfn, pfn + pages);
+    spin_unlock_irqrestore(&zone_lock, flags);
+}
+
+// usable bytes behind a kmalloc pointer
+unsigned long ksize(void *ptr)
+{
+    frame_t *frame = &frame_array[((unsigned long long)ptr - BUDDY_MEMORY_BASE) >> 12];
+    if (frame->slab)
+        return slab_of(ptr)->cache->object_size;
+    if (frame->contig)
+        return (unsigned long)frame->contig * PAGESIZE;
+    return PAGESIZE << frame->val;
+}
+
+// enough free memory for a max-order block, but no max-order block left
+int memory_fragmented()
+{
+    return !(buddy_zone.free_orders & (1UL << FRAME_IDX_FINAL)) &&
+           buddy_zone_nr_free_pages(&buddy_zone) >= (1UL << FRAME_IDX_FINAL);
 }
 
 void *kmalloc(unsigned int size)
 {
-    lock();
     memory_sendline("\n\n");
     memory_sendline("================================\r\n");
     memory_sendline("[+] Request kmalloc size: %d\r\n", size);
     memory_sendline("================================\r\n");
+    // beyond the largest buddy block, go for a contiguous run
+    if (size > (PAGESIZE << FRAME_IDX_FINAL))
+    {
+        void *r = alloc_contig(size);
+        memtrace(MEMTRACE_KMALLOC, r, size);
+        return r;
+    }
     // if size is larger than cache size, go for page
     if (size > (32 << CACHE_IDX_FINAL))
     {
         void *r = page_malloc(size);
-        unlock();
+        memtrace(MEMTRACE_KMALLOC, r, size);
         return r;
     }
-    // go for cache
+    // go for cache, the slab layer takes the cache's lock only on a magazine miss
     void *r = cache_malloc(size);
-    unlock();
+    memtrace(MEMTRACE_KMALLOC, r, size);
     return r;
 }
 
 void kfree(void *ptr)
 {
-    lock();
     memory_sendline("\n\n");
     memory_sendline("==========================\r\n");
     memory_sendline("[+] Request kfree 0x%x\r\n", ptr);
     memory_sendline("==========================\r\n");
-    // If no cache assigned, go for page
-    if ((unsigned long long)ptr % PAGESIZE == 0 && frame_array[((unsigned long long)ptr - BUDDY_MEMORY_BASE) >> 12].cache_order == CACHE_NONE)
+    memtrace(MEMTRACE_KFREE, ptr, ksize(ptr));
+    if (frame_array[((unsigned long long)ptr - BUDDY_MEMORY_BASE) >> 12].contig)
+    {
+        free_contig(ptr);
+        return;
+    }
+    // If no slab owns the page, go for page
+    if (!frame_array[((unsigned long long)ptr - BUDDY_MEMORY_BASE) >> 12].slab)
     {
         page_free(ptr);
-        unlock();
         return;
     }
     // go for cache
     cache_free(ptr);
-    unlock();
 }
 
 void memory_reserve(unsigned long long start, unsigned long long end)
@@ -344,37 +759,9 @@ void memory_reserve(unsigned long long start, unsigned long long end)
     uart_sendline("start 0x%x ~ ", start);
     uart_sendline("end 0x%x\r\n",end);
 
-    // delete page from free list
-    for (int order = FRAME_IDX_FINAL; order >= 0; order--)
-    {
-        list_head_t *pos;
-        list_for_each(pos, &frame_freelist[order])
-        {
-            unsigned long long pagestart = ((frame_t *)pos)->idx * PAGESIZE + BUDDY_MEMORY_BASE;
-            unsigned long long pageend = pagestart + (PAGESIZE << order);
-
-            if (start <= pagestart && end >= pageend) // if page all in reserved memory -> delete it from freelist
-            {
-                ((frame_t *)pos)->used = FRAME_ALLOCATED;
-                memory_sendline("    [!] Reserved page in 0x%x - 0x%x\n", pagestart, pageend);
-                memory_sendline("        Before\n");
-                dump_page_info();
-                list_del_entry(pos);
-                memory_sendline("        Remove usable block for reserved memory: order %d\r\n", order);
-                memory_sendline("        After\n");
-                dump_page_info();
-            }
-            else if (start >= pageend || end <= pagestart) // no intersection
-            {
-                continue;
-            }
-            else // partial intersection, separate the page into smaller size.
-            {
-                list_del_entry(pos);
-                list_head_t *temppos = pos -> prev;
-                list_add(&release_redundant((frame_t *)pos)->listhead, &frame_freelist[order - 1]);
-                pos = temppos;
-            }
-        }
-    }
+    memory_sendline("        Before\n");
+    memtrace_dump(dump_page_info);
+    buddy_zone_reserve(&buddy_zone, (start - BUDDY_MEMORY_BASE) / PAGESIZE, (end - BUDDY_MEMORY_BASE) / PAGESIZE);
+    memory_sendline("        After\n");
+    memtrace_dump(dump_page_info);
 }
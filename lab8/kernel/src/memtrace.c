@@ -0,0 +1,98 @@
+#include "memtrace.h"
+#include "uart1.h"
+#include "string.h"
+#include "exception.h"
+#include "smp.h"
+#include "spinlock.h"
+
+#if MEMTRACE_LEVEL >= 1
+
+static const char *memtrace_names[MEMTRACE_TYPE_COUNT] = {
+    "page_alloc", "page_free", "cache_alloc", "cache_free", "kmalloc", "kfree"};
+
+static int memtrace_on;
+static unsigned long memtrace_head; // total events recorded, ring index = head % size
+static memtrace_event_t memtrace_ring[MEMTRACE_RING_SIZE];
+static unsigned long memtrace_hist[MEMTRACE_TYPE_COUNT][MEMTRACE_HIST_SIZE];
+static spinlock_t memtrace_lock = SPINLOCK_INIT("memtrace", LOCK_RANK_MEMTRACE); // head, ring and hist, from every core
+
+static int memtrace_bucket(unsigned int size)
+{
+    int b = size <= 1 ? 0 : 32 - __builtin_clz(size - 1); // ceil(log2(size))
+    return b < MEMTRACE_HIST_SIZE ? b : MEMTRACE_HIST_SIZE - 1;
+}
+
+void memtrace_record(int type, void *ptr, unsigned int size)
+{
+    unsigned long flags = spin_lock_irqsave(&memtrace_lock);
+    memtrace_hist[type][memtrace_bucket(size)]++;
+    if (memtrace_on)
+    {
+        memtrace_event_t *e = &memtrace_ring[memtrace_head++ & (MEMTRACE_RING_SIZE - 1)];
+        __asm__ __volatile__("mrs %0, cntpct_el0\n\t" : "=r"(e->tick));
+        e->ptr = ptr;
+        e->size = size;
+        e->type = type;
+        e->cpu = smp_processor_id();
+    }
+    spin_unlock_irqrestore(&memtrace_lock, flags);
+}
+
+static void memtrace_dump_log()
+{
+    unsigned long head = memtrace_head;
+    unsigned long start = head > MEMTRACE_RING_SIZE ? head - MEMTRACE_RING_SIZE : 0;
+    uart_sendline("  seq             tick cpu       size ptr                 type\r\n");
+    for (unsigned long i = start; i < head; i++)
+    {
+        memtrace_event_t *e = &memtrace_ring[i & (MEMTRACE_RING_SIZE - 1)];
+        uart_sendline("%5d 0x%16x %3d %10d 0x%16x  %s\r\n", (int)i, e->tick, e->cpu, e->size, e->ptr, memtrace_names[e->type]);
+    }
+    if (start)
+        uart_sendline("(%d older events overwritten)\r\n", (int)start);
+}
+
+static void memtrace_dump_hist()
+{
+    uart_sendline("    size  page_alloc   page_free cache_alloc  cache_free     kmalloc       kfree\r\n");
+    for (int b = 0; b < MEMTRACE_HIST_SIZE; b++)
+    {
+        unsigned long row = 0;
+        for (int t = 0; t < MEMTRACE_TYPE_COUNT; t++)
+            row += memtrace_hist[t][b];
+        if (!row)
+            continue;
+        uart_sendline("  <=2^%2d", b);
+        for (int t = 0; t < MEMTRACE_TYPE_COUNT; t++)
+            uart_sendline(" %11d", (int)memtrace_hist[t][b]);
+        uart_sendline("\r\n");
+    }
+}
+
+void memtrace_cmd(char *arg)
+{
+    if (strcmp(arg, "on") == 0)
+        memtrace_on = 1;
+    else if (strcmp(arg, "off") == 0)
+        memtrace_on = 0;
+    else if (strcmp(arg, "log") == 0)
+        memtrace_dump_log();
+    else if (strcmp(arg, "clear") == 0)
+    {
+        unsigned long flags = spin_lock_irqsave(&memtrace_lock);
+        memtrace_head = 0;
+        memset(memtrace_hist, 0, sizeof(memtrace_hist));
+        spin_unlock_irqrestore(&memtrace_lock, flags);
+    }
+    else
+        memtrace_dump_hist();
+}
+
+#else
+
+void memtrace_cmd(char *arg)
+{
+    uart_sendline("memtrace is compiled out, rebuild with MEMTRACE=1\r\n");
+}
+
+#endif
@@ -3,36 +3,124 @@
 #include "memory.h"
 #include "string.h"
 #include "uart1.h"
+#include "asid.h"
+#include "cache.h"
+#include "init.h"
 
-void* set_2M_kernel_mmu(void* x0)
+kmem_cache_t *vma_cache;
+
+void mmu_init()
+{
+    vma_cache = kmem_cache_create("vm_area_struct", sizeof(vm_area_struct_t), 0, 0);
+}
+
+// ------ kernel page tables, built before the MMU is on: every address here is physical ------
+extern char _kernel_start, _etext, _data, _kernel_end;
+
+static unsigned long kernel_pgtable_next __initdata = MMU_PGTABLE_ADDR;
+
+// the image is linked high, but adrp gives the physical address while the MMU is off
+static inline unsigned long __init kernel_pa(char *sym)
 {
-   // Turn
-   //   Two-level Translation (1GB) - in boot.S
-   // to
-   //   Three-level Translation (2MB) - set PUD point to new table
-   unsigned long *pud_table = (unsigned long *) MMU_PUD_ADDR;
+    return (unsigned long)sym & ~0xffff000000000000UL;
+}
 
-    unsigned long *pte_table1 = (unsigned long *) MMU_PTE_ADDR;
-    unsigned long *pte_table2 = (unsigned long *)(MMU_PTE_ADDR + 0x1000L);
+static unsigned long * __init kernel_pgtable_alloc()
+{
+    if (kernel_pgtable_next >= MMU_PGTABLE_END)
+        while (1); // no uart without the MMU, MMU_PGTABLE_END is too small for the image
+    unsigned long *table = (unsigned long *)kernel_pgtable_next;
+    kernel_pgtable_next += 0x1000;
     for (int i = 0; i < 512; i++)
+        table[i] = 0;
+    return table;
+}
+
+// map [pa, pa + size) at va with the largest descriptors that fit: 1GB blocks in the PUD, 2MB blocks
+// in the PMD, 4KB pages only where a range does not cover an aligned block (or always, pages set,
+// for ranges mmu_kernel_protect changes later). Ranges must not overlap.
+static void __init kernel_map_range(unsigned long *pgd, unsigned long va, unsigned long pa, unsigned long size, unsigned long attr, int pages)
+{
+    while (size)
     {
-        unsigned long addr = 0x200000L * i;
-        if ( addr >= PERIPHERAL_END )
+        unsigned long *table = pgd;
+        for (int level = 0; ; level++)
         {
-            pte_table1[i] = ( 0x00000000 + addr ) + BOOT_PTE_ATTR_nGnRnE;
-            continue;
+            unsigned long block = 1UL << (39 - level * 9);
+            unsigned long *entry = &table[(va >> (39 - level * 9)) & 0x1ff];
+            if (level == 3 || (!pages && level > 0 && !((va | pa) & (block - 1)) && size >= block))
+            {
+                *entry = pa | attr | (level == 3 ? PD_TABLE : PD_BLOCK); // level 3: page descriptor
+                va += block;
+                pa += block;
+                size -= block;
+                break;
+            }
+            if (!*entry)
+                *entry = (unsigned long)kernel_pgtable_alloc() | PD_TABLE;
+            table = (unsigned long *)(*entry & ENTRY_ADDR_MASK);
         }
-        pte_table1[i] = (0x00000000 + addr ) | BOOT_PTE_ATTR_NOCACHE; //   0 * 2MB // No definition for 3-level attribute, use nocache.
-        pte_table2[i] = (0x40000000 + addr ) | BOOT_PTE_ATTR_NOCACHE; // 512 * 2MB
     }
+}
 
-    // set PUD
-    pud_table[0] = (unsigned long) pte_table1 | BOOT_PUD_ATTR;
-    pud_table[1] = (unsigned long) pte_table2 | BOOT_PUD_ATTR;
+static void __init kernel_map_linear(unsigned long *pgd, unsigned long start, unsigned long end, unsigned long attr)
+{
+    kernel_map_range(pgd, PHYS_TO_VIRT(start), start, end - start, attr, 0);
+}
 
+// ttbr1_el1: the linear map of the first 2GB, with W^X on the image (text rx, rodata r, the rest rw).
+// ttbr0_el1 at boot: the identity map, the same PUD behind a root of its own. User roots start empty.
+void* __init mmu_build_kernel_pgd(void* x0)
+{
+    unsigned long *pgd = (unsigned long *)MMU_KERNEL_PGD_ADDR;
+    unsigned long *boot_pgd = (unsigned long *)MMU_PGD_ADDR;
+    for (int i = 0; i < 512; i++)
+        pgd[i] = boot_pgd[i] = 0;
+
+    unsigned long text = kernel_pa(&_kernel_start);
+    unsigned long end = kernel_pa(&_kernel_end);
+    kernel_map_linear(pgd, 0,                             text,                          KERNEL_ATTR_DATA);    // spin tables, page tables
+    kernel_map_linear(pgd, text,                          kernel_pa(&_etext),            KERNEL_ATTR_TEXT);
+    kernel_map_linear(pgd, kernel_pa(&_etext),            kernel_pa(&_data),             KERNEL_ATTR_RODATA);
+    kernel_map_linear(pgd, kernel_pa(&_data),             kernel_pa(&_init_start),       KERNEL_ATTR_DATA);
+    kernel_map_range(pgd, PHYS_TO_VIRT(kernel_pa(&_init_start)), kernel_pa(&_init_start),
+                     kernel_pa(&_init_data) - kernel_pa(&_init_start), KERNEL_ATTR_TEXT, 1);                       // until free_initmem
+    kernel_map_linear(pgd, kernel_pa(&_init_data),        end,                           KERNEL_ATTR_DATA);    // init data, bss, boot stack
+    kernel_map_linear(pgd, end,                           PERIPHERAL_START,              KERNEL_ATTR_DATA);
+    kernel_map_linear(pgd, PERIPHERAL_START,              PERIPHERAL_END,                KERNEL_ATTR_NOCACHE); // VideoCore's share of RAM, the framebuffer lives there
+    kernel_map_linear(pgd, PERIPHERAL_END,                0x80000000L,                   KERNEL_ATTR_DEVICE);  // GPU peripherals, then a 1GB block for the local ones
+
+    boot_pgd[0] = pgd[0];
     return x0;
 }
 
+// change the attributes of page mapped kernel memory, e.g. the init section once it is freed. A block
+// descriptor on the way is left alone: splitting it is not supported, the range must be built with pages.
+void mmu_kernel_protect(size_t va, size_t size, size_t attr)
+{
+    for (size_t s = 0; s < size; s += 0x1000)
+    {
+        size_t *table_p = (size_t *)PHYS_TO_VIRT(MMU_KERNEL_PGD_ADDR);
+        for (int level = 0; level < 3 && table_p; level++)
+        {
+            size_t entry = table_p[((va + s) >> (39 - level * 9)) & 0x1ff];
+            table_p = (entry & 0b11) == PD_TABLE ? (size_t *)PHYS_TO_VIRT((size_t)(entry & ENTRY_ADDR_MASK)) : 0;
+        }
+        size_t *pte = table_p ? &table_p[((va + s) >> 12) & 0x1ff] : 0;
+        if (!pte || (*pte & 0b11) != PD_TABLE)
+        {
+            uart_sendline("mmu_kernel_protect: 0x%x is not page mapped\r\n", va + s);
+            break;
+        }
+        *pte = (*pte & ENTRY_ADDR_MASK) | attr | PD_TABLE;
+    }
+    // global entries, gone from every core under every ASID
+    __asm__ __volatile__("dsb ishst\n\t"
+                         "tlbi vmalle1is\n\t"
+                         "dsb ish\n\t"
+                         "isb\n\t" ::: "memory");
+}
+
 void map_one_page(size_t *virt_pgd_p, size_t va, size_t pa, size_t flag)
 {
     size_t *table_p = virt_pgd_p;
@@ -43,7 +131,7 @@ void map_one_page(size_t *virt_pgd_p, size_t va, size_t pa, size_t flag)
         if (level == 3)
         {
             table_p[idx] = pa;
-            table_p[idx] |= PD_ACCESS | PD_TABLE | (MAIR_IDX_NORMAL_NOCACHE << 2) | PD_KNX | flag; // el0 only
+            table_p[idx] |= PD_ACCESS | PD_TABLE | PD_KNX | PD_NG | flag; // el0 only, memory type in flag
             return;
         }
 
@@ -60,30 +148,142 @@ void map_one_page(size_t *virt_pgd_p, size_t va, size_t pa, size_t flag)
 }
 
 
-void mmu_add_vma(struct thread *t, size_t va, size_t size, size_t pa, size_t rwx, int is_alloced)
+vm_area_struct_t *mmu_add_vma(struct thread *t, size_t va, size_t size, size_t pa, size_t rwx, int backing)
 {
     size = size % 0x1000 ? size + (0x1000 - size % 0x1000) : size;
-    vm_area_struct_t* new_area = kmalloc(sizeof(vm_area_struct_t));
+    vm_area_struct_t* new_area = kmem_cache_alloc(vma_cache);
     new_area->rwx = rwx;
     new_area->area_size = size;
     new_area->virt_addr = va;
     new_area->phys_addr = pa;
-    new_area->is_alloced = is_alloced;
+    new_area->backing = backing;
     list_add_tail((list_head_t *)new_area, &t->vma_list);
+    return new_area;
+}
+
+// give back the frames an anonymous vma faulted in
+static void mmu_free_anon_pages(struct thread *t, vm_area_struct_t *vma)
+{
+    size_t *pgd_p = (size_t *)PHYS_TO_VIRT((size_t)t->context.pgd);
+    for (size_t s = 0; s < vma->area_size; s += 0x1000)
+    {
+        size_t *pte = mmu_find_pte(pgd_p, vma->virt_addr + s);
+        if (!pte || !*pte) continue;
+        page_put((void *)PHYS_TO_VIRT((size_t)(*pte & ENTRY_ADDR_MASK)));
+        *pte = 0;
+    }
 }
 
+// page tables must still be there, anonymous frames are found through them
 void mmu_del_vma(struct thread *t)
 {
     list_head_t *pos = t->vma_list.next;
     vm_area_struct_t *vma;
     while(pos != &t->vma_list){
         vma = (vm_area_struct_t *)pos;
-        if (vma->is_alloced)
+        if (vma->backing == VMA_ALLOCED)
             kfree((void*)PHYS_TO_VIRT(vma->phys_addr));
+        else if (vma->backing == VMA_ANON)
+            mmu_free_anon_pages(t, vma);
         list_head_t* next_pos = pos->next;
-        kfree(pos);
+        kmem_cache_free(vma_cache, pos);
         pos = next_pos;
     }
+    t->rss = 0;
+}
+
+size_t mmu_vma_flags(vm_area_struct_t *vma)
+{
+    // the VideoCore's memory (framebuffer) is not coherent with the caches, everything else is RAM
+    size_t flag = vma->backing == VMA_FIXED && vma->phys_addr >= PERIPHERAL_START && vma->phys_addr < PERIPHERAL_END ? PD_ATTR_NOCACHE : PD_ATTR_RAM;
+    if(!(vma->rwx & (0b1 << 2))) flag |= PD_UNX;        // 4: executable
+    if(!(vma->rwx & (0b1 << 1))) flag |= PD_RDONLY;     // 2: writable
+    if(  vma->rwx & (0b1 << 0) ) flag |= PD_UK_ACCESS;  // 1: readable / accessible
+    return flag;
+}
+
+// leaf entry for va, 0 when an intermediate table is missing
+size_t *mmu_find_pte(size_t *virt_pgd_p, size_t va)
+{
+    size_t *table_p = virt_pgd_p;
+    for (int level = 0; level < 3; level++)
+    {
+        size_t entry = table_p[(va >> (39 - level * 9)) & 0x1ff];
+        if (!entry) return 0;
+        table_p = (size_t *)PHYS_TO_VIRT((size_t)(entry & ENTRY_ADDR_MASK));
+    }
+    return &table_p[(va >> 12) & 0x1ff];
+}
+
+// allocate, zero and map the frame behind va of an anonymous vma, returns its kernel address
+char *mmu_map_anon_page(struct thread *t, vm_area_struct_t *vma, size_t va)
+{
+    char *frame = kmalloc(0x1000);
+    if (!frame) return 0;
+    memset(frame, 0, 0x1000);
+    map_one_page(PHYS_TO_VIRT(t->context.pgd), va, VIRT_TO_PHYS((size_t)frame), mmu_vma_flags(vma));
+    t->rss++;
+    return frame;
+}
+
+// back the first size bytes of an anonymous vma with frames now, filled from src
+int mmu_load_anon_pages(struct thread *t, vm_area_struct_t *vma, const char *src, size_t size)
+{
+    for (size_t s = 0; s < size; s += 0x1000)
+    {
+        char *frame = mmu_map_anon_page(t, vma, vma->virt_addr + s);
+        if (!frame) return -1;
+        memcpy(frame, src + s, size - s < 0x1000 ? size - s : 0x1000);
+        if (vma->rwx & (0b1 << 2)) icache_sync(frame, 0x1000);
+    }
+    return 0;
+}
+
+// fork: map every frame the parent has touched into the child, both read-only, the first write splits it
+void mmu_share_anon_pages(struct thread *dst, struct thread *src, vm_area_struct_t *vma)
+{
+    size_t *src_pgd = (size_t *)PHYS_TO_VIRT((size_t)src->context.pgd);
+    size_t *dst_pgd = (size_t *)PHYS_TO_VIRT((size_t)dst->context.pgd);
+    for (size_t s = 0; s < vma->area_size; s += 0x1000)
+    {
+        size_t *pte = mmu_find_pte(src_pgd, vma->virt_addr + s);
+        if (!pte || !*pte) continue;
+        *pte |= PD_RDONLY;
+        map_one_page(dst_pgd, vma->virt_addr + s, *pte & ENTRY_ADDR_MASK, mmu_vma_flags(vma) | PD_RDONLY);
+        page_get((void *)PHYS_TO_VIRT((size_t)(*pte & ENTRY_ADDR_MASK)));
+        dst->rss++;
+    }
+    mmu_flush_tlb_asid(src); // its entries are read-only now
+}
+
+// write to a shared frame: the last sharer takes it over, everyone else gets a private copy
+static int mmu_cow_page(struct thread *t, size_t va)
+{
+    size_t *pte = mmu_find_pte(PHYS_TO_VIRT(t->context.pgd), va);
+    if (!pte || !*pte) return -1;
+
+    char *old = (char *)PHYS_TO_VIRT((size_t)(*pte & ENTRY_ADDR_MASK));
+    lock();
+    if (page_refcount(old) == 1)
+    {
+        *pte &= ~PD_RDONLY;
+    }
+    else
+    {
+        char *new = kmalloc(0x1000);
+        if (!new)
+        {
+            unlock();
+            return -1;
+        }
+        memcpy(new, old, 0x1000);
+        if (!(*pte & PD_UNX)) icache_sync(new, 0x1000);
+        *pte = (*pte & ~(ENTRY_ADDR_MASK | PD_RDONLY)) | VIRT_TO_PHYS((size_t)new);
+        page_put(old);
+    }
+    unlock();
+    mmu_flush_tlb_page(t, va);
+    return 0;
 }
 
 void mmu_map_pages(size_t *virt_pgd_p, size_t va, size_t size, size_t pa, size_t flag)
@@ -95,6 +295,43 @@ void mmu_map_pages(size_t *virt_pgd_p, size_t va, size_t size, size_t pa, size_t
     }
 }
 
+// drop the leaf entries of [va, va + size) in t, the pages fault back in from their vma, returns entries dropped
+unsigned long mmu_unmap_pages(struct thread *t, size_t va, size_t size)
+{
+    size_t *virt_pgd_p = (size_t *)PHYS_TO_VIRT((size_t)t->context.pgd);
+    unsigned long dropped = 0;
+    for (size_t s = 0; s < size; s += 0x1000)
+    {
+        size_t *pte = mmu_find_pte(virt_pgd_p, va + s);
+        if (!pte || !*pte) continue;
+        *pte = 0;
+        dropped++;
+    }
+    if (dropped) mmu_flush_tlb_asid(t);
+    return dropped;
+}
+
+// t's page table changed: drop the TLB entries of its ASID on every core, other address spaces keep theirs.
+// A thread that has none yet has nothing cached, flushing ASID 0 then is harmless.
+void mmu_flush_tlb_asid(struct thread *t)
+{
+    asm volatile("dsb ishst\n\t"      // page table writes are visible to the walkers
+                 "tlbi aside1is, %0\n\t"
+                 "dsb ish\n\t"        // ensure completion of TLB invalidatation
+                 "isb\n\t"            // clear pipeline
+                 :: "r"((t->asid & ASID_MASK) << 48));
+}
+
+// one page of t changed
+void mmu_flush_tlb_page(struct thread *t, size_t va)
+{
+    asm volatile("dsb ishst\n\t"
+                 "tlbi vae1is, %0\n\t"
+                 "dsb ish\n\t"
+                 "isb\n\t"
+                 :: "r"((t->asid & ASID_MASK) << 48 | (va >> 12 & ((1UL << 44) - 1))));
+}
+
 void mmu_free_page_tables(size_t *page_table, int level)
 {
     size_t *table_virt = (size_t*)PHYS_TO_VIRT((char*)page_table);
@@ -118,13 +355,15 @@ void mmu_memfail_abort_handle(esr_el1_t* esr_el1)
     unsigned long long far_el1;
     __asm__ __volatile__("mrs %0, FAR_EL1\n\t": "=r"(far_el1));
 
+    // vma_list and the page tables are shared with compaction, which may move the block behind a VMA
+    lock();
     list_head_t *pos;
     vm_area_struct_t *vma;
     vm_area_struct_t *the_area_ptr = 0;
     list_for_each(pos, &curr_thread->vma_list)
     {
         vma = (vm_area_struct_t *)pos;
-        if (vma->virt_addr <= far_el1 && vma->virt_addr + vma->area_size >= far_el1)
+        if (vma->virt_addr <= far_el1 && vma->virt_addr + vma->area_size > far_el1)
         {
             the_area_ptr = vma;
             break;
@@ -133,6 +372,7 @@ void mmu_memfail_abort_handle(esr_el1_t* esr_el1)
     // area is not part of process's address space
     if (!the_area_ptr)
     {
+        unlock();
         uart_sendline("[Segmentation fault]: Kill Process\r\n");
         thread_exit();
         return;
@@ -150,15 +390,50 @@ void mmu_memfail_abort_handle(esr_el1_t* esr_el1)
         size_t addr_offset = (far_el1 - the_area_ptr->virt_addr);
         addr_offset = (addr_offset % 0x1000) == 0 ? addr_offset : addr_offset - (addr_offset % 0x1000);
 
-        size_t flag = 0;
-        if(!(the_area_ptr->rwx & (0b1 << 2))) flag |= PD_UNX;        // 4: executable
-        if(!(the_area_ptr->rwx & (0b1 << 1))) flag |= PD_RDONLY;     // 2: writable
-        if(  the_area_ptr->rwx & (0b1 << 0) ) flag |= PD_UK_ACCESS;  // 1: readable / accessible
-        map_one_page(PHYS_TO_VIRT(curr_thread->context.pgd), the_area_ptr->virt_addr + addr_offset, the_area_ptr->phys_addr + addr_offset, flag);
+        // mapped meanwhile: compaction put the page back while this fault waited for the lock
+        size_t *pte = mmu_find_pte(PHYS_TO_VIRT(curr_thread->context.pgd), the_area_ptr->virt_addr + addr_offset);
+        if (pte && *pte)
+        {
+            unlock();
+            return;
+        }
+
+        if (the_area_ptr->backing == VMA_ANON)
+        {
+            // demand zero: first touch of an anonymous page
+            char *frame = mmu_map_anon_page(curr_thread, the_area_ptr, the_area_ptr->virt_addr + addr_offset);
+            unlock();
+            if (!frame)
+            {
+                uart_sendline("[Out of memory]: Kill Process\r\n");
+                thread_exit();
+            }
+            return;
+        }
+        map_one_page(PHYS_TO_VIRT(curr_thread->context.pgd), the_area_ptr->virt_addr + addr_offset, the_area_ptr->phys_addr + addr_offset, mmu_vma_flags(the_area_ptr));
+        if (the_area_ptr->backing != VMA_FIXED) curr_thread->rss++;
+        unlock();
+    }
+    // Write to a page fork left read-only in a writable area: copy on write
+    else if (esr_el1->ec != MEMFAIL_INST_ABORT_LOWER &&
+             (esr_el1->iss & ISS_WNR) &&
+             ((esr_el1->iss & 0x3f) == PF_LEVEL1 ||
+              (esr_el1->iss & 0x3f) == PF_LEVEL2 ||
+              (esr_el1->iss & 0x3f) == PF_LEVEL3) &&
+             the_area_ptr->backing == VMA_ANON && (the_area_ptr->rwx & (0b1 << 1)))
+    {
+        int err = mmu_cow_page(curr_thread, far_el1 & ~0xfffUL);
+        unlock();
+        if (err)
+        {
+            uart_sendline("[Out of memory]: Kill Process\r\n");
+            thread_exit();
+        }
     }
     else
     {
         // For other Fault (permisson ...etc)
+        unlock();
         uart_sendline("[Segmentation fault]: Kill Process\r\n");
         thread_exit();
     }
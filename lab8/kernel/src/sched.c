@@ -6,151 +6,798 @@
 #include "signal.h"
 #include "mmu.h"
 #include "string.h"
+#include "smp.h"
+#include "spinlock.h"
+#include "vdso.h"
+#include "asid.h"
 
-thread_t *curr_thread;
-list_head_t *run_queue;
-list_head_t *wait_queue;
-thread_t threads[PIDMAX + 1];
+// Every core has its own run queue (struct rq), so picking the next thread only takes the local
+// lock. A thread is on at most one list through listhead: its class's queue on one run queue while
+// it waits for a core (the fair class keeps a heap instead), a wait list (or none) while blocked,
+// the zombie list of a run queue once dead and off its core (the reaper frees it). A running
+// thread is queued nowhere.
+// New threads go to the least loaded core, woken ones back to the core they ran on; idle cores
+// steal from the busiest one and every core balances with the others every SCHED_BALANCE_TICKS.
+struct rq runqueues[NR_CPUS];
+thread_t *idle_threads[NR_CPUS];        // run only when every class is empty, never queued
+static spinlock_t wait_lock = SPINLOCK_INIT("waitqueue", LOCK_RANK_WAITQUEUE); // all wait lists, sleeping and waking
+
+static inline struct rq *this_rq()
+{
+    return &runqueues[smp_processor_id()];
+}
+
+// Threads are slab objects found by pid through a two-level table: the upper bits of a pid pick a
+// leaf of PID_LEAF_SIZE pointers, allocated the first time one of its pids is handed out and kept.
+// Free pids are a bitmap searched from just after the last pid given, so a pid is not reused right
+// after its thread dies. All of it is under the BKL, a thread found stays valid until unlock().
+#define PID_LEAF_SHIFT 9
+#define PID_LEAF_SIZE  (1 << PID_LEAF_SHIFT)
+#define PID_DIR_SIZE   ((PIDMAX + PID_LEAF_SIZE) / PID_LEAF_SIZE)
+#define PID_WORDS      ((PIDMAX + 64) / 64)
+
+static kmem_cache_t   *thread_cache;
+static thread_t      **pid_dir[PID_DIR_SIZE];
+static unsigned long   pid_bitmap[PID_WORDS];
+static int             pid_next;      // where the search for a free pid starts
+LIST_HEAD(thread_list);
+static int             nr_threads;    // on thread_list, every fair heap has room for all of them
+
+// BKL held: first free pid from pid_next on, wrapping around to 1 (pid 0 is the boot thread's), -1 if none
+static int pid_alloc()
+{
+    int pid = pid_next;
+    for (int n = 0; n <= PID_WORDS; n++)  // one more: the first word again, below where the search started
+    {
+        int w = pid / 64;
+        unsigned long free = ~pid_bitmap[w] & (~0UL << (pid % 64));
+        if (free && w * 64 + __builtin_ctzl(free) <= PIDMAX)
+        {
+            pid = w * 64 + __builtin_ctzl(free);
+            pid_bitmap[w] |= 1UL << (pid % 64);
+            pid_next = pid < PIDMAX ? pid + 1 : 1;
+            return pid;
+        }
+        pid = (w + 1) * 64;
+        if (pid > PIDMAX) pid = 1;
+    }
+    return -1;
+}
+
+// BKL held: pid now names t, -1 if there is no memory for its leaf
+static int pid_attach(int pid, thread_t *t)
+{
+    thread_t **leaf = pid_dir[pid >> PID_LEAF_SHIFT];
+    if (!leaf)
+    {
+        leaf = kmalloc(PID_LEAF_SIZE * sizeof(thread_t *));
+        if (!leaf) return -1;
+        memset(leaf, 0, PID_LEAF_SIZE * sizeof(thread_t *));
+        pid_dir[pid >> PID_LEAF_SHIFT] = leaf;
+    }
+    leaf[pid & (PID_LEAF_SIZE - 1)] = t;
+    return 0;
+}
+
+// BKL held
+static void pid_free(int pid)
+{
+    thread_t **leaf = pid_dir[pid >> PID_LEAF_SHIFT];
+    if (leaf) leaf[pid & (PID_LEAF_SIZE - 1)] = 0;
+    pid_bitmap[pid / 64] &= ~(1UL << (pid % 64));
+}
+
+// BKL held: the thread with this pid, 0 if there is none
+thread_t *find_thread(int pid)
+{
+    if (pid < 0 || pid > PIDMAX || !pid_dir[pid >> PID_LEAF_SHIFT]) return 0;
+    return pid_dir[pid >> PID_LEAF_SHIFT][pid & (PID_LEAF_SIZE - 1)];
+}
+
+// Dead threads are freed by the reaper thread, woken whenever one lands on a zombie list.
+static LIST_HEAD(reaper_wait);
+static volatile int reaper_pending;
+
+static void reaper()
+{
+    while (1)
+    {
+        sched_sleep_on(&reaper_wait, &reaper_pending);
+        reaper_pending = 0; // before draining: a zombie queued after the drain wakes us again
+        kill_zombies();
+    }
+}
+
+// no locks held
+static void reaper_wake()
+{
+    reaper_pending = 1;
+    sched_wake_up_all(&reaper_wait);
+}
 
 void init_thread_sched()
 {
     lock();
-    run_queue = kmalloc(sizeof(list_head_t));
-    wait_queue = kmalloc(sizeof(list_head_t));
-    INIT_LIST_HEAD(run_queue);
-    INIT_LIST_HEAD(wait_queue);
-
-    //init pids
-    for (int i = 0; i <= PIDMAX; i++)
+    for (int cpu = 0; cpu < NR_CPUS; cpu++)
     {
-        threads[i].isused = 0;
-        threads[i].pid = i;
-        threads[i].iszombie = 0;
+        struct rq *rq = &runqueues[cpu];
+        spin_lock_init(&rq->lock, "runqueue", LOCK_RANK_RUNQUEUE + cpu);
+        rq->cpu = cpu;
+        rq->nr_queued = 0;
+        rq->need_resched = 0;
+        rq->balance_tick = 0;
+        INIT_LIST_HEAD(&rq->zombies);
+        rt_init(rq);
+        fair_init(rq);
     }
 
-    thread_t* idlethread = thread_create(idle,0x1000);
-    curr_thread = idlethread;
-    asm volatile("msr tpidr_el1, %0" ::"r" (&idlethread->context));
+    thread_cache = kmem_cache_create("thread", sizeof(thread_t), CACHE_LINE_SIZE, 0);
+
+    // the boot code running main() becomes pid 0, it is running so it goes on no list
+    thread_t* bootthread = thread_alloc(0);
+    if (!bootthread)
+    {
+        uart_sendline("[kernel panic] sched_init: no memory for the boot thread\r\n");
+        while (1);
+    }
+    bootthread->on_cpu = 1;
+    bootthread->cpu = 0;
+    bootthread->state = THREAD_RUNNABLE;
+    bootthread->exec_start = sched_clock();
+    runqueues[0].curr = bootthread;
+    asm volatile("msr tpidr_el1, %0" ::"r" (&bootthread->context));
     unlock();
+
+    sched_create_idle(0);
+    thread_create(reaper);
+}
+
+// idle thread of a core, secondary cores start on theirs (smp_init)
+thread_t *sched_create_idle(int cpu)
+{
+    thread_t *t = thread_alloc(idle);
+    if (!t)
+    {
+        uart_sendline("[kernel panic] no memory for the idle thread of cpu%d\r\n", cpu);
+        while (1);
+    }
+    t->state = THREAD_RUNNABLE;
+    t->cpu = cpu;
+    idle_threads[cpu] = t;
+    if (cpu) runqueues[cpu].curr = t;
+    return t;
 }
 
 void idle(){
     while(1)
     {
-        kill_zombies();   //reclaim threads marked as DEAD
-        schedule();       //switch to next thread in run queue
+        if (!this_rq()->nr_queued) sched_balance(); // nothing here, take work from the busiest core
+        schedule();       //switch to the best queued thread
+
+        // nothing to run: stop the tick and sleep until an event, IPI or device interrupt.
+        // Checked with interrupts masked, wfi still wakes on one that arrived since.
+        el1_interrupt_disable();
+        struct rq *rq = this_rq();
+        if (!rq->nr_queued && !rq->need_resched)
+        {
+            tick_stop();
+            asm volatile("wfi");
+        }
+        el1_interrupt_enable();
+    }
+}
+
+// rq->lock held: the class queues and the count of queued threads
+static void enqueue_thread(struct rq *rq, thread_t *t, int flags)
+{
+    t->sched_class->enqueue(rq, t, flags);
+    rq->nr_queued++;
+}
+
+static void dequeue_thread(struct rq *rq, thread_t *t, int flags)
+{
+    t->sched_class->dequeue(rq, t, flags);
+    rq->nr_queued--;
+}
+
+static thread_t *pick_next_thread(struct rq *rq)
+{
+    for (const struct sched_class *class = sched_class_highest; class; class = class->next)
+    {
+        thread_t *t = class->peek(rq);
+        if (t) return t;
+    }
+    return 0;
+}
+
+static int is_idle_thread(thread_t *t)
+{
+    for (int cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        if (idle_threads[cpu] == t) return 1;
     }
+    return 0;
+}
+
+// t should run instead of curr: a higher class always wins, a yielding curr gives way to its own class
+static int sched_preempts(thread_t *t, thread_t *curr)
+{
+    if (is_idle_thread(curr)) return 1;
+    if (t->sched_class != curr->sched_class) return t->sched_class == &rt_sched_class;
+    return curr->yield || t->sched_class->preempts(t, curr);
+}
+
+// bill the time since exec_start to curr
+static void update_curr(struct rq *rq, thread_t *curr)
+{
+    unsigned long now = sched_clock();
+    unsigned long delta = now - curr->exec_start;
+    curr->exec_start = now;
+    curr->slice_exec += delta;
+    curr->sched_class->charge(rq, curr, delta);
+}
+
+// lock the run queue t belongs to, t->cpu may change until it is held
+static struct rq *thread_rq_lock(thread_t *t)
+{
+    while (1)
+    {
+        struct rq *rq = &runqueues[t->cpu];
+        spin_lock(&rq->lock);
+        if (rq == &runqueues[t->cpu]) return rq;
+        spin_unlock(&rq->lock);
+    }
+}
+
+// threads that are runnable here: queued plus the running one
+static int rq_nr_running(struct rq *rq)
+{
+    return rq->nr_queued + (rq->curr != idle_threads[rq->cpu]);
+}
+
+// rq->lock held, interrupts masked: hand this core to next, returns with rq->lock released once prev is switched back in
+static void context_switch(struct rq *rq, thread_t *prev, thread_t *next)
+{
+    next->on_cpu = 1;
+    next->cpu = rq->cpu;
+    next->exec_start = sched_clock();
+    next->slice_exec = 0;
+    rq->curr = next;
+    rq->prev = prev;
+    vdso_update_cpu(rq->cpu, rq_nr_running(rq), 1);
+    fpsimd_switch(prev, next);
+    asid_switch_mm(next);
+    switch_to(&prev->context, &next->context);
+    schedule_tail();
+}
+
+// first thing on the thread switched to: the thread switched from is saved and may run elsewhere now,
+// put it where its state says (a blocked one is already on its wait list). The core may not be the
+// one the switch started on, this core's run queue lock is the one held.
+void schedule_tail()
+{
+    struct rq *rq = this_rq();
+    thread_t *prev = rq->prev;
+    int from_idle = prev == idle_threads[rq->cpu];
+    int dead = 0;
+    prev->on_cpu = 0;
+    if (!from_idle)
+    {
+        if (prev->state == THREAD_RUNNABLE)
+            enqueue_thread(rq, prev, prev->yield ? ENQUEUE_YIELD : 0);
+        else if (prev->state == THREAD_ZOMBIE)
+        {
+            list_add_tail(&prev->listhead, &rq->zombies);
+            dead = 1;
+        }
+    }
+    prev->yield = 0;
+    spin_unlock(&rq->lock);
+
+    if (from_idle) tick_start(); // idle stopped it
+    if (dead) reaper_wake();
+}
+
+// rq->lock held with interrupts masked, flags from the caller's spin_lock_irqsave
+static void __schedule(struct rq *rq, unsigned long flags)
+{
+    thread_t *prev = rq->curr;
+    thread_t *idle = idle_threads[rq->cpu];
+    rq->need_resched = 0;
+    if (prev != idle) update_curr(rq, prev);
+
+    thread_t *next = pick_next_thread(rq);
+    if (prev->state == THREAD_RUNNABLE && prev != idle && (!next || !sched_preempts(next, prev)))
+        next = prev; // still the best choice for this core
+    else if (!next)
+        next = idle;
+
+    if (next == prev)
+    {
+        prev->yield = 0;
+        spin_unlock_irqrestore(&rq->lock, flags);
+        return;
+    }
+    if (next != idle) dequeue_thread(rq, next, 0);
+    context_switch(rq, prev, next);
+    local_irq_restore(flags);
 }
 
 void schedule(){
-    lock();
-    do{
-        curr_thread = (thread_t *)curr_thread->listhead.next;
-    } while (list_is_head(&curr_thread->listhead, run_queue) || curr_thread->iszombie);
-    unlock();
-    switch_to(get_current(), &curr_thread->context);
+    lockdep_assert_none_held("schedule");
+    unsigned long flags = local_irq_save();
+    struct rq *rq = this_rq();
+    spin_lock(&rq->lock);
+    __schedule(rq, flags);
+}
+
+// give the core to any queued thread of the same or a higher class
+void sched_yield()
+{
+    lockdep_assert_none_held("sched_yield");
+    unsigned long flags = local_irq_save();
+    struct rq *rq = this_rq();
+    spin_lock(&rq->lock);
+    rq->curr->yield = 1;
+    __schedule(rq, flags);
+}
+
+// idle cores have no tick to balance with: if rq has work queued, wake one to come and steal it
+static void nohz_kick(struct rq *rq)
+{
+    if (!rq->nr_queued) return;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        struct rq *other = &runqueues[cpu];
+        if (other == rq || !(cpu_online_mask & (1 << cpu))) continue;
+        if (other->curr == idle_threads[cpu] && !other->nr_queued) // unlocked peek, a spurious kick is harmless
+        {
+            smp_send_ipi(cpu, IPI_RESCHEDULE);
+            return;
+        }
+    }
+}
+
+// timer tick on this core: bill the running thread and ask its class whether its slice is over,
+// every SCHED_BALANCE_TICKS also even out the run queues and wake an idle core if work is left over
+int sched_tick()
+{
+    unsigned long flags = local_irq_save();
+    struct rq *rq = this_rq();
+    spin_lock(&rq->lock);
+    thread_t *curr = rq->curr;
+    if (curr == idle_threads[rq->cpu])
+    {
+        if (rq->nr_queued) rq->need_resched = 1;
+    }
+    else
+    {
+        update_curr(rq, curr);
+        thread_t *best = pick_next_thread(rq);
+        if (curr->sched_class->tick(rq, curr) || (best && best->sched_class != curr->sched_class && sched_preempts(best, curr)))
+            rq->need_resched = 1;
+    }
+    vdso_update_cpu(rq->cpu, rq_nr_running(rq), 0);
+    int balance = ++rq->balance_tick >= SCHED_BALANCE_TICKS;
+    if (balance) rq->balance_tick = 0;
+    spin_unlock(&rq->lock);
+
+    if (balance)
+    {
+        sched_balance();
+        nohz_kick(rq);
+    }
+    local_irq_restore(flags);
+    return rq->need_resched;
+}
+
+int sched_resched_pending()
+{
+    return this_rq()->need_resched;
+}
+
+// rq->lock held: t was just queued on rq, its core reschedules on its way out of an interrupt if t
+// beats what it runs. Returns 1 if that core is another one and has to be told.
+static int check_preempt(struct rq *rq, thread_t *t)
+{
+    if (!sched_preempts(t, rq->curr)) return 0;
+    rq->need_resched = 1;
+    return rq != this_rq();
+}
+
+// both run queues, in cpu order
+static void double_rq_lock(struct rq *a, struct rq *b)
+{
+    if (a->cpu < b->cpu)
+    {
+        spin_lock(&a->lock);
+        spin_lock(&b->lock);
+    }
+    else
+    {
+        spin_lock(&b->lock);
+        spin_lock(&a->lock);
+    }
+}
+
+static void double_rq_unlock(struct rq *a, struct rq *b)
+{
+    spin_unlock(&a->lock);
+    spin_unlock(&b->lock);
+}
+
+// both locks held: move up to nr queued threads from src to dst, best first (they would run next on
+// src anyway and are the ones it is slowest to get to)
+static int pull_threads(struct rq *dst, struct rq *src, int nr)
+{
+    int moved = 0;
+    while (moved < nr)
+    {
+        thread_t *t = pick_next_thread(src);
+        if (!t) break;
+        dequeue_thread(src, t, DEQUEUE_MIGRATE);
+        t->cpu = dst->cpu;
+        enqueue_thread(dst, t, ENQUEUE_MIGRATE);
+        moved++;
+    }
+    return moved;
+}
+
+// pull work to this core from the online core with the most runnable threads, half the difference
+// so both end up even. An idle core takes at least one thread if the busiest has any queued.
+void sched_balance()
+{
+    unsigned long flags = local_irq_save();
+    struct rq *rq = this_rq();
+    struct rq *busiest = 0;
+    int max = 0;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        struct rq *other = &runqueues[cpu];
+        if (other == rq || !(cpu_online_mask & (1 << cpu))) continue;
+        int n = rq_nr_running(other); // unlocked peek, checked again below
+        if (other->nr_queued && n > max)
+        {
+            max = n;
+            busiest = other;
+        }
+    }
+    if (busiest)
+    {
+        double_rq_lock(rq, busiest);
+        int imbalance = (rq_nr_running(busiest) - rq_nr_running(rq)) / 2;
+        if (imbalance < 1 && rq->curr == idle_threads[rq->cpu] && busiest->nr_queued) imbalance = 1;
+        if (imbalance > busiest->nr_queued) imbalance = busiest->nr_queued;
+        if (imbalance > 0 && pull_threads(rq, busiest, imbalance))
+            rq->need_resched = 1;
+        double_rq_unlock(rq, busiest);
+    }
+    local_irq_restore(flags);
+}
+
+int sched_nr_queued()
+{
+    int nr = 0;
+    for (int cpu = 0; cpu < NR_CPUS; cpu++)
+        nr += runqueues[cpu].nr_queued;
+    return nr;
+}
+
+// block the current thread on wq (0: on no list) until sched_wake_up, unless *cond (may be 0) is
+// already set. It is checked under wait_lock: a waker that sets it before waking cannot be missed.
+void sched_sleep_on(list_head_t *wq, volatile int *cond)
+{
+    lockdep_assert_none_held("sched_sleep_on");
+    unsigned long flags = spin_lock_irqsave(&wait_lock);
+    struct rq *rq = this_rq();
+    spin_lock(&rq->lock);
+    thread_t *t = rq->curr;
+    if ((cond && *cond) || t->state != THREAD_RUNNABLE) // killed threads do not go to sleep
+    {
+        spin_unlock(&rq->lock);
+        spin_unlock_irqrestore(&wait_lock, flags);
+        return;
+    }
+    t->state = THREAD_BLOCKED;
+    if (wq)
+        list_add_tail(&t->listhead, wq);
+    else
+        INIT_LIST_HEAD(&t->listhead);
+    // a waker needs this run queue too, it waits until the switch is done
+    spin_unlock(&wait_lock);
+    __schedule(rq, flags);
+}
+
+// wait_event: the condition is checked with wait_lock held, interrupts masked
+unsigned long sched_wait_lock()
+{
+    lockdep_assert_none_held("wait_event");
+    return spin_lock_irqsave(&wait_lock);
+}
+
+void sched_wait_unlock(unsigned long flags)
+{
+    spin_unlock_irqrestore(&wait_lock, flags);
+}
+
+// wait_lock held, the condition is false: block on wq until woken, then take wait_lock again for the
+// next check. 0 without sleeping once the thread has been killed.
+int sched_wait_sleep(list_head_t *wq, unsigned long *flags)
+{
+    struct rq *rq = this_rq();
+    thread_t *t = rq->curr;
+    spin_lock(&rq->lock);
+    if (t->state != THREAD_RUNNABLE)
+    {
+        spin_unlock(&rq->lock);
+        return 0;
+    }
+    t->state = THREAD_BLOCKED;
+    list_add_tail(&t->listhead, wq);
+    spin_unlock(&wait_lock);
+    __schedule(rq, *flags);
+    *flags = spin_lock_irqsave(&wait_lock);
+    return 1;
+}
+
+// wait_lock held: back on the run queue of the core t last ran on, its caches may still be warm.
+// Returns the cpu to send a reschedule IPI to, or -1.
+static int wake_up_locked(thread_t *t)
+{
+    if (t->state != THREAD_BLOCKED) return -1;
+    struct rq *rq = &runqueues[t->cpu]; // a blocked thread is queued nowhere, its cpu cannot change
+    spin_lock(&rq->lock);
+    list_del_entry(&t->listhead); // off its wait list
+    t->state = THREAD_RUNNABLE;
+    enqueue_thread(rq, t, ENQUEUE_WAKEUP);
+    int ipi = check_preempt(rq, t) ? rq->cpu : -1;
+    spin_unlock(&rq->lock);
+    return ipi;
+}
+
+void sched_wake_up(thread_t *t)
+{
+    unsigned long flags = spin_lock_irqsave(&wait_lock);
+    int cpu = wake_up_locked(t);
+    spin_unlock_irqrestore(&wait_lock, flags);
+    if (cpu >= 0) smp_send_ipi(cpu, IPI_RESCHEDULE);
+}
+
+void sched_wake_up_all(list_head_t *wq)
+{
+    unsigned int cpus = 0;
+    unsigned long flags = spin_lock_irqsave(&wait_lock);
+    while (!list_empty(wq))
+    {
+        int cpu = wake_up_locked((thread_t *)wq->next);
+        if (cpu >= 0) cpus |= 1 << cpu;
+    }
+    spin_unlock_irqrestore(&wait_lock, flags);
+    for (int cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        if (cpus & (1 << cpu)) smp_send_ipi(cpu, IPI_RESCHEDULE);
+    }
+}
+
+// mark t dead, a thread running somewhere is moved to a zombie list by its core's next switch
+void sched_kill(thread_t *t)
+{
+    unsigned long flags = spin_lock_irqsave(&wait_lock);
+    struct rq *rq = thread_rq_lock(t);
+    int dead = 0, ipi = 0;
+    if ((t->state == THREAD_RUNNABLE || t->state == THREAD_BLOCKED) && !is_idle_thread(t))
+    {
+        if (t->on_cpu)
+        {
+            // running: its core switches away at the next schedule(), which must come now, not at the
+            // end of its slice (never for SCHED_FIFO)
+            rq->need_resched = 1;
+            ipi = rq != this_rq();
+        }
+        else
+        {
+            if (t->state == THREAD_RUNNABLE)
+                dequeue_thread(rq, t, 0);
+            else
+                list_del_entry(&t->listhead); // off its wait list
+            list_add_tail(&t->listhead, &rq->zombies);
+            dead = 1;
+        }
+        t->state = THREAD_ZOMBIE;
+    }
+    spin_unlock(&rq->lock);
+    spin_unlock_irqrestore(&wait_lock, flags);
+    if (ipi) smp_send_ipi(rq->cpu, IPI_RESCHEDULE);
+    if (dead) reaper_wake();
+}
+
+static void sleep_timer_fire(void *thread)
+{
+    thread_t *t = thread;
+    t->sleep_expired = 1;
+    wake_up(&t->sleep_wait);
+}
+
+// block until cntpct reaches deadline, 0 then. -1 if a signal arrived or the thread was killed first,
+// or right away if no timer could be armed.
+int sched_sleep_until(unsigned long long deadline)
+{
+    thread_t *t = curr_thread;
+    t->sleep_expired = 0;
+    if (timer_arm(&t->sleep_timer, deadline)) return -1;
+    wait_event(&t->sleep_wait, t->sleep_expired || signal_pending(t));
+    timer_cancel(&t->sleep_timer);
+    return t->sleep_expired ? 0 : -1;
+}
+
+// a signal was queued for t: cut its sleep short so it is delivered now
+void sched_signal_wake(thread_t *t)
+{
+    wake_up(&t->sleep_wait);
 }
 
 void kill_zombies(){
-    lock();
-    list_head_t *curr;
-    thread_t *t;
-    list_for_each(curr,run_queue)
+    list_head_t dead;
+    list_head_t *curr, *n;
+    INIT_LIST_HEAD(&dead);
+
+    // take every core's list under its lock, free outside of them: freeing takes the page table and allocator locks
+    for (int cpu = 0; cpu < NR_CPUS; cpu++)
     {
-        t = (thread_t *)curr;
-        if (t->iszombie)
+        struct rq *rq = &runqueues[cpu];
+        unsigned long flags = spin_lock_irqsave(&rq->lock);
+        list_for_each_safe(curr, n, &rq->zombies)
         {
             list_del_entry(curr);
-            mmu_free_page_tables(t->context.pgd,0);
-            mmu_del_vma(t);
-            for(int i = 0; i < MAX_FD;i++)
-            {
-                if (t->file_descriptors_table[i])
-                    vfs_close(t->file_descriptors_table[i]);
-            }
-            kfree(t->kernel_stack_alloced_ptr);
-            kfree(PHYS_TO_VIRT(t->context.pgd));
-            t->iszombie = 0;
-            t->isused   = 0;
+            list_add(curr, &dead);
         }
+        spin_unlock_irqrestore(&rq->lock, flags);
+    }
+
+    list_for_each_safe(curr, n, &dead)
+    {
+        thread_free((thread_t *)curr);
     }
+}
+
+// give back everything a thread owns, it must be on no queue and running nowhere
+void thread_free(thread_t *t)
+{
+    // a callback already started on core 0 still uses t, wait for it before t goes back to the slab
+    t->itimer_interval = 0;
+    timer_cancel_sync(&t->sleep_timer);
+    timer_cancel_sync(&t->itimer);
+    lock();
+    mmu_del_vma(t);
+    mmu_free_page_tables(t->context.pgd,0);
+    for(int i = 0; i <= MAX_FD;i++)
+    {
+        if (t->file_descriptors_table[i])
+            vfs_close(t->file_descriptors_table[i]);
+    }
+    kfree(t->kernel_stack_alloced_ptr);
+    kfree(PHYS_TO_VIRT(t->context.pgd));
+    list_del_entry(&t->thread_node);
+    nr_threads--;
+    pid_free(t->pid);
+    kmem_cache_free(thread_cache, t);
     unlock();
 }
 
 int thread_exec(char *data, unsigned int filesize)
 {
-    thread_t *t = thread_create(data, filesize);
+    thread_t *t = thread_alloc(thread_start_user);
+    if (!t) return -1;
+    lock();
+    t->context.pgd = VIRT_TO_PHYS(t->context.pgd);
 
-    mmu_add_vma(t,              USER_KERNEL_BASE,                       t->datasize,   (size_t)VIRT_TO_PHYS(t->data)             , 0b111, 1);
-    mmu_add_vma(t, USER_STACK_BASE - USTACK_SIZE,                       USTACK_SIZE,   (size_t)VIRT_TO_PHYS(t->stack_alloced_ptr), 0b111, 1);
-    mmu_add_vma(t,              PERIPHERAL_START, PERIPHERAL_END - PERIPHERAL_START,                             PERIPHERAL_START, 0b011, 0);
-    mmu_add_vma(t,        USER_SIGNAL_WRAPPER_VA,                            0x2000, (size_t)VIRT_TO_PHYS(signal_handler_wrapper), 0b101, 0);
+    // the image lives in anonymous frames so fork can share it copy-on-write
+    vm_area_struct_t *image = mmu_add_vma(t, USER_KERNEL_BASE, filesize, 0, 0b111, VMA_ANON);
+    mmu_add_vma(t, USER_STACK_BASE - USTACK_SIZE,                       USTACK_SIZE,                                         0, 0b111, VMA_ANON);
+    mmu_add_vma(t,              PERIPHERAL_START, PERIPHERAL_END - PERIPHERAL_START,                             PERIPHERAL_START, 0b011, VMA_FIXED);
+    mmu_add_vma(t,        USER_SIGNAL_WRAPPER_VA,                            0x2000, (size_t)VIRT_TO_PHYS(signal_handler_wrapper), 0b101, VMA_FIXED);
+    mmu_add_vma(t,                  USER_VDSO_VA,                            0x1000,                   (size_t)VIRT_TO_PHYS(vdso_data), 0b001, VMA_FIXED);
 
-    t->context.pgd = VIRT_TO_PHYS(t->context.pgd);
-    t->context.sp = USER_STACK_BASE;
-    t->context.fp = USER_STACK_BASE;
-    t->context.lr = USER_KERNEL_BASE;
-
-    //copy file into data
-    for (int i = 0; i < filesize;i++)
-    {
-        t->data[i] = data[i];
-    }
-
-    //disable echo when going to userspace
-    curr_thread = t;
-
-    vfs_open("/dev/uart", 0, &curr_thread->file_descriptors_table[0]);
-    vfs_open("/dev/uart", 0, &curr_thread->file_descriptors_table[1]);
-    vfs_open("/dev/uart", 0, &curr_thread->file_descriptors_table[2]);
-    
-    //disable echo when going to userspace
-    add_timer(schedule_timer, 1, "", 0);
-    // eret to exception level 0
-    asm("msr tpidr_el1, %0\n\t"
-        "msr elr_el1, %1\n\t"
-        "msr spsr_el1, xzr\n\t" // enable interrupt in EL0. You can do it by setting spsr_el1 to 0 before returning to EL0.
-        "msr sp_el0, %2\n\t"
-        "mov sp, %3\n\t"
-        "dsb ish\n\t"        // ensure write has completed
-        "msr ttbr0_el1, %4\n\t"
-        "tlbi vmalle1is\n\t" // invalidate all TLB entries
-        "dsb ish\n\t"        // ensure completion of TLB invalidatation
-        "isb\n\t"            // clear pipeline"
-        "eret\n\t" ::"r"(&t->context),"r"(t->context.lr), "r"(t->context.sp), "r"(t->kernel_stack_alloced_ptr + KSTACK_SIZE), "r"(t->context.pgd));
+    //copy file into the image
+    if (mmu_load_anon_pages(t, image, data, filesize))
+    {
+        uart_sendline("[Out of memory]: cannot load image\r\n");
+        unlock();
+        thread_free(t);
+        return -1;
+    }
+
+    vfs_open("/dev/uart", 0, &t->file_descriptors_table[0]);
+    vfs_open("/dev/uart", 0, &t->file_descriptors_table[1]);
+    vfs_open("/dev/uart", 0, &t->file_descriptors_table[2]);
+    unlock();
 
+    // the image replaces the shell: switch straight into it, thread_start_user erets to EL0.
+    // The shell's thread is done, its core's switch puts it on a zombie list.
+    unsigned long flags = local_irq_save();
+    struct rq *rq = this_rq();
+    spin_lock(&rq->lock);
+    t->state = THREAD_RUNNABLE;
+    t->vruntime = curr_thread->vruntime;
+    curr_thread->state = THREAD_ZOMBIE;
+    context_switch(rq, curr_thread, t);
+    local_irq_restore(flags);
     return 0;
 }
 
+// first switch into a spawned thread returns here: enter its image at EL0 with an empty kernel stack
+void thread_start_user()
+{
+    asm("msr daifset, 0xf\n\t"
+        "msr elr_el1, %0\n\t"
+        "msr spsr_el1, xzr\n\t" // interrupts enabled in EL0
+        "msr sp_el0, %1\n\t"
+        "mov sp, %2\n\t"
+        "eret\n\t" ::"r"(USER_KERNEL_BASE), "r"(USER_STACK_BASE), "r"(curr_thread->kernel_stack_alloced_ptr + KSTACK_SIZE));
+}
 
-//malloc a kstack and a userstack
-thread_t *thread_create(void *start, unsigned int filesize)
+//malloc a kstack and a userstack, the thread is not runnable until sched_enqueue. 0 when out of pids or memory.
+thread_t *thread_alloc(void *start)
 {
     lock();
 
-    thread_t *r;
-    for (int i = 0; i <= PIDMAX; i++)
+    int pid = pid_alloc();
+    thread_t *r = pid < 0 ? 0 : kmem_cache_alloc(thread_cache);
+    if (r && pid_attach(pid, r))
     {
-        if (!threads[i].isused)
-        {
-            r = &threads[i];
-            break;
-        }
+        kmem_cache_free(thread_cache, r);
+        r = 0;
     }
+    if (!r)
+    {
+        if (pid >= 0) pid_free(pid);
+        unlock();
+        return 0;
+    }
+    // any run queue may end up holding every thread
+    void *kstack = fair_reserve(nr_threads + 1) ? 0 : kmalloc(KSTACK_SIZE);
+    void *pgd = kstack ? kmalloc(0x1000) : 0;
+    if (!pgd)
+    {
+        if (kstack) kfree(kstack);
+        kmem_cache_free(thread_cache, r);
+        pid_free(pid);
+        unlock();
+        return 0;
+    }
+    nr_threads++;
+    memset(r, 0, sizeof(thread_t));
+    r->pid = pid;
+    list_add_tail(&r->thread_node, &thread_list);
     INIT_LIST_HEAD(&r->vma_list);
-    r->iszombie = 0;
-    r->isused = 1;
-    r->context.lr = (unsigned long long)start;
-    r->stack_alloced_ptr = kmalloc(USTACK_SIZE);
-    r->kernel_stack_alloced_ptr = kmalloc(KSTACK_SIZE);
+    INIT_LIST_HEAD(&r->listhead);
+    r->state = THREAD_NEW;
+    r->sched_class = &fair_sched_class;
+    r->policy = SCHED_NORMAL;
+    r->nice = 0;
+    r->rt_priority = 0;
+    r->weight = nice_to_weight(0);
+    r->vruntime = 0;
+    r->slice_exec = 0;
+    r->heap_idx = -1;
+    r->yield = 0;
+    r->rss = 0;
+    r->on_cpu = 0;
+    r->cpu = 0;
+    r->context.lr = (unsigned long long)ret_from_create;
+    r->context.x19 = (unsigned long long)start;  // ret_from_create calls it after schedule_tail
+    r->kernel_stack_alloced_ptr = kstack;
     r->signal_is_checking = 0;
-    r->data = kmalloc(filesize);
-    r->datasize = filesize;
+    INIT_LIST_HEAD(&r->sleep_wait);
+    timer_setup(&r->sleep_timer, sleep_timer_fire, r);
+    timer_setup(&r->itimer, itimer_fire, r);
+    r->itimer_interval = 0;
+    r->fpsimd_cpu = -1;
     r->context.sp = (unsigned long long)r->kernel_stack_alloced_ptr + KSTACK_SIZE;
     r->context.fp = r->context.sp;
     strcpy(r->curr_working_dir, "/"); //Lab7 Basic Exercise 3
 
-    r->context.pgd = kmalloc(0x1000);
+    r->context.pgd = pgd;
     memset(r->context.pgd, 0, 0x1000);
 
     //initial signal handler with signal_default_handler (kill thread)
@@ -160,20 +807,102 @@ thread_t *thread_create(void *start, unsigned int filesize)
         r->sigcount[i] = 0;
     }
 
-    list_add(&r->listhead, run_queue);
     unlock();
     return r;
 }
 
-void thread_exit(){
-    lock();
-    curr_thread->iszombie = 1;
-    unlock();
-    schedule();
+// the online core with the fewest runnable threads
+static struct rq *select_idlest_rq()
+{
+    struct rq *best = this_rq();
+    int min = rq_nr_running(best);
+    for (int cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        struct rq *rq = &runqueues[cpu];
+        if (!(cpu_online_mask & (1 << cpu))) continue;
+        int n = rq_nr_running(rq); // unlocked peek, only a placement hint
+        if (n < min)
+        {
+            min = n;
+            best = rq;
+        }
+    }
+    return best;
 }
 
-void schedule_timer(char* notuse){
-    unsigned long long cntfrq_el0;
-    __asm__ __volatile__("mrs %0, cntfrq_el0\n\t": "=r"(cntfrq_el0)); //tick frequency
-    add_timer(schedule_timer, cntfrq_el0 >> 5, "", 1);
+// publish a fully set up thread on the least loaded core
+void sched_enqueue(thread_t *t)
+{
+    unsigned long flags = local_irq_save();
+    struct rq *rq = select_idlest_rq();
+    spin_lock(&rq->lock);
+    t->cpu = rq->cpu;
+    t->state = THREAD_RUNNABLE;
+    enqueue_thread(rq, t, ENQUEUE_NEW);
+    int ipi = check_preempt(rq, t);
+    spin_unlock_irqrestore(&rq->lock, flags);
+    if (ipi) smp_send_ipi(rq->cpu, IPI_RESCHEDULE);
+}
+
+// a forked or spawned thread inherits the scheduling parameters, not the run time.
+// The child is not published yet, nothing else looks at it.
+void sched_fork(thread_t *child, thread_t *parent)
+{
+    child->sched_class = parent->sched_class;
+    child->policy = parent->policy;
+    child->nice = parent->nice;
+    child->rt_priority = parent->rt_priority;
+    child->weight = parent->weight;
+}
+
+// move t to the class of policy, -1 if the parameters do not fit it
+int sched_set_policy(thread_t *t, int policy, int rt_priority, int nice)
+{
+    if (policy == SCHED_NORMAL && rt_priority != 0) return -1;
+    if ((policy == SCHED_FIFO || policy == SCHED_RR) && (rt_priority < 1 || rt_priority >= RT_PRIO_MAX)) return -1;
+    if (policy != SCHED_NORMAL && policy != SCHED_FIFO && policy != SCHED_RR) return -1;
+    if (nice < NICE_MIN) nice = NICE_MIN;
+    if (nice > NICE_MAX) nice = NICE_MAX;
+
+    unsigned long flags = local_irq_save();
+    struct rq *rq = thread_rq_lock(t);
+    int queued = t->state == THREAD_RUNNABLE && !t->on_cpu && !is_idle_thread(t);
+    int ipi = 0;
+    if (queued) dequeue_thread(rq, t, 0);
+    // vruntime did not move in the rt class: start level with the fair queue, like a new thread
+    if (policy == SCHED_NORMAL && t->sched_class != &fair_sched_class) t->vruntime = rq->fair.min_vruntime;
+    t->sched_class = policy == SCHED_NORMAL ? &fair_sched_class : &rt_sched_class;
+    t->policy = policy;
+    t->rt_priority = rt_priority;
+    t->nice = nice;
+    t->weight = nice_to_weight(nice);
+    if (queued)
+    {
+        enqueue_thread(rq, t, 0);
+        ipi = check_preempt(rq, t);
+    }
+    else if (t == rq->curr)
+    {
+        rq->need_resched = 1; // may have dropped below a queued thread
+        ipi = rq != this_rq();
+    }
+    spin_unlock_irqrestore(&rq->lock, flags);
+    if (ipi) smp_send_ipi(rq->cpu, IPI_RESCHEDULE);
+    return 0;
+}
+
+thread_t *thread_create(void *start)
+{
+    thread_t *t = thread_alloc(start);
+    if (t) sched_enqueue(t);
+    return t;
+}
+
+void thread_exit(){
+    lockdep_assert_none_held("thread_exit");
+    unsigned long flags = local_irq_save();
+    struct rq *rq = this_rq();
+    spin_lock(&rq->lock);
+    rq->curr->state = THREAD_ZOMBIE;
+    __schedule(rq, flags); // never switched back in
 }
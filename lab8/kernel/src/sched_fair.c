@@ -0,0 +1,189 @@
+#include "sched.h"
+#include "memory.h"
+#include "timer.h"
+#include "string.h"
+#include "uart1.h"
+
+// Weighted fair class: a thread's vruntime grows by its run time scaled by NICE_0_WEIGHT / weight,
+// the queued thread with the smallest vruntime runs next. Queued threads sit in a binary min-heap
+// on vruntime per run queue, each thread remembers its index so it can be removed from the middle.
+
+// nice -20 ~ 19, every step is about 10% of CPU time against a nice 0 neighbour (same table as Linux)
+static const unsigned long prio_to_weight[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+     9548,  7620,  6100,  4904,  3906,
+     3121,  2501,  1991,  1586,  1277,
+     1024,   820,   655,   526,   423,
+      335,   272,   215,   172,   137,
+      110,    87,    70,    56,    45,
+       36,    29,    23,    18,    15,
+};
+
+#define FAIR_HEAP_MIN 64
+
+static unsigned long sched_latency;
+static unsigned long sched_min_gran;
+
+unsigned long nice_to_weight(int nice)
+{
+    return prio_to_weight[nice - NICE_MIN];
+}
+
+void fair_init(struct rq *rq)
+{
+    rq->fair.heap = kmalloc(FAIR_HEAP_MIN * sizeof(thread_t *));
+    if (!rq->fair.heap)
+    {
+        uart_sendline("[kernel panic] fair_init: no memory for the run queue heap\r\n");
+        while (1);
+    }
+    rq->fair.cap = FAIR_HEAP_MIN;
+    rq->fair.nr = 0;
+    rq->fair.load = 0;
+    rq->fair.min_vruntime = 0;
+    sched_latency = sched_ms_to_ticks(SCHED_LATENCY_MS);
+    unsigned long cntfrq_el0;
+    __asm__ __volatile__("mrs %0, cntfrq_el0\n\t" : "=r"(cntfrq_el0));
+    sched_min_gran = cntfrq_el0 >> SCHED_TICK_SHIFT;
+}
+
+// Room for n queued threads on every run queue, so enqueueing under rq->lock never allocates.
+// thread_alloc calls it for the number of threads that exist, the heaps grow by doubling like
+// the timer heap. -1 when memory runs out, the heaps keep what they had.
+int fair_reserve(int n)
+{
+    for (int cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        struct rq *rq = &runqueues[cpu];
+        while (rq->fair.cap < n)
+        {
+            int cap = rq->fair.cap * 2;
+            thread_t **bigger = kmalloc(cap * sizeof(thread_t *));
+            if (!bigger) return -1;
+            unsigned long flags = spin_lock_irqsave(&rq->lock);
+            thread_t **old = bigger;
+            if (rq->fair.cap < cap)
+            {
+                memcpy(bigger, rq->fair.heap, rq->fair.nr * sizeof(thread_t *));
+                old = rq->fair.heap;
+                rq->fair.heap = bigger;
+                rq->fair.cap = cap;
+            }
+            spin_unlock_irqrestore(&rq->lock, flags);
+            kfree(old);
+        }
+    }
+    return 0;
+}
+
+static inline void heap_set(struct fair_rq *fq, int i, thread_t *t)
+{
+    fq->heap[i] = t;
+    t->heap_idx = i;
+}
+
+static void heap_sift_up(struct fair_rq *fq, int i)
+{
+    thread_t *t = fq->heap[i];
+    while (i > 0 && fq->heap[(i - 1) / 2]->vruntime > t->vruntime)
+    {
+        heap_set(fq, i, fq->heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
+    }
+    heap_set(fq, i, t);
+}
+
+static void heap_sift_down(struct fair_rq *fq, int i)
+{
+    thread_t *t = fq->heap[i];
+    while (2 * i + 1 < fq->nr)
+    {
+        int c = 2 * i + 1;
+        if (c + 1 < fq->nr && fq->heap[c + 1]->vruntime < fq->heap[c]->vruntime) c++;
+        if (fq->heap[c]->vruntime >= t->vruntime) break;
+        heap_set(fq, i, fq->heap[c]);
+        i = c;
+    }
+    heap_set(fq, i, t);
+}
+
+static void fair_enqueue(struct rq *rq, thread_t *t, int flags)
+{
+    struct fair_rq *fq = &rq->fair;
+    if (flags & ENQUEUE_NEW)
+    {
+        t->vruntime = fq->min_vruntime;
+    }
+    else if (flags & ENQUEUE_MIGRATE)
+    {
+        // vruntime holds the lag behind the old queue's min_vruntime, see fair_dequeue
+        long lag = (long)t->vruntime;
+        t->vruntime = lag < 0 && (unsigned long)-lag > fq->min_vruntime ? 0 : fq->min_vruntime + lag;
+    }
+    else if (flags & ENQUEUE_WAKEUP)
+    {
+        // a sleeper gets ahead of the queue by half a period, but cannot bank what it slept through
+        unsigned long floor = fq->min_vruntime > sched_latency / 2 ? fq->min_vruntime - sched_latency / 2 : 0;
+        if (t->vruntime < floor) t->vruntime = floor;
+    }
+    heap_set(fq, fq->nr, t);
+    heap_sift_up(fq, fq->nr++);
+    fq->load += t->weight;
+}
+
+static void fair_dequeue(struct rq *rq, thread_t *t, int flags)
+{
+    struct fair_rq *fq = &rq->fair;
+    int i = t->heap_idx;
+    thread_t *last = fq->heap[--fq->nr];
+    fq->load -= t->weight;
+    t->heap_idx = -1;
+    // every queue has its own min_vruntime, a migrating thread keeps only its distance to it
+    if (flags & DEQUEUE_MIGRATE) t->vruntime -= fq->min_vruntime;
+    if (i == fq->nr) return;
+    // the last leaf fills the hole and moves whichever way its vruntime says
+    heap_set(fq, i, last);
+    heap_sift_up(fq, i);
+    heap_sift_down(fq, last->heap_idx);
+}
+
+static thread_t *fair_peek(struct rq *rq)
+{
+    return rq->fair.nr ? rq->fair.heap[0] : 0;
+}
+
+static int fair_preempts(thread_t *t, thread_t *curr)
+{
+    return t->vruntime < curr->vruntime;
+}
+
+static void fair_charge(struct rq *rq, thread_t *curr, unsigned long delta)
+{
+    struct fair_rq *fq = &rq->fair;
+    curr->vruntime += delta * NICE_0_WEIGHT / curr->weight;
+
+    unsigned long min = curr->vruntime;
+    if (fq->nr && fq->heap[0]->vruntime < min) min = fq->heap[0]->vruntime;
+    if (min > fq->min_vruntime) fq->min_vruntime = min;
+}
+
+// curr's share of the period goes by its weight against everything queued
+static int fair_tick(struct rq *rq, thread_t *curr)
+{
+    struct fair_rq *fq = &rq->fair;
+    if (!fq->nr) return 0;
+    unsigned long slice = sched_latency * curr->weight / (fq->load + curr->weight);
+    if (slice < sched_min_gran) slice = sched_min_gran;
+    return curr->slice_exec >= slice;
+}
+
+const struct sched_class fair_sched_class = {
+    .next     = 0,
+    .enqueue  = fair_enqueue,
+    .dequeue  = fair_dequeue,
+    .peek     = fair_peek,
+    .preempts = fair_preempts,
+    .charge   = fair_charge,
+    .tick     = fair_tick,
+};
@@ -0,0 +1,73 @@
+#include "sched.h"
+
+// Fixed priority class: one FIFO list per rt_priority and a bitmap of the non-empty ones per run
+// queue, so the highest queued priority is found with one count-leading-zeros per word.
+
+static unsigned long rr_slice;
+
+void rt_init(struct rq *rq)
+{
+    for (int prio = 0; prio < RT_PRIO_MAX; prio++)
+        INIT_LIST_HEAD(&rq->rt.queue[prio]);
+    for (int w = 0; w < RT_BITMAP_WORDS; w++)
+        rq->rt.bitmap[w] = 0;
+    rr_slice = sched_ms_to_ticks(SCHED_RR_SLICE_MS);
+}
+
+static void rt_enqueue(struct rq *rq, thread_t *t, int flags)
+{
+    struct rt_rq *rt = &rq->rt;
+    // a FIFO thread preempted by a higher priority goes back to the front of its list
+    if (t->policy == SCHED_FIFO && !(flags & (ENQUEUE_WAKEUP | ENQUEUE_NEW | ENQUEUE_YIELD | ENQUEUE_MIGRATE)))
+        list_add(&t->listhead, &rt->queue[t->rt_priority]);
+    else
+        list_add_tail(&t->listhead, &rt->queue[t->rt_priority]);
+    rt->bitmap[t->rt_priority / 64] |= 1UL << (t->rt_priority % 64);
+}
+
+static void rt_dequeue(struct rq *rq, thread_t *t, int flags)
+{
+    struct rt_rq *rt = &rq->rt;
+    list_del_entry(&t->listhead);
+    if (list_empty(&rt->queue[t->rt_priority]))
+        rt->bitmap[t->rt_priority / 64] &= ~(1UL << (t->rt_priority % 64));
+}
+
+static thread_t *rt_peek(struct rq *rq)
+{
+    struct rt_rq *rt = &rq->rt;
+    for (int w = RT_BITMAP_WORDS - 1; w >= 0; w--)
+    {
+        if (rt->bitmap[w])
+            return (thread_t *)rt->queue[w * 64 + 63 - __builtin_clzl(rt->bitmap[w])].next;
+    }
+    return 0;
+}
+
+static int rt_preempts(thread_t *t, thread_t *curr)
+{
+    return t->rt_priority > curr->rt_priority;
+}
+
+static void rt_charge(struct rq *rq, thread_t *curr, unsigned long delta)
+{
+}
+
+// round robin: hand over to the next thread of the same priority once the slice is used up
+static int rt_tick(struct rq *rq, thread_t *curr)
+{
+    if (curr->policy != SCHED_RR || curr->slice_exec < rr_slice || list_empty(&rq->rt.queue[curr->rt_priority]))
+        return 0;
+    curr->yield = 1; // to the back of its list
+    return 1;
+}
+
+const struct sched_class rt_sched_class = {
+    .next     = &fair_sched_class,
+    .enqueue  = rt_enqueue,
+    .dequeue  = rt_dequeue,
+    .peek     = rt_peek,
+    .preempts = rt_preempts,
+    .charge   = rt_charge,
+    .tick     = rt_tick,
+};
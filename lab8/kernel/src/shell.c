@@ -10,8 +10,11 @@
 #include "timer.h"
 #include "sched.h"
 #include "vfs.h"
+#include "bench.h"
+#include "memtrace.h"
+#include "mmu.h"
 
-#define CLI_MAX_CMD 11
+#define CLI_MAX_CMD 15
 
 extern int   uart_recv_echo_flag;
 extern char* dtb_ptr;
@@ -29,7 +32,11 @@ struct CLI_CMDS cmd_list[CLI_MAX_CMD]=
     {.command="setTimeout", .help="setTimeout [MESSAGE] [SECONDS]"},
     {.command="vfs", .help="test vfs"},
     {.command="initramfs", .help="test initramfs"},
-    {.command="reboot", .help="reboot the device"}
+    {.command="reboot", .help="reboot the device"},
+    {.command="bench", .help="bench [buddy|smp|sched|timer|switch|mem] run kernel micro benchmarks"},
+    {.command="slabinfo", .help="show slab cache statistics"},
+    {.command="memtrace", .help="memtrace [on|off|log|hist|clear] allocator trace (build with MEMTRACE=1)"},
+    {.command="ps", .help="list threads with resident and virtual memory size"}
 };
 
 void cli_cmd_clear(char* buffer, int length)
@@ -90,6 +97,14 @@ void cli_cmd_exec(char* buffer)
         do_cmd_initramfs();
     } else if (strcmp(cmd, "reboot") == 0) {
         do_cmd_reboot();
+    } else if (strcmp(cmd, "bench") == 0) {
+        do_cmd_bench(argvs);
+    } else if (strcmp(cmd, "slabinfo") == 0) {
+        do_cmd_slabinfo();
+    } else if (strcmp(cmd, "memtrace") == 0) {
+        do_cmd_memtrace(argvs);
+    } else if (strcmp(cmd, "ps") == 0) {
+        do_cmd_ps();
     }
 }
 
@@ -220,9 +235,26 @@ void do_cmd_ls(char* workdir)
     }
 }
 
+static void setTimeout_fire(void *msg)
+{
+    uart_sendline("%s\r\n", (char *)msg);
+    kfree(msg);
+}
+
 void do_cmd_setTimeout(char* msg, char* sec)
 {
-    add_timer(uart_sendline,atoi(sec),msg,0);
+    char *copy = kmalloc(strlen(msg) + 1); // the command buffer is reused before the timer fires
+    if (!copy)
+    {
+        uart_sendline("setTimeout: out of memory\r\n");
+        return;
+    }
+    strcpy(copy, msg);
+    if (add_timer(setTimeout_fire, copy, atoi(sec), 0))
+    {
+        uart_sendline("setTimeout: out of memory\r\n");
+        kfree(copy);
+    }
 }
 
 void do_cmd_vfs()
@@ -242,4 +274,42 @@ void do_cmd_reboot()
     *rst_addr = PM_PASSWORD | 0x20;
     volatile unsigned int* wdg_addr = (unsigned int*)PM_WDOG;
     *wdg_addr = PM_PASSWORD | 5;
+}
+
+void do_cmd_bench(char* name)
+{
+    bench_run(name);
+}
+
+void do_cmd_slabinfo()
+{
+    kmem_cache_dump_stats();
+}
+
+void do_cmd_memtrace(char* arg)
+{
+    memtrace_cmd(arg);
+}
+
+void do_cmd_ps()
+{
+    static const char *state_names[] = {"new   ", "run   ", "sleep ", "zombie"};
+    static const char *policy_names[] = {"other", "fifo ", "rr   "};
+    list_head_t *pos;
+    uart_sendline("  PID STATE  POL    NI PRI   RSS(KB)  VSZ(KB)\r\n");
+    lock();
+    list_head_t *tpos;
+    list_for_each(tpos, &thread_list)
+    {
+        thread_t *t = thread_list_entry(tpos);
+        unsigned long vsz = 0;
+        list_for_each(pos, &t->vma_list)
+        {
+            vm_area_struct_t *vma = (vm_area_struct_t *)pos;
+            if (vma->backing != VMA_FIXED) vsz += vma->area_size;
+        }
+        uart_sendline("%5d %s %s %3d %3d %9d %8d\r\n", t->pid, state_names[t->state], policy_names[t->policy],
+                      t->nice, t->rt_priority, (int)(t->rss * PAGESIZE / 1024), (int)(vsz / 1024));
+    }
+    unlock();
 }
\ No newline at end of file
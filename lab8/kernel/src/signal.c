@@ -62,6 +62,19 @@ void signal_handler_wrapper()
         "svc 0\n\t");
 }
 
+// ITIMER_REAL expired: SIGALRM to its thread, interval timers re-arm from the old deadline so they do not drift.
+// setitimer zeroes itimer_interval and waits this out with timer_cancel_sync before it arms anew.
+void itimer_fire(void *thread)
+{
+    thread_t *t = thread;
+    lock();
+    t->sigcount[SIGALRM]++;
+    unlock();
+    sched_signal_wake(t);
+    if (t->itimer_interval && timer_arm(&t->itimer, t->itimer.interrupt_time + t->itimer_interval))
+        t->itimer_interval = 0; // out of memory: the interval timer stops, this was its last SIGALRM
+}
+
 void signal_default_handler()
 {
     kill(0,curr_thread->pid);
@@ -0,0 +1,85 @@
+#include "smp.h"
+#include "sched.h"
+#include "memory.h"
+#include "timer.h"
+#include "exception.h"
+#include "uart1.h"
+#include "init.h"
+#include "cache.h"
+
+#define SMP_BOOT_TIMEOUT_US 100000
+
+unsigned long secondary_stack[NR_CPUS];
+volatile unsigned int cpu_online_mask = 1;  // core 0 runs main()
+
+// Release the cores the firmware parked in the spin table. Each one starts at
+// secondary_entry (boot.S) on the kernel stack of its own idle thread.
+void __init smp_init()
+{
+    for (int cpu = 1; cpu < NR_CPUS; cpu++)
+    {
+        thread_t *t = sched_create_idle(cpu);
+        t->on_cpu = 1; // its core runs it from secondary_entry
+        secondary_stack[cpu] = (unsigned long)t->kernel_stack_alloced_ptr + KSTACK_SIZE;
+    }
+    __asm__ __volatile__("dsb sy\n\t"); // stacks visible before any core can start
+    for (int cpu = 1; cpu < NR_CPUS; cpu++)
+        *(volatile unsigned long *)PHYS_TO_VIRT(SPIN_TABLE_BASE + 8 * cpu) = VIRT_TO_PHYS((unsigned long)secondary_entry);
+    dcache_clean_inval((void *)PHYS_TO_VIRT(SPIN_TABLE_BASE), 8 * NR_CPUS); // the parked cores read memory, caches off
+    __asm__ __volatile__("dsb sy\n\t"
+                         "sev\n\t");
+
+    unsigned long long cntfrq_el0, start, now;
+    __asm__ __volatile__("mrs %0, cntfrq_el0\n\t" : "=r"(cntfrq_el0));
+    __asm__ __volatile__("mrs %0, cntpct_el0\n\t" : "=r"(start));
+    do {
+        __asm__ __volatile__("mrs %0, cntpct_el0\n\t" : "=r"(now));
+    } while (cpu_online_mask != (1 << NR_CPUS) - 1 && now - start < cntfrq_el0 * SMP_BOOT_TIMEOUT_US / 1000000);
+
+    uart_sendline("SMP: %d of %d cores online\r\n", smp_num_online(), NR_CPUS);
+    *CORE_MAILBOX_IRQ_CTRL(0) = 1 << 0;  // core 0 takes IPIs too (timer reprogram, reschedule)
+}
+
+// C entry of a secondary core, MMU and vector table are already set up
+void secondary_main(int cpu)
+{
+    __asm__ __volatile__("msr tpidr_el1, %0\n\t" :: "r"(&idle_threads[cpu]->context));
+    fpsimd_init_cpu();
+
+    lock();
+    cpu_online_mask |= 1 << cpu;
+    unlock(); // leaves interrupts enabled
+
+    *CORE_MAILBOX_IRQ_CTRL(cpu) = 1 << 0;  // mailbox 0 raises an IRQ
+    local_tick_enable();
+    idle();
+}
+
+void smp_send_ipi(int cpu, int ipi)
+{
+    *CORE_MAILBOX_SET(cpu, 0) = 1 << ipi;
+}
+
+// new runnable work: idle cores sitting in wfi come and look for it
+void smp_send_reschedule_others()
+{
+    int self = smp_processor_id();
+    for (int cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        if (cpu != self && (cpu_online_mask & (1 << cpu)))
+            smp_send_ipi(cpu, IPI_RESCHEDULE);
+    }
+}
+
+void smp_handle_ipi(int cpu)
+{
+    unsigned int pending = *CORE_MAILBOX_CLR(cpu, 0);
+    *CORE_MAILBOX_CLR(cpu, 0) = pending;
+    if (pending & (1 << IPI_TIMER)) timer_handle_ipi();
+    if (pending & (1 << IPI_RESCHEDULE)) schedule();
+}
+
+int smp_num_online()
+{
+    return __builtin_popcount(cpu_online_mask);
+}
@@ -0,0 +1,54 @@
+#include "spinlock.h"
+#include "uart1.h"
+
+#if LOCKDEP
+
+#define LOCKDEP_MAX_HELD 8
+
+// locks held by each core in the order taken, interrupts are masked while any is held
+static spinlock_t *lockdep_held[NR_CPUS][LOCKDEP_MAX_HELD];
+static int         lockdep_depth[NR_CPUS];
+
+void lockdep_acquire(spinlock_t *lock)
+{
+    int cpu = smp_processor_id();
+    for (int i = 0; i < lockdep_depth[cpu]; i++)
+    {
+        spinlock_t *held = lockdep_held[cpu][i];
+        if (held == lock)
+            uart_sendline("[lockdep] cpu%d: recursive locking of %s\r\n", cpu, lock->name);
+        else if (held->rank >= lock->rank)
+            uart_sendline("[lockdep] cpu%d: %s taken while holding %s, lock order violation\r\n", cpu, lock->name, held->name);
+    }
+    if (lockdep_depth[cpu] == LOCKDEP_MAX_HELD)
+    {
+        uart_sendline("[lockdep] cpu%d: more than %d locks held, not tracking %s\r\n", cpu, LOCKDEP_MAX_HELD, lock->name);
+        return;
+    }
+    lockdep_held[cpu][lockdep_depth[cpu]++] = lock;
+}
+
+// locks may be released in any order
+void lockdep_release(spinlock_t *lock)
+{
+    int cpu = smp_processor_id();
+    for (int i = lockdep_depth[cpu] - 1; i >= 0; i--)
+    {
+        if (lockdep_held[cpu][i] != lock) continue;
+        for (; i < lockdep_depth[cpu] - 1; i++)
+            lockdep_held[cpu][i] = lockdep_held[cpu][i + 1];
+        lockdep_depth[cpu]--;
+        return;
+    }
+    uart_sendline("[lockdep] cpu%d: releasing %s which is not held\r\n", cpu, lock->name);
+}
+
+// sleeping or switching threads with a lock held hands it to whatever runs next on this core
+void lockdep_assert_none_held(const char *where)
+{
+    int cpu = smp_processor_id();
+    if (lockdep_depth[cpu])
+        uart_sendline("[lockdep] cpu%d: %s with %s held\r\n", cpu, where, lockdep_held[cpu][lockdep_depth[cpu] - 1]->name);
+}
+
+#endif
@@ -10,6 +10,8 @@
 #include "mmu.h"
 #include "string.h"
 #include "dev_framebuffer.h"
+#include "vdso.h"
+#include "cache.h"
 
 int getpid(trapframe_t* tpf)
 {
@@ -39,12 +41,58 @@ size_t uartwrite(trapframe_t *tpf,const char buf[], size_t size)
     return i;
 }
 
+// build a fresh user address space in t and read the image at abs_path into its frames, -1 when memory runs out.
+// The BKL is only held for the vma_list and page table changes compaction can see, never across the reads.
+static int load_image(thread_t *t, const char *abs_path, size_t filesize)
+{
+    lock();
+    vm_area_struct_t *image = mmu_add_vma(t, USER_KERNEL_BASE, filesize, 0, 0b111, VMA_ANON);
+    mmu_add_vma(t, USER_STACK_BASE - USTACK_SIZE,                       USTACK_SIZE,                                         0, 0b111, VMA_ANON);
+    mmu_add_vma(t,              PERIPHERAL_START, PERIPHERAL_END - PERIPHERAL_START,                             PERIPHERAL_START, 0b011, VMA_FIXED);
+    mmu_add_vma(t,        USER_SIGNAL_WRAPPER_VA,                            0x2000, (size_t)VIRT_TO_PHYS(signal_handler_wrapper), 0b101, VMA_FIXED);
+    mmu_add_vma(t,                  USER_VDSO_VA,                            0x1000,                   (size_t)VIRT_TO_PHYS(vdso_data), 0b001, VMA_FIXED);
+    unlock();
+
+    // -------Lab7------------
+    // read the image into frames nobody can see yet, each is mapped once it is complete
+    struct file *f;
+    vfs_open(abs_path, 0, &f);
+    for (size_t s = 0; s < filesize; s += 0x1000)
+    {
+        char *frame = kmalloc(0x1000);
+        if (!frame)
+        {
+            vfs_close(f);
+            return -1;
+        }
+        memset(frame, 0, 0x1000);
+        vfs_read(f, frame, filesize - s < 0x1000 ? filesize - s : 0x1000);
+        icache_sync(frame, 0x1000); // the image is code
+        lock();
+        map_one_page(PHYS_TO_VIRT(t->context.pgd), USER_KERNEL_BASE + s, VIRT_TO_PHYS((size_t)frame), mmu_vma_flags(image));
+        t->rss++;
+        unlock();
+    }
+    vfs_close(f);
+    //------------------------
+    return 0;
+}
+
+static void dup_file_descriptors(thread_t *dst, thread_t *src)
+{
+    for (int i = 0; i <= MAX_FD; i++)
+    {
+        if (src->file_descriptors_table[i])
+        {
+            dst->file_descriptors_table[i] = kmem_cache_alloc(file_cache);
+            *dst->file_descriptors_table[i] = *src->file_descriptors_table[i];
+        }
+    }
+}
+
 //In this lab, you won’t have to deal with argument passing
 int exec(trapframe_t *tpf,const char *name, char *const argv[])
 {
-    mmu_del_vma(curr_thread);
-    INIT_LIST_HEAD(&curr_thread->vma_list);
-
     // -------Lab7------------
     // use virtual file system
     char abs_path[MAX_PATH_NAME];
@@ -52,37 +100,34 @@ int exec(trapframe_t *tpf,const char *name, char *const argv[])
     get_absolute_path(abs_path, curr_thread->curr_working_dir);
 
     struct vnode *target_file;
-    vfs_lookup(abs_path,&target_file);
-    curr_thread->datasize = target_file->f_ops->getsize(target_file);
+    if (vfs_lookup(abs_path, &target_file) != 0)
+    {
+        tpf->x0 = -1;
+        return -1;
+    }
+    size_t filesize = target_file->f_ops->getsize(target_file);
     // ------------------------
-    
-    curr_thread->data = kmalloc(curr_thread->datasize);
-    curr_thread->stack_alloced_ptr = kmalloc(USTACK_SIZE);
 
-    asm("dsb ish\n\t");      // ensure write has completed
+    lock(); // compaction walks vma_list and the page tables once this thread is preempted
+    mmu_del_vma(curr_thread);
+    INIT_LIST_HEAD(&curr_thread->vma_list);
+
     mmu_free_page_tables(curr_thread->context.pgd, 0);
     memset(PHYS_TO_VIRT(curr_thread->context.pgd), 0, 0x1000);
-    asm("tlbi vmalle1is\n\t" // invalidate all TLB entries
-        "dsb ish\n\t"        // ensure completion of TLB invalidatation
-        "isb\n\t");          // clear pipeline
-
-    mmu_add_vma(curr_thread,              USER_KERNEL_BASE,             curr_thread->datasize, (size_t)VIRT_TO_PHYS(curr_thread->data)             , 0b111, 1);
-    mmu_add_vma(curr_thread, USER_STACK_BASE - USTACK_SIZE,                       USTACK_SIZE, (size_t)VIRT_TO_PHYS(curr_thread->stack_alloced_ptr), 0b111, 1);
-    mmu_add_vma(curr_thread,              PERIPHERAL_START, PERIPHERAL_END - PERIPHERAL_START,                                     PERIPHERAL_START, 0b011, 0);
-    mmu_add_vma(curr_thread,        USER_SIGNAL_WRAPPER_VA,                            0x2000,         (size_t)VIRT_TO_PHYS(signal_handler_wrapper), 0b101, 0);
+    mmu_flush_tlb_asid(curr_thread); // the old image's entries and cached table walks
+    unlock();
 
-    //memcpy(curr_thread->data, new_data, curr_thread->datasize);
-    // -------Lab7------------
-    struct file *f;
-    vfs_open(abs_path, 0, &f);
-    vfs_read(f, curr_thread->data, curr_thread->datasize);
-    vfs_close(f);
-    //------------------------
+    if (load_image(curr_thread, abs_path, filesize))
+    {
+        uart_sendline("[Out of memory]: Kill Process\r\n");
+        thread_exit();
+    }
 
     for (int i = 0; i <= SIGNAL_MAX; i++)
     {
         curr_thread->signal_handler[i] = signal_default_handler;
     }
+    fpsimd_flush(curr_thread);
 
 
     tpf->elr_el1 = USER_KERNEL_BASE;
@@ -91,10 +136,55 @@ int exec(trapframe_t *tpf,const char *name, char *const argv[])
     return 0;
 }
 
+// fork + exec in one step: the child is built straight from the file, nothing of the caller is copied
+// but its working directory and open files. argv is ignored like in exec.
+int spawn(trapframe_t *tpf, const char *name, char *const argv[])
+{
+    char abs_path[MAX_PATH_NAME];
+    strcpy(abs_path, name);
+    get_absolute_path(abs_path, curr_thread->curr_working_dir);
+
+    struct vnode *target_file;
+    if (vfs_lookup(abs_path, &target_file) != 0)
+    {
+        tpf->x0 = -1;
+        return -1;
+    }
+    size_t filesize = target_file->f_ops->getsize(target_file);
+
+    thread_t *newt = thread_alloc(thread_start_user);
+    if (!newt)
+    {
+        tpf->x0 = -1;
+        return -1;
+    }
+    // newt stays THREAD_NEW until sched_enqueue, compaction leaves it alone: no BKL across the reads
+    newt->context.pgd = VIRT_TO_PHYS(newt->context.pgd);
+    strcpy(newt->curr_working_dir, curr_thread->curr_working_dir);
+    dup_file_descriptors(newt, curr_thread);
+    if (load_image(newt, abs_path, filesize))
+    {
+        thread_free(newt); // never queued, give back what was loaded right away
+        tpf->x0 = -1;
+        return -1;
+    }
+    sched_fork(newt, curr_thread);
+    sched_enqueue(newt);
+
+    tpf->x0 = newt->pid;
+    return newt->pid;
+}
+
 int fork(trapframe_t *tpf)
 {
+    thread_t *newt = thread_alloc(0);
+    if (!newt)
+    {
+        tpf->x0 = -1;
+        return -1;
+    }
     lock();
-    thread_t *newt = thread_create(curr_thread->data,curr_thread->datasize);
+    newt->context.pgd = VIRT_TO_PHYS(newt->context.pgd); // anonymous pages get shared into it below
 
     //copy signal handler
     for (int i = 0; i <= SIGNAL_MAX;i++)
@@ -102,38 +192,39 @@ int fork(trapframe_t *tpf)
         newt->signal_handler[i] = curr_thread->signal_handler[i];
     }
 
-    for (int i = 0; i <= MAX_FD; i++)
-    {
-        if (curr_thread->file_descriptors_table[i])
-        {
-            newt->file_descriptors_table[i] = kmalloc(sizeof(struct file));
-            *newt->file_descriptors_table[i] = *curr_thread->file_descriptors_table[i];
-        }
-    }
+    dup_file_descriptors(newt, curr_thread);
 
     list_head_t *pos;
     vm_area_struct_t *vma;
     list_for_each(pos, &curr_thread->vma_list){
-        // ignore device and signal wrapper
+        // ignore device, signal wrapper and vdso page
         vma = (vm_area_struct_t *)pos;
-        if (vma->virt_addr == USER_SIGNAL_WRAPPER_VA || vma->virt_addr == PERIPHERAL_START)
+        if (vma->virt_addr == USER_SIGNAL_WRAPPER_VA || vma->virt_addr == PERIPHERAL_START || vma->virt_addr == USER_VDSO_VA)
         {
             continue;
         }
+        if (vma->backing == VMA_ANON)
+        {
+            mmu_add_vma(newt, vma->virt_addr, vma->area_size, 0, vma->rwx, VMA_ANON);
+            mmu_share_anon_pages(newt, curr_thread, vma);
+            continue;
+        }
         char *new_alloc = kmalloc(vma->area_size);
-        mmu_add_vma(newt, vma->virt_addr, vma->area_size, (size_t)VIRT_TO_PHYS(new_alloc), vma->rwx, 1);
+        mmu_add_vma(newt, vma->virt_addr, vma->area_size, (size_t)VIRT_TO_PHYS(new_alloc), vma->rwx, VMA_ALLOCED);
         memcpy(new_alloc, (void*)PHYS_TO_VIRT(vma->phys_addr), vma->area_size);
+        if (vma->rwx & (0b1 << 2)) icache_sync(new_alloc, vma->area_size);
     }
-    mmu_add_vma(newt,       PERIPHERAL_START, PERIPHERAL_END - PERIPHERAL_START,                             PERIPHERAL_START, 0b011, 0);
-    mmu_add_vma(newt, USER_SIGNAL_WRAPPER_VA,                            0x2000, (size_t)VIRT_TO_PHYS(signal_handler_wrapper), 0b101, 0);
+    mmu_add_vma(newt,       PERIPHERAL_START, PERIPHERAL_END - PERIPHERAL_START,                             PERIPHERAL_START, 0b011, VMA_FIXED);
+    mmu_add_vma(newt, USER_SIGNAL_WRAPPER_VA,                            0x2000, (size_t)VIRT_TO_PHYS(signal_handler_wrapper), 0b101, VMA_FIXED);
+    mmu_add_vma(newt,           USER_VDSO_VA,                            0x1000,                   (size_t)VIRT_TO_PHYS(vdso_data), 0b001, VMA_FIXED);
 
     int parent_pid = curr_thread->pid;
 
-    //copy stack into new process
-    for (int i = 0; i < KSTACK_SIZE; i++)
-    {
-        newt->kernel_stack_alloced_ptr[i] = curr_thread->kernel_stack_alloced_ptr[i];
-    }
+    //copy the live part of the kernel stack into new process, the child resumes in this frame
+    unsigned long sp;
+    asm volatile("mov %0, sp\n\t" : "=r"(sp));
+    unsigned long used = (unsigned long)curr_thread->kernel_stack_alloced_ptr + KSTACK_SIZE - sp;
+    memcpy(newt->kernel_stack_alloced_ptr + KSTACK_SIZE - used, (void *)sp, used);
 
     store_context(get_current());
     //for child
@@ -144,16 +235,21 @@ int fork(trapframe_t *tpf)
 
     void *temp_pgd = newt->context.pgd;
     newt->context = curr_thread->context;
-    newt->context.pgd = VIRT_TO_PHYS(temp_pgd);
+    newt->context.pgd = temp_pgd;
     newt->context.fp += newt->kernel_stack_alloced_ptr - curr_thread->kernel_stack_alloced_ptr; // move fp
     newt->context.sp += newt->kernel_stack_alloced_ptr - curr_thread->kernel_stack_alloced_ptr; // move kernel sp
+    fpsimd_fork(newt, curr_thread);
 
     unlock();
+    sched_fork(newt, curr_thread);
+    sched_enqueue(newt); // only now may another core switch into the copied context
 
     tpf->x0 = newt->pid;
     return newt->pid;
 
 child:
+    schedule_tail(); // switched in by schedule(), which holds the run queue lock
+    el1_interrupt_enable();
     tpf->x0 = 0;
     return 0;
 }
@@ -180,12 +276,13 @@ int syscall_mbox_call(trapframe_t *tpf, unsigned char ch, unsigned int *mbox_use
 void kill(trapframe_t *tpf,int pid)
 {
     lock();
-    if (pid >= PIDMAX || pid < 0  || !threads[pid].isused)
+    thread_t *t = find_thread(pid);
+    if (!t)
     {
         unlock();
         return;
     }
-    threads[pid].iszombie = 1;
+    sched_kill(t);
     unlock();
     schedule();
 }
@@ -199,10 +296,15 @@ void signal_register(int signal, void (*handler)())
 
 void signal_kill(int pid, int signal)
 {
-    if (pid > PIDMAX || pid < 0 || !threads[pid].isused)return;
+    if (signal > SIGNAL_MAX || signal < 0)return;
 
     lock();
-    threads[pid].sigcount[signal]++;
+    thread_t *t = find_thread(pid);
+    if (t)
+    {
+        t->sigcount[signal]++;
+        sched_signal_wake(t); // under the lock, t may be reaped right after it
+    }
     unlock();
 }
 
@@ -210,6 +312,7 @@ void signal_kill(int pid, int signal)
 void *mmap(trapframe_t *tpf, void *addr, size_t len, int prot, int flags, int fd, int file_offset)
 {
     // Ignore flags as we have demand pages
+    lock(); // vma_list is walked by compaction
 
     // Req #3 Page size round up
     len = len % 0x1000 ? len + (0x1000 - len % 0x1000) : len;
@@ -233,10 +336,12 @@ void *mmap(trapframe_t *tpf, void *addr, size_t len, int prot, int flags, int fd
     if (the_area_ptr)
     {
         tpf->x0 = (unsigned long) mmap(tpf, (void *)(the_area_ptr->virt_addr + the_area_ptr->area_size), len, prot, flags, fd, file_offset);
+        unlock();
         return (void *)tpf->x0;
     }
-    // create new valid region, map and set the page attributes (prot)
-    mmu_add_vma(curr_thread, (unsigned long)addr, len, VIRT_TO_PHYS((unsigned long)kmalloc(len)), prot, 1);
+    // create new valid region, frames are allocated and zeroed on first touch
+    mmu_add_vma(curr_thread, (unsigned long)addr, len, 0, prot, VMA_ANON);
+    unlock();
     tpf->x0 = (unsigned long)addr;
     return (void*)tpf->x0;
 }
@@ -375,6 +480,138 @@ int ioctl(trapframe_t *tpf, int fb, unsigned long request, void *info)
     return tpf->x0;
 }
 
+// add inc to the caller's nice value, returns the new one
+int nice(trapframe_t *tpf, int inc)
+{
+    thread_t *t = curr_thread;
+    sched_set_policy(t, t->policy, t->rt_priority, t->nice + inc);
+    tpf->x0 = t->nice;
+    return tpf->x0;
+}
+
+// pid 0 is the caller, the BKL keeps the thread from being reaped until the change is done
+static thread_t *sched_target_lock(int pid)
+{
+    lock();
+    if (pid == 0) return curr_thread;
+    return find_thread(pid);
+}
+
+int sched_setscheduler(trapframe_t *tpf, int pid, int policy, int priority)
+{
+    thread_t *t = sched_target_lock(pid);
+    tpf->x0 = t ? sched_set_policy(t, policy, priority, t->nice) : -1;
+    unlock();
+    schedule(); // may no longer be the best thread for this core
+    return tpf->x0;
+}
+
+int sched_setparam(trapframe_t *tpf, int pid, int priority)
+{
+    thread_t *t = sched_target_lock(pid);
+    tpf->x0 = t ? sched_set_policy(t, t->policy, priority, t->nice) : -1;
+    unlock();
+    schedule();
+    return tpf->x0;
+}
+
+static unsigned long long cntfrq()
+{
+    unsigned long long cntfrq_el0;
+    __asm__ __volatile__("mrs %0, cntfrq_el0\n\t" : "=r"(cntfrq_el0));
+    return cntfrq_el0;
+}
+
+// rounded up, a sleep never ends early
+static unsigned long long timespec_to_ticks(long sec, long nsec)
+{
+    unsigned long long freq = cntfrq();
+    return sec * freq + (nsec * freq + NSEC_PER_SEC - 1) / NSEC_PER_SEC;
+}
+
+static void ticks_to_timespec(unsigned long long ticks, struct timespec *ts)
+{
+    unsigned long long freq = cntfrq();
+    ts->tv_sec = ticks / freq;
+    ts->tv_nsec = (ticks % freq) * NSEC_PER_SEC / freq;
+}
+
+// -1 if a signal cut the sleep short, rem (may be 0) gets what was left of it
+int nanosleep(trapframe_t *tpf, const struct timespec *req, struct timespec *rem)
+{
+    if (req->tv_sec < 0 || req->tv_nsec < 0 || req->tv_nsec >= NSEC_PER_SEC)
+    {
+        tpf->x0 = -1;
+        return -1;
+    }
+    unsigned long long deadline = get_tick_plus_s(0) + timespec_to_ticks(req->tv_sec, req->tv_nsec);
+    tpf->x0 = sched_sleep_until(deadline);
+    if (rem)
+    {
+        unsigned long long now = get_tick_plus_s(0);
+        ticks_to_timespec(now < deadline ? deadline - now : 0, rem);
+    }
+    return tpf->x0;
+}
+
+// both clocks count cntpct from boot, there is no wall clock to set
+int clock_gettime(trapframe_t *tpf, int clockid, struct timespec *ts)
+{
+    if (clockid != CLOCK_REALTIME && clockid != CLOCK_MONOTONIC)
+    {
+        tpf->x0 = -1;
+        return -1;
+    }
+    ticks_to_timespec(get_tick_plus_s(0) - vdso_data->boot_cntpct, ts); // same base as the vdso page
+    tpf->x0 = 0;
+    return 0;
+}
+
+static void ticks_to_timeval(unsigned long long ticks, struct timeval *tv)
+{
+    unsigned long long freq = cntfrq();
+    tv->tv_sec = ticks / freq;
+    tv->tv_usec = (ticks % freq) * USEC_PER_SEC / freq;
+}
+
+// ITIMER_REAL only: SIGALRM after it_value, then every it_interval. A zero it_value disarms it.
+static int timeval_valid(const struct timeval *tv)
+{
+    return tv->tv_sec >= 0 && tv->tv_usec >= 0 && tv->tv_usec < USEC_PER_SEC;
+}
+
+int setitimer(trapframe_t *tpf, int which, const struct itimerval *new_value, struct itimerval *old_value)
+{
+    thread_t *t = curr_thread;
+    if (which != ITIMER_REAL || (new_value && (!timeval_valid(&new_value->it_value) || !timeval_valid(&new_value->it_interval))))
+    {
+        tpf->x0 = -1;
+        return -1;
+    }
+    unsigned long old_interval = t->itimer_interval;
+    t->itimer_interval = 0; // a firing timer must not re-arm itself past the cancel
+    int armed = timer_cancel_sync(&t->itimer); // itimer_fire on core 0 is done with the old interval too
+    if (old_value)
+    {
+        unsigned long long now = get_tick_plus_s(0);
+        unsigned long long left = armed && t->itimer.interrupt_time > now ? t->itimer.interrupt_time - now : 0;
+        ticks_to_timeval(left, &old_value->it_value);
+        ticks_to_timeval(old_interval, &old_value->it_interval);
+    }
+    if (new_value && (new_value->it_value.tv_sec || new_value->it_value.tv_usec))
+    {
+        t->itimer_interval = timespec_to_ticks(new_value->it_interval.tv_sec, new_value->it_interval.tv_usec * 1000);
+        if (timer_arm(&t->itimer, get_tick_plus_s(0) + timespec_to_ticks(new_value->it_value.tv_sec, new_value->it_value.tv_usec * 1000)))
+        {
+            t->itimer_interval = 0;
+            tpf->x0 = -1;
+            return -1;
+        }
+    }
+    tpf->x0 = 0;
+    return 0;
+}
+
 char* get_file_start(char *thefilepath)
 {
     char *filepath;
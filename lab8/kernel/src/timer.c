@@ -3,11 +3,28 @@
 #include "memory.h"
 #include "string.h"
 #include "exception.h"
+#include "spinlock.h"
+#include "smp.h"
 
 #define STR(x) #x
 #define XSTR(s) STR(s)
 
-struct list_head *timer_event_list;
+// Armed timers sit in a binary min-heap on interrupt_time, each remembers its index so it can be
+// cancelled or moved in O(log n). The array grows by doubling, arming never walks the others.
+#define TIMER_HEAP_MIN 64
+
+static timer_event_t **timer_heap;
+static int             timer_heap_nr;
+static int             timer_heap_cap;
+static kmem_cache_t   *timer_event_cache; // add_timer's one-shot events
+static spinlock_t timer_lock = SPINLOCK_INIT("timer", LOCK_RANK_TIMER); // timer_heap and core 0's cntp_cval
+static timer_event_t * volatile timer_running;  // event whose callback core 0 is in, for timer_cancel_sync
+
+// Tickless: each core's timer is programmed for whatever comes first of its next scheduler tick
+// and, on core 0, the first timer event. An idle core stops its tick, so with no events pending it
+// sleeps in wfi until an interrupt brings work.
+static unsigned long long tick_period;        // cntfrq_el0 >> SCHED_TICK_SHIFT
+static unsigned long long tick_next[NR_CPUS]; // cntpct of this core's next tick, 0: stopped
 
 void timer_list_init()
 {
@@ -16,8 +33,13 @@ void timer_list_init()
     tmp |= 1;
     asm volatile("msr cntkctl_el1, %0":: "r"(tmp));
 
-    timer_event_list = kmalloc(sizeof(list_head_t));
-    INIT_LIST_HEAD(timer_event_list);
+    unsigned long long cntfrq_el0;
+    asm volatile("mrs %0, cntfrq_el0": "=r"(cntfrq_el0));
+    tick_period = cntfrq_el0 >> SCHED_TICK_SHIFT;
+
+    timer_event_cache = kmem_cache_create("timer_event", sizeof(timer_event_t), CACHE_LINE_SIZE, 0);
+    timer_heap_cap = TIMER_HEAP_MIN;
+    timer_heap = kmalloc(timer_heap_cap * sizeof(timer_event_t *));
 }
 
 void core_timer_enable()
@@ -32,6 +54,14 @@ void core_timer_enable()
     :::"x1","x2");
 }
 
+// every core's timer drives its scheduler tick, only core 0's also serves timer events
+void local_tick_enable()
+{
+    tick_start();
+    __asm__ __volatile__("msr cntp_ctl_el0, %0\n\t" :: "r"(1UL)); // enable
+    *CORE_TIMER_IRQ_CTRL(smp_processor_id()) = 2;                  // unmask timer interrupt
+}
+
 void core_timer_disable()
 {
     __asm__ __volatile__(
@@ -41,82 +71,247 @@ void core_timer_disable()
     :::"x1","x2");
 }
 
-void timer_event_callback(timer_event_t *timer_event)
+static inline void timer_heap_set(int i, timer_event_t *timer)
 {
-    ((void (*)(char *))timer_event->callback)(timer_event->args); // call the callback store in event
-    list_del_entry((struct list_head *)timer_event);              // delete the event
-    kfree(timer_event->args); // kfree the arg space
-    kfree(timer_event);
+    timer_heap[i] = timer;
+    timer->heap_idx = i;
+}
 
-    //set interrupt to next time_event if existing
-    if (!list_empty(timer_event_list))
-    {
-        set_core_timer_interrupt_by_tick(((timer_event_t *)timer_event_list->next)->interrupt_time);
-    }
-    else
+static void timer_sift_up(int i)
+{
+    timer_event_t *timer = timer_heap[i];
+    while (i > 0 && timer_heap[(i - 1) / 2]->interrupt_time > timer->interrupt_time)
     {
-        set_core_timer_interrupt(10000); // disable timer interrupt (set a very big value)
+        timer_heap_set(i, timer_heap[(i - 1) / 2]);
+        i = (i - 1) / 2;
     }
+    timer_heap_set(i, timer);
 }
 
-void core_timer_handler()
+static void timer_sift_down(int i)
 {
-    lock();
-    //disable_interrupt();
-    if (list_empty(timer_event_list))
+    timer_event_t *timer = timer_heap[i];
+    while (2 * i + 1 < timer_heap_nr)
     {
-        set_core_timer_interrupt(10000); // disable timer interrupt (set a very big value)
-        unlock();
-        return;
+        int c = 2 * i + 1;
+        if (c + 1 < timer_heap_nr && timer_heap[c + 1]->interrupt_time < timer_heap[c]->interrupt_time) c++;
+        if (timer_heap[c]->interrupt_time >= timer->interrupt_time) break;
+        timer_heap_set(i, timer_heap[c]);
+        i = c;
     }
+    timer_heap_set(i, timer);
+}
 
-    timer_event_callback((timer_event_t *)timer_event_list->next); // do callback and set new interrupt
-    unlock();
+// timer_lock held: room for one more timer, -1 when the heap is full and cannot grow
+static int timer_heap_reserve()
+{
+    if (timer_heap_nr < timer_heap_cap) return 0;
+    timer_event_t **bigger = kmalloc(2 * timer_heap_cap * sizeof(timer_event_t *));
+    if (!bigger) return -1;
+    memcpy(bigger, timer_heap, timer_heap_cap * sizeof(timer_event_t *));
+    kfree(timer_heap);
+    timer_heap = bigger;
+    timer_heap_cap *= 2;
+    return 0;
 }
 
-// give a string argument to callback   timeout after seconds
-void add_timer(void *callback, unsigned long long timeout, char *args, int bytick)
+// timer_lock held, room reserved
+static void timer_heap_insert(timer_event_t *timer)
 {
-    timer_event_t *the_timer_event = kmalloc(sizeof(timer_event_t)); //need to kfree by event handler
+    timer_heap_set(timer_heap_nr, timer);
+    timer_sift_up(timer_heap_nr++);
+}
 
-    // store argument string into timer_event
-    the_timer_event->args = kmalloc(strlen(args) + 1);
-    strcpy(the_timer_event->args, args);
+// timer_lock held, timer armed
+static void timer_heap_remove(timer_event_t *timer)
+{
+    int i = timer->heap_idx;
+    timer_event_t *last = timer_heap[--timer_heap_nr];
+    timer->heap_idx = -1;
+    if (i == timer_heap_nr) return;
+    // the last leaf fills the hole and moves whichever way its deadline says
+    timer_heap_set(i, last);
+    timer_sift_up(i);
+    timer_sift_down(last->heap_idx);
+}
 
-    if(bytick == 0)
-    {
-        the_timer_event->interrupt_time = get_tick_plus_s(timeout); // store interrupt time into timer_event
-    }else
+// timer_lock held on core 0, interrupts masked: program this core's timer for its next tick or,
+// on core 0, the first event if that is earlier
+static void timer_reprogram()
+{
+    int cpu = smp_processor_id();
+    unsigned long long deadline = tick_next[cpu];
+    if (cpu == 0 && timer_heap_nr)
     {
-        the_timer_event->interrupt_time = get_tick_plus_s(0) + timeout;
+        unsigned long long first = timer_heap[0]->interrupt_time;
+        if (!deadline || first < deadline) deadline = first;
     }
+    if (deadline)
+        set_core_timer_interrupt_by_tick(deadline);
+    else
+        set_core_timer_interrupt_by_tick(~0UL); // nothing due: a compare value cntpct never reaches. A relative
+                                                // one would be cut to the signed 32-bit tval and fire at once
+}
 
-    the_timer_event->callback = callback;
+static void timer_reprogram_local()
+{
+    unsigned long flags = local_irq_save();
+    if (smp_processor_id() == 0) spin_lock(&timer_lock);
+    timer_reprogram();
+    if (smp_processor_id() == 0) spin_unlock(&timer_lock);
+    local_irq_restore(flags);
+}
 
-    // add the timer_event into timer_event_list (sorted)
-    struct list_head *curr;
+// this core runs a thread again: tick every tick_period from now
+void tick_start()
+{
+    unsigned long flags = local_irq_save();
+    tick_next[smp_processor_id()] = get_tick_plus_s(0) + tick_period;
+    timer_reprogram_local();
+    local_irq_restore(flags);
+}
+
+// this core goes idle: no more ticks until tick_start, only timer events (core 0) wake it
+void tick_stop()
+{
+    unsigned long flags = local_irq_save();
+    tick_next[smp_processor_id()] = 0;
+    timer_reprogram_local();
+    local_irq_restore(flags);
+}
+
+// timer interrupt on this core: 1 if the scheduler tick is due, the timer is re-armed either way
+int tick_handle()
+{
+    unsigned long flags = local_irq_save();
+    int cpu = smp_processor_id();
+    unsigned long long now = get_tick_plus_s(0);
+    int due = tick_next[cpu] && now >= tick_next[cpu];
+    if (due) tick_next[cpu] = now + tick_period;
+    timer_reprogram_local();
+    local_irq_restore(flags);
+    return due;
+}
 
-    lock();
-    list_for_each(curr, timer_event_list)
+// run every event that is due, one at a time off the heap so callbacks may arm timers
+void core_timer_handler()
+{
+    while (1)
     {
-        if (((timer_event_t *)curr)->interrupt_time > the_timer_event->interrupt_time)
+        unsigned long flags = spin_lock_irqsave(&timer_lock);
+        if (!timer_heap_nr || timer_heap[0]->interrupt_time > get_tick_plus_s(0))
         {
-            list_add(&the_timer_event->listhead, curr->prev); // add this timer at the place just before the bigger one (sorted)
-            break;
+            timer_reprogram(); // next event or tick
+            spin_unlock_irqrestore(&timer_lock, flags);
+            return;
         }
+        timer_event_t *timer = timer_heap[0];
+        timer_heap_remove(timer);
+        timer_callback_t callback = timer->callback;
+        void *ctx = timer->ctx;
+        int oneshot = timer->oneshot;
+        timer_running = timer;
+        spin_unlock_irqrestore(&timer_lock, flags);
+
+        if (oneshot) kmem_cache_free(timer_event_cache, timer); // the callback may re-arm a caller's own timer, not this
+        callback(ctx);
+        timer_running = 0;
+    }
+}
+
+// IPI_TIMER: another core changed the head of the heap, only core 0 owns the event timer
+void timer_handle_ipi()
+{
+    unsigned long flags = spin_lock_irqsave(&timer_lock);
+    timer_reprogram();
+    spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+void timer_setup(timer_event_t *timer, timer_callback_t callback, void *ctx)
+{
+    timer->callback = callback;
+    timer->ctx = ctx;
+    timer->heap_idx = -1;
+    timer->oneshot = 0;
+}
+
+// timer_lock held: core 0 programs its timer for a new first deadline, others ask it to. 1 if core 0
+// must be sent IPI_TIMER once the lock is dropped.
+static int timer_head_changed()
+{
+    if (smp_processor_id() == 0)
+    {
+        timer_reprogram();
+        return 0;
     }
+    return 1;
+}
 
-    if (list_is_head(curr, timer_event_list))
+// fire at cntpct tick expires, an armed timer moves to the new deadline. -1 if the heap could not
+// grow for a timer that was not armed, it stays unarmed then.
+int timer_arm(timer_event_t *timer, unsigned long long expires)
+{
+    unsigned long flags = spin_lock_irqsave(&timer_lock);
+    if (timer->heap_idx < 0 && timer_heap_reserve())
     {
-        list_add_tail(&the_timer_event->listhead, timer_event_list); // for the time is the biggest
+        spin_unlock_irqrestore(&timer_lock, flags);
+        return -1;
     }
+    int was_first = timer->heap_idx == 0;
+    if (timer->heap_idx >= 0) timer_heap_remove(timer);
+    timer->interrupt_time = expires;
+    timer_heap_insert(timer);
+    int remote = (was_first || timer->heap_idx == 0) && timer_head_changed();
+    spin_unlock_irqrestore(&timer_lock, flags);
+    if (remote) smp_send_ipi(0, IPI_TIMER);
+    return 0;
+}
 
+// 1 if the timer was armed and now will not fire, 0 if it already fired (its callback may be running)
+int timer_cancel(timer_event_t *timer)
+{
+    unsigned long flags = spin_lock_irqsave(&timer_lock);
+    if (timer->heap_idx < 0)
+    {
+        spin_unlock_irqrestore(&timer_lock, flags);
+        return 0;
+    }
+    // cancelling the first one only makes core 0 wake early once, it finds nothing due and re-arms
+    timer_heap_remove(timer);
+    spin_unlock_irqrestore(&timer_lock, flags);
+    return 1;
+}
 
-    // set interrupt to first event
-    set_core_timer_interrupt_by_tick(((timer_event_t *)timer_event_list->next)->interrupt_time);
-    unlock();
+// timer_cancel that also waits out a callback already running on core 0, after it the timer and its
+// ctx may be freed. Not from the callback itself. A callback that re-arms its timer must be told to
+// stop first, it may still do so once more.
+int timer_cancel_sync(timer_event_t *timer)
+{
+    int pending = 0;
+    do
+    {
+        pending |= timer_cancel(timer);
+        while (timer_running == timer);
+    } while (timer->heap_idx >= 0); // the callback armed it again
+    return pending;
 }
 
+// fire-and-forget: callback(ctx) after timeout seconds (bytick: cntpct ticks), the event is freed before
+// the callback runs. Use timer_setup/timer_arm for a timer that may need cancelling. -1 when out of
+// memory, the callback will not run.
+int add_timer(timer_callback_t callback, void *ctx, unsigned long long timeout, int bytick)
+{
+    timer_event_t *timer = kmem_cache_alloc(timer_event_cache);
+    if (!timer) return -1;
+    timer_setup(timer, callback, ctx);
+    timer->oneshot = 1;
+    if (timer_arm(timer, bytick ? get_tick_plus_s(0) + timeout : get_tick_plus_s(timeout)))
+    {
+        kmem_cache_free(timer_event_cache, timer);
+        return -1;
+    }
+    return 0;
+}
 
 // get cpu tick add some second
 unsigned long long get_tick_plus_s(unsigned long long second)
@@ -151,13 +346,7 @@ void set_core_timer_interrupt_by_tick(unsigned long long tick)
         :: "r"(tick));
 }
 
-int timer_list_get_size()
+int timer_count()
 {
-    int r = 0;
-    struct list_head *curr;
-    list_for_each(curr, timer_event_list)
-    {
-        r++;
-    }
-    return r;
+    return timer_heap_nr;
 }
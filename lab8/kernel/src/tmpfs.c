@@ -6,10 +6,12 @@
 
 struct file_operations tmpfs_file_operations = {tmpfs_write,tmpfs_read,tmpfs_open,tmpfs_close,tmpfs_lseek64,tmpfs_getsize};
 struct vnode_operations tmpfs_vnode_operations = {tmpfs_lookup,tmpfs_create,tmpfs_mkdir};
+kmem_cache_t *tmpfs_inode_cache;
 
 int register_tmpfs()
 {
     struct filesystem fs;
+    tmpfs_inode_cache = kmem_cache_create("tmpfs_inode", sizeof(struct tmpfs_inode), CACHE_LINE_SIZE, 0);
     fs.name = "tmpfs";
     fs.setup_mount = tmpfs_setup_mount; //set tmpfs.setup_mount to func(tmpfs_setup_mount) for later use
     return register_filesystem(&fs);
@@ -25,11 +27,11 @@ int tmpfs_setup_mount(struct filesystem *fs, struct mount *_mount)
 
 struct vnode* tmpfs_create_vnode(struct mount* _mount, enum fsnode_type type)
 {
-    struct vnode *v = kmalloc(sizeof(struct vnode));
+    struct vnode *v = kmem_cache_alloc(vnode_cache);
     v->f_ops = &tmpfs_file_operations;
     v->v_ops = &tmpfs_vnode_operations;
     v->mount = 0;
-    struct tmpfs_inode* inode = kmalloc(sizeof(struct tmpfs_inode));
+    struct tmpfs_inode* inode = kmem_cache_alloc(tmpfs_inode_cache);
     memset(inode, 0, sizeof(struct tmpfs_inode));
     inode->type = type; // dir_t
     inode->data = kmalloc(0x1000); // 4KB
@@ -102,7 +104,7 @@ int tmpfs_open(struct vnode *file_node, struct file **target)
 
 int tmpfs_close(struct file *file)
 {
-    kfree(file);
+    kmem_cache_free(file_cache, file);
     return 0;
 }
 
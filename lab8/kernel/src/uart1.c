@@ -4,6 +4,7 @@
 #include "uart1.h"
 #include "exception.h"
 #include "string.h"
+#include "sched.h"
 
 //implement first in first out buffer with a read index and a write index
 char uart_tx_buffer[VSPRINT_MAX_BUF_SIZE]={};
@@ -15,6 +16,13 @@ unsigned int uart_rx_buffer_ridx = 0;
 
 int uart_recv_echo_flag = 1;
 
+// readers sleep while rx is empty, writers while tx is full, the irq handlers wake them
+static LIST_HEAD(uart_rx_wait);
+static LIST_HEAD(uart_tx_wait);
+
+#define UART_RX_EMPTY() (uart_rx_buffer_ridx == uart_rx_buffer_widx)
+#define UART_TX_FULL()  ((uart_tx_buffer_widx + 1) % VSPRINT_MAX_BUF_SIZE == uart_tx_buffer_ridx)
+
 void uart_init()
 {
     register unsigned int r;
@@ -96,12 +104,19 @@ int  uart_sendline(char* fmt, ...) {
 // uart_r_irq_handler write to buffer then output
 char uart_async_getc() {
     *AUX_MU_IER_REG |=1; // enable read interrupt
-    // do while if buffer empty
-    while (uart_rx_buffer_ridx == uart_rx_buffer_widx) *AUX_MU_IER_REG |=1; // enable read interrupt
-    lock();
+    // sleep while buffer empty, a killed reader gets 0. Another core's reader may take the byte between
+    // the wakeup and lock(), check again under it.
+    while (1)
+    {
+        if (!wait_event(&uart_rx_wait, !UART_RX_EMPTY())) return 0;
+        lock();
+        if (!UART_RX_EMPTY()) break;
+        unlock();
+    }
     char r = uart_rx_buffer[uart_rx_buffer_ridx++];
     if (uart_rx_buffer_ridx >= VSPRINT_MAX_BUF_SIZE) uart_rx_buffer_ridx = 0;
     unlock();
+    *AUX_MU_IER_REG |=1; // room again if uart_r_irq_handler stopped on a full buffer
     return r;
 }
 
@@ -109,9 +124,15 @@ char uart_async_getc() {
 // uart_async_putc writes to buffer
 // uart_w_irq_handler read from buffer then output
 void uart_async_putc(char c) {
-    // if buffer full, wait for uart_w_irq_handler
-    while( (uart_tx_buffer_widx + 1) % VSPRINT_MAX_BUF_SIZE == uart_tx_buffer_ridx )  *AUX_MU_IER_REG |=2;  // enable write interrupt
-    lock();
+    // if buffer full, sleep until uart_w_irq_handler drains some
+    *AUX_MU_IER_REG |=2;  // enable write interrupt
+    while (1)
+    {
+        if (!wait_event(&uart_tx_wait, !UART_TX_FULL())) return;
+        lock();
+        if (!UART_TX_FULL()) break; // another core's writer took the slot first
+        unlock();
+    }
     uart_tx_buffer[uart_tx_buffer_widx++] = c;
     if(uart_tx_buffer_widx >= VSPRINT_MAX_BUF_SIZE) uart_tx_buffer_widx=0;  // cycle pointer
     unlock();
@@ -156,6 +177,7 @@ void uart_r_irq_handler(){
     }
     uart_rx_buffer[uart_rx_buffer_widx++] = uart_recv();
     if(uart_rx_buffer_widx>=VSPRINT_MAX_BUF_SIZE) uart_rx_buffer_widx=0;
+    wake_up(&uart_rx_wait); // every time: a reader on another core may have just emptied the ring and gone to sleep
     *AUX_MU_IER_REG |=1;
 }
 
@@ -167,6 +189,7 @@ void uart_w_irq_handler(){
     }
     uart_send(uart_tx_buffer[uart_tx_buffer_ridx++]);
     if(uart_tx_buffer_ridx>=VSPRINT_MAX_BUF_SIZE) uart_tx_buffer_ridx=0;
+    wake_up(&uart_tx_wait); // every time, same as the read side
     *AUX_MU_IER_REG |=2;  // enable write interrupt
 }
 
@@ -0,0 +1,21 @@
+#include "vdso.h"
+#include "memory.h"
+#include "string.h"
+#include "timer.h"
+
+struct vdso_data *vdso_data;
+
+// after timer_list_init, before the first process is built: every address space maps this page
+void vdso_init()
+{
+    vdso_data = kmalloc(0x1000); // a whole frame, nothing else of the kernel shows through the mapping
+    memset(vdso_data, 0, 0x1000);
+
+    unsigned long cntfrq;
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(cntfrq));
+    vdso_data->version = VDSO_VERSION;
+    vdso_data->nr_cpus = NR_CPUS;
+    vdso_data->cntfrq = cntfrq;
+    vdso_data->boot_cntpct = get_tick_plus_s(0);
+    vdso_data->tick_period = cntfrq >> SCHED_TICK_SHIFT;
+}
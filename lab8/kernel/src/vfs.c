@@ -6,10 +6,19 @@
 #include "initramfs.h"
 #include "dev_uart.h"
 #include "dev_framebuffer.h"
+#include "spinlock.h"
 
 struct mount *rootfs;
 struct filesystem reg_fs[MAX_FS_REG];
 struct file_operations reg_dev[MAX_DEV_REG];
+kmem_cache_t *file_cache;
+kmem_cache_t *vnode_cache;
+
+// Namespace lock: lookup, create, mkdir and mount walk and change the vnode tree. Reads and writes
+// go straight to the file's f_ops without it, a device read may wait for an interrupt.
+static spinlock_t vfs_lock = SPINLOCK_INIT("vfs", LOCK_RANK_VFS);
+
+static int vfs_lookup_locked(const char *pathname, struct vnode **target);
 
 // register the file system to the kernel.
 int register_filesystem(struct filesystem *fs)
@@ -58,8 +67,9 @@ int vfs_open(const char *pathname, int flags, struct file **target)
     // 1. Lookup pathname
     // 3. Create a new file if O_CREAT is specified in flags and vnode not found
     struct vnode *node;
+    unsigned long irqflags = spin_lock_irqsave(&vfs_lock);
     // if pathname not found and have set O_CREAT
-    if (vfs_lookup(pathname, &node) != 0 && (flags & O_CREAT))
+    if (vfs_lookup_locked(pathname, &node) != 0 && (flags & O_CREAT))
     {
         int last_slash_idx = 0;
         for (int i = 0; i < strlen(pathname); i++)
@@ -74,23 +84,26 @@ int vfs_open(const char *pathname, int flags, struct file **target)
         strcpy(dirname, pathname);
         dirname[last_slash_idx] = 0;
         // dirname = /lll/ddd
-        if (vfs_lookup(dirname,&node)!=0)
+        if (vfs_lookup_locked(dirname,&node)!=0)
         {
+            spin_unlock_irqrestore(&vfs_lock, irqflags);
             uart_sendline("cannot ocreate no dir name\r\n");
             return -1;
         }
         // pathname+last_slash_idx+1 = ggg
         node->v_ops->create(node, &node, pathname+last_slash_idx+1);
-        *target = kmalloc(sizeof(struct file));
+        *target = kmem_cache_alloc(file_cache);
         node->f_ops->open(node, target);
         (*target)->flags = flags;
+        spin_unlock_irqrestore(&vfs_lock, irqflags);
         return 0;
     }
     else // 2. Create a new file handle for this vnode if found.
     {
-        *target = kmalloc(sizeof(struct file));
+        *target = kmem_cache_alloc(file_cache);
         node->f_ops->open(node, target);
         (*target)->flags = flags;
+        spin_unlock_irqrestore(&vfs_lock, irqflags);
         return 0;
     }
 
@@ -142,11 +155,14 @@ int vfs_mkdir(const char *pathname)
     strcpy(newdirname, pathname + last_slash_idx + 1);
 
     struct vnode *node;
-    if(vfs_lookup(dirname,&node)==0)
+    unsigned long flags = spin_lock_irqsave(&vfs_lock);
+    if(vfs_lookup_locked(dirname,&node)==0)
     {
         node->v_ops->mkdir(node,&node,newdirname);
+        spin_unlock_irqrestore(&vfs_lock, flags);
         return 0;
     }
+    spin_unlock_irqrestore(&vfs_lock, flags);
 
     uart_sendline("vfs_mkdir cannot find pathname");
     return -1;
@@ -163,23 +179,36 @@ int vfs_mount(const char *target, const char *filesystem)
         return -1;
     }
 
-    if(vfs_lookup(target, &dirnode)==-1)
+    unsigned long flags = spin_lock_irqsave(&vfs_lock);
+    if(vfs_lookup_locked(target, &dirnode)==-1)
     {
+        spin_unlock_irqrestore(&vfs_lock, flags);
         uart_sendline("vfs_mount cannot find dir\r\n");
         return -1;
     }else
     {
-        // malloc a mount space for /ddd
-        dirnode->mount = kmalloc(sizeof(struct mount));
+        // malloc a mount space for /ddd, set up before lookups can cross into it
+        struct mount *mnt = kmalloc(sizeof(struct mount));
         // set fs's mount at /ddd
-        fs->setup_mount(fs, dirnode->mount);
+        fs->setup_mount(fs, mnt);
+        dirnode->mount = mnt;
     }
+    spin_unlock_irqrestore(&vfs_lock, flags);
     return 0;
 }
 
 // lookup specify pathname's vnode
 // e.x. vfs_lookup("/foo/abc", &dir_node);
 int vfs_lookup(const char *pathname, struct vnode **target)
+{
+    unsigned long flags = spin_lock_irqsave(&vfs_lock);
+    int r = vfs_lookup_locked(pathname, target);
+    spin_unlock_irqrestore(&vfs_lock, flags);
+    return r;
+}
+
+// vfs_lock held
+static int vfs_lookup_locked(const char *pathname, struct vnode **target)
 {
     if(strlen(pathname)==0)
     {
@@ -227,7 +256,7 @@ int vfs_lookup(const char *pathname, struct vnode **target)
 
 int vfs_mknod(char* pathname, int id)
 {
-    struct file* f = kmalloc(sizeof(struct file));
+    struct file* f;
     //create file
     vfs_open(pathname, O_CREAT, &f);
     f->vnode->f_ops = &reg_dev[id];
@@ -237,6 +266,9 @@ int vfs_mknod(char* pathname, int id)
 
 void init_rootfs()
 {
+    file_cache = kmem_cache_create("file", sizeof(struct file), 0, 0);
+    vnode_cache = kmem_cache_create("vnode", sizeof(struct vnode), 0, 0);
+
     int idx = register_tmpfs(); // register tmpfs filesystem
     rootfs = kmalloc(sizeof(struct mount)); // malloc rootfs's mount structure
     reg_fs[idx].setup_mount(&reg_fs[idx], rootfs); // mount tmpfs on rootfs